@@ -15,7 +15,11 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/shared_array.hpp>
 
+#include <climits>
+#include <cmath>
 #include <cstring>
+#include <string>
+#include <vector>
 
 #include "flandmark_detector.h"
 
@@ -44,8 +48,14 @@ static auto s_class = bob::extension::ClassDoc(
           "Constructor",
           "Initializes the key-point locator with a model."
           )
-        .add_prototype("[model]", "")
+        .add_prototype("[model], [single_precision], [quantized], [coarse_to_fine], [branch_and_bound], [threads], [interpolation]", "")
         .add_parameter("model", "str (path), optional", "Path to the localization model. If not set (or set to ``None``), then use the default localization model, stored on the class variable ``__default_model__``)")
+        .add_parameter("single_precision", "bool, optional", "If ``True``, scores are computed in 32-bit floats, which is faster; key-points may then differ from the ones of the default double precision mode by up to one pixel of the normalized face frame")
+        .add_parameter("quantized", "bool, optional", "If ``True``, scores are computed in fixed point from 16-bit weights, read from the model path with the ``.q16`` extension appended when that file exists and matches the model (see :py:meth:`save_quantized`), which is faster and needs less memory than ``single_precision``; the same tolerance applies. Overrides ``single_precision``")
+        .add_parameter("coarse_to_fine", "bool, optional", "If ``True``, key-points are first searched on every second position of their search regions and then refined around the best one, which is faster; the exhaustive search is run instead when the refined key-points may not be the optimal ones (see :py:attr:`coarse_to_fine_stats`), otherwise they may differ from the exhaustive ones")
+        .add_parameter("branch_and_bound", "bool, optional", "If ``True``, the deformations of the face center are only solved at positions that can still beat the best one found, which is usually faster; the key-points are the same")
+        .add_parameter("threads", "int, optional", "If positive, the number of additional threads on which each localization scores the key-points and solves the branches of the model in parallel, which lowers the latency of a single face on an otherwise idle machine; the key-points are the same. By default, each localization runs on the calling thread only")
+        .add_parameter("interpolation", "str, optional", "How the face is resampled into the normalized face frame: ``'cubic'`` (the default, which the models are trained with), ``'bilinear'``, which is cheaper, or ``'area'``, which averages all pixels of faces larger than the frame and is the most expensive for them (smaller faces are interpolated from 2x2 pixels, as OpenCV's ``INTER_AREA`` does). Both other modes move the key-points somewhat; the ``bob_ip_flandmark_interpolation.py`` script measures by how much")
         )
     ;
 
@@ -53,19 +63,40 @@ typedef struct {
   PyObject_HEAD
   FLANDMARK_Model* flandmark;
   char* filename;
+  std::vector<FLANDMARK_Context*>* contexts; ///< idle per-call buffers, guarded by the GIL
+  int flags; ///< FLANDMARK_COARSE_TO_FINE and FLANDMARK_BRANCH_AND_BOUND
+  FLANDMARK_ThreadPool* threads; ///< shared by all contexts, 0 if not requested
+  int interpolation; ///< of the normalized frame, FLANDMARK_INTER_CUBIC by default
 } PyBobIpFlandmarkObject;
 
+static const char* const s_interpolations[] = {"cubic", "bilinear", "area", 0}; ///< indexed by FLANDMARK_INTER_*
+
 static int PyBobIpFlandmark_init
 (PyBobIpFlandmarkObject* self, PyObject* args, PyObject* kwds) {
 
   /* Parses input arguments in a single shot */
-  static const char* const_kwlist[] = {"model", 0};
+  static const char* const_kwlist[] = {"model", "single_precision", "quantized", "coarse_to_fine", "branch_and_bound", "threads", "interpolation", 0};
   static char** kwlist = const_cast<char**>(const_kwlist);
 
   PyObject* model = 0;
-
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O&", kwlist,
-        &PyBobIo_FilenameConverter, &model)) return -1;
+  PyObject* single_precision = Py_False;
+  PyObject* quantized = Py_False;
+  PyObject* coarse_to_fine = Py_False;
+  PyObject* branch_and_bound = Py_False;
+  int threads = 0;
+  const char* interpolation = s_interpolations[FLANDMARK_INTER_CUBIC];
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O&OOOOis", kwlist,
+        &PyBobIo_FilenameConverter, &model, &single_precision, &quantized, &coarse_to_fine, &branch_and_bound, &threads, &interpolation)) return -1;
+
+  self->interpolation = -1;
+  for (int k = 0; s_interpolations[k]; ++k)
+    if (!strcmp(interpolation, s_interpolations[k])) self->interpolation = k;
+  if (self->interpolation < 0) {
+    Py_XDECREF(model);
+    PyErr_Format(PyExc_ValueError, "`%s' interpolation must be one of 'cubic', 'bilinear' or 'area', not '%s'", Py_TYPE(self)->tp_name, interpolation);
+    return -1;
+  }
 
   if (!model) { //use what is stored in __default_model__
     PyObject* default_model = PyObject_GetAttrString((PyObject*)self,
@@ -93,7 +124,17 @@ static int PyBobIpFlandmark_init
   //now we have a filename we can use
   if (!c_filename) return -1;
 
-  self->flandmark = flandmark_init(c_filename);
+  int single = PyObject_IsTrue(single_precision);
+  if (single < 0) return -1;
+  int fixed = PyObject_IsTrue(quantized);
+  if (fixed < 0) return -1;
+  int c2f = PyObject_IsTrue(coarse_to_fine);
+  if (c2f < 0) return -1;
+  int bnb = PyObject_IsTrue(branch_and_bound);
+  if (bnb < 0) return -1;
+  self->flags = (c2f ? FLANDMARK_COARSE_TO_FINE : 0) | (bnb ? FLANDMARK_BRANCH_AND_BOUND : 0);
+
+  self->flandmark = flandmark_init(c_filename, (single ? FLANDMARK_SINGLE_PRECISION : 0) | (fixed ? FLANDMARK_QUANTIZED : 0));
   if (!self->flandmark) {
     PyErr_Format(PyExc_RuntimeError, "`%s' could not initialize from model file `%s'", Py_TYPE(self)->tp_name, c_filename);
     return -1;
@@ -102,12 +143,33 @@ static int PyBobIpFlandmark_init
   //flandmark is now initialized, set filename
   self->filename = strndup(c_filename, 256);
 
+  //contexts are created on demand, one per concurrent call
+  self->contexts = new std::vector<FLANDMARK_Context*>();
+
+  //worker threads, shared by all contexts
+  self->threads = 0;
+  if (threads > 0) {
+    self->threads = flandmark_thread_pool_create(threads);
+    if (!self->threads) {
+      PyErr_Format(PyExc_RuntimeError, "`%s' could not start %d threads", Py_TYPE(self)->tp_name, threads);
+      return -1;
+    }
+  }
+
   //all good, flandmark is ready
   return 0;
 
 }
 
 static void PyBobIpFlandmark_delete (PyBobIpFlandmarkObject* self) {
+  if (self->contexts) {
+    for (auto it = self->contexts->begin(); it != self->contexts->end(); ++it)
+      flandmark_context_free(*it);
+    delete self->contexts;
+    self->contexts = 0;
+  }
+  flandmark_thread_pool_free(self->threads);
+  self->threads = 0;
   flandmark_free(self->flandmark);
   self->flandmark = 0;
   free(self->filename);
@@ -119,50 +181,161 @@ static void delete_image(IplImage* i) {
   cvReleaseImage(&i);
 }
 
+/**
+ * Takes an idle context from the pool (or creates one) and hands it back to
+ * the pool when released. Must be called with the GIL held, which is what
+ * protects the pool; the context itself is then used without the GIL.
+ */
+static boost::shared_ptr<FLANDMARK_Context> acquire_context
+(PyBobIpFlandmarkObject* self) {
+
+  FLANDMARK_Context* context = 0;
+  if (!self->contexts->empty()) {
+    context = self->contexts->back();
+    self->contexts->pop_back();
+  }
+  else {
+    context = flandmark_context_create(self->flandmark);
+    if (!context) {
+      PyErr_NoMemory();
+      return boost::shared_ptr<FLANDMARK_Context>();
+    }
+    context->workspace->pool = self->threads;
+  }
+
+  return boost::shared_ptr<FLANDMARK_Context>(context,
+      [self](FLANDMARK_Context* c) { self->contexts->push_back(c); });
+}
+
+/**
+ * Converts a 2D uint8 array to an IplImage, or sets a TypeError and returns
+ * an empty pointer.
+ *
+ * When the pixels of every row are contiguous and rows come one after the
+ * other (C-contiguous arrays and their row and column slices), the IplImage
+ * is a header over the caller's buffer, which the native code only reads
+ * where faces are; it holds a reference to image until it is released, which
+ * must be with the GIL held. Other views (strided columns, transposes,
+ * reversed rows) are copied.
+ */
+static boost::shared_ptr<IplImage> to_iplimage(PyBobIpFlandmarkObject* self,
+    PyBlitzArrayObject* image) {
+
+  if (image->type_num != NPY_UINT8 || image->ndim != 2) {
+    PyErr_Format(PyExc_TypeError, "`%s' input `image' data must be a 2D array with dtype `uint8' (i.e. a gray-scaled image), but you passed a %" PY_FORMAT_SIZE_T "d array with data type `%s'", Py_TYPE(self)->tp_name, image->ndim, PyBlitzArray_TypenumAsString(image->type_num));
+    return boost::shared_ptr<IplImage>();
+  }
+
+  const Py_ssize_t height = image->shape[0], width = image->shape[1];
+  const Py_ssize_t row_stride = image->stride[0], col_stride = image->stride[1];
+
+  if (col_stride == 1 && row_stride >= width && row_stride <= INT_MAX) {
+    IplImage* header = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 1);
+    if (!header) {
+      PyErr_NoMemory();
+      return boost::shared_ptr<IplImage>();
+    }
+    cvSetData(header, image->data, (int)row_stride);
+    Py_INCREF(image);
+    return boost::shared_ptr<IplImage>(header, [image](IplImage* i) {
+        cvReleaseImageHeader(&i);
+        Py_DECREF(image);
+        });
+  }
+
+  // converts to OpenCV's IplImage
+  boost::shared_ptr<IplImage> cv_image(cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1), std::ptr_fun(delete_image));
+
+  // copy image data aligned (see http://chi3x10.wordpress.com/2008/05/07/be-aware-of-memory-alignment-of-iplimage-in-opencv)
+  for (Py_ssize_t yy = 0; yy < height; ++yy) {
+    const char* row = reinterpret_cast<const char*>(image->data) + yy * row_stride;
+    char* dst = cv_image->imageData + yy * cv_image->widthStep;
+    for (Py_ssize_t xx = 0; xx < width; ++xx) dst[xx] = row[xx * col_stride];
+  }
+
+  return cv_image;
+}
+
+/**
+ * Returns a new reference to the (y, x) key-points of a detection from its
+ * (x, y) landmarks, or to None if it failed
+ */
+static PyObject* to_landmarks(PyBobIpFlandmarkObject* self, int result,
+    const double* buffer) {
+
+  if (result != NO_ERR) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+
+  Py_ssize_t shape[2];
+  shape[0] = self->flandmark->data.options.M;
+  shape[1] = 2;
+  PyObject* landmarks = PyArray_SimpleNew(2, shape, NPY_FLOAT64);
+  if (!landmarks) return 0;
+  double* data = reinterpret_cast<double*>(PyArray_DATA((PyArrayObject*)landmarks));
+
+  //swap keypoint coordinates (x, y) -> (y, x)
+  for (int k = 0; k < (2*self->flandmark->data.options.M); k += 2) {
+    data[k]   = buffer[k+1];
+    data[k+1] = buffer[k];
+  }
+
+  return landmarks;
+}
+
 /**
  * Returns a list of key-point annotations given an image and an iterable over
- * bounding boxes.
+ * bounding boxes. Faces scoring below threshold get None; their scores (or
+ * the bounds that rejected them) go to scores if given, NaN for faces that
+ * could not be located. Only the key-points of mask are located if given,
+ * the others are NaN. Faces are normalized
+ * from the octaves of pyramid if given, which must be built over image.
+ * Without scores, several faces are detected together (see
+ * flandmark_detect_batch_ctx).
  */
 static PyObject* call(PyBobIpFlandmarkObject* self,
-    boost::shared_ptr<IplImage> image, int nbbx, boost::shared_array<int> bbx) {
+    boost::shared_ptr<IplImage> image, int nbbx, boost::shared_array<int> bbx,
+    double threshold=FLANDMARK_NO_THRESHOLD, double* scores=0,
+    const int* mask=0, FLANDMARK_ImagePyramid* pyramid=0) {
 
   PyObject* retval = PyTuple_New(nbbx);
   if (!retval) return 0;
   auto retval_ = make_safe(retval);
 
-  for (int i=0; i<nbbx; ++i) {
-
-    //allocate output array _and_ Flandmark buffer within a single structure
-    Py_ssize_t shape[2];
-    shape[0] = self->flandmark->data.options.M;
-    shape[1] = 2;
-    PyObject* landmarks = PyArray_SimpleNew(2, shape, NPY_FLOAT64);
-    if (!landmarks) return 0;
-    auto landmarks_ = make_safe(landmarks);
-    double* buffer = reinterpret_cast<double*>(PyArray_DATA((PyArrayObject*)landmarks));
-
-    int result = 0;
+  auto context = acquire_context(self);
+  if (!context) return 0;
+
+  context->flags = self->flags;
+  context->threshold = threshold;
+  context->mask = mask;
+  context->pyramid = pyramid;
+  context->interpolation = self->interpolation;
+
+  const int M = self->flandmark->data.options.M;
+  std::vector<double> buffer(2*M*nbbx);
+  std::vector<int> results(nbbx);
+
+  if (scores) {
+    for (int i=0; i<nbbx; ++i) {
+      Py_BEGIN_ALLOW_THREADS
+      results[i] = flandmark_detect_ctx(image.get(), &bbx[4*i], self->flandmark, context.get(), &buffer[2*M*i]);
+      Py_END_ALLOW_THREADS
+      scores[i] = (results[i] == NO_ERR || results[i] == FLANDMARK_REJECTED) ? context->score : NAN;
+    }
+  }
+  else {
+    int error = 0;
     Py_BEGIN_ALLOW_THREADS
-    result = flandmark_detect(image.get(), &bbx[4*i], self->flandmark, buffer);
+    error = flandmark_detect_batch_ctx(image.get(), nbbx, bbx.get(), self->flandmark, context.get(), buffer.data(), results.data());
     Py_END_ALLOW_THREADS
+    if (error) return PyErr_NoMemory();
+  }
 
-    if (result != NO_ERR) {
-      Py_INCREF(Py_None);
-      landmarks = Py_None;
-    }
-    else {
-      //swap keypoint coordinates (x, y) -> (y, x)
-      double tmp;
-      for (int k = 0; k < (2*self->flandmark->data.options.M); k += 2) {
-        tmp         = buffer[k];
-        buffer[k]   = buffer[k+1];
-        buffer[k+1] = tmp;
-      }
-      Py_INCREF(landmarks);
-    }
-
+  for (int i=0; i<nbbx; ++i) {
+    PyObject* landmarks = to_landmarks(self, results[i], &buffer[2*M*i]);
+    if (!landmarks) return 0;
     PyTuple_SET_ITEM(retval, i, landmarks);
-
   }
 
   Py_INCREF(retval);
@@ -196,19 +369,24 @@ static auto s_call = bob::extension::FunctionDoc(
     "(y, x).\n"
     "\n"
     )
-    .add_prototype("image, y, x, height, width", "landmarks")
+    .add_prototype("image, y, x, height, width, [threshold], [return_score], [landmarks]", "landmarks")
+    .add_prototype("image, y, x, height, width, [threshold], return_score, [landmarks]", "landmarks, score")
     .add_parameter("image", "array-like (2D, uint8)",
-      "The image Flandmark will operate on")
+      "The image Flandmark will operate on; it is read in place, without a copy, unless the pixels of its rows are not contiguous (e.g. ``image[:,::2]`` or ``image.T``)")
     .add_parameter("y, x", "int", "The top left-most corner of the bounding box containing the face image you want to locate keypoints on.")
     .add_parameter("height, width", "int", "The dimensions accross ``y`` (height) and ``x`` (width) for the bounding box, in number of pixels.")
-    .add_return("landmarks", "array (2D, float64)", "Each row in the output array contains the locations of keypoints in the format ``(y, x)``")
+    .add_parameter("threshold", "float, optional", "If given, faces whose score is below are rejected, most of the time without completing the localization")
+    .add_parameter("return_score", "bool, optional", "If ``True``, the score of the face is returned as well")
+    .add_parameter("landmarks", "[int], optional", "If given, the indices of the keypoints to locate; only these, the face center and the keypoints linking them to it in the model (e.g. 1 for 5) are computed, and the rows of the others are NaN. The keypoints are then the best ones of the reduced model, which may differ from the ones located with all keypoints")
+    .add_return("landmarks", "array (2D, float64) or None", "Each row in the output array contains the locations of keypoints in the format ``(y, x)``; ``None`` if the face was rejected")
+    .add_return("score", "float", "The score of the located keypoints, higher is better; for rejected faces, an upper bound of it; ``nan`` for faces that could not be located (e.g. outside the image)")
     ;
 
 static PyObject* PyBobIpFlandmark_call_single(PyBobIpFlandmarkObject* self,
     PyObject *args, PyObject* kwds) {
 
   /* Parses input arguments in a single shot */
-  static const char* const_kwlist[] = {"image", "y", "x", "height", "width", 0};
+  static const char* const_kwlist[] = {"image", "y", "x", "height", "width", "threshold", "return_score", "landmarks", 0};
   static char** kwlist = const_cast<char**>(const_kwlist);
 
   PyBlitzArrayObject* image = 0;
@@ -216,24 +394,38 @@ static PyObject* PyBobIpFlandmark_call_single(PyBobIpFlandmarkObject* self,
   int x = 0;
   int height = 0;
   int width = 0;
+  double threshold = FLANDMARK_NO_THRESHOLD;
+  PyObject* return_score = Py_False;
+  PyObject* landmarks = Py_None;
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&iiii", kwlist,
-        &PyBlitzArray_Converter, &image, &y, &x, &height, &width)) return 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&iiii|dOO", kwlist,
+        &PyBlitzArray_Converter, &image, &y, &x, &height, &width, &threshold, &return_score, &landmarks)) return 0;
 
   auto image_ = make_safe(image);
 
-  //check
-  if (image->type_num != NPY_UINT8 || image->ndim != 2) {
-    PyErr_Format(PyExc_TypeError, "`%s' input `image' data must be a 2D array with dtype `uint8' (i.e. a gray-scaled image), but you passed a %" PY_FORMAT_SIZE_T "d array with data type `%s'", Py_TYPE(self)->tp_name, image->ndim, PyBlitzArray_TypenumAsString(image->type_num));
-    return 0;
+  //which keypoints to locate
+  const int M = self->flandmark->data.options.M;
+  std::vector<int> mask;
+  if (landmarks != Py_None) {
+    PyObject* iterator = PyObject_GetIter(landmarks);
+    if (!iterator) return 0;
+    auto iterator_ = make_safe(iterator);
+    mask.assign(M, 0);
+    while (PyObject* item = PyIter_Next(iterator)) {
+      auto item_ = make_safe(item);
+      long k = PyNumber_AsSsize_t(item, PyExc_OverflowError);
+      if (PyErr_Occurred()) return 0;
+      if (k < 0 || k >= M) {
+        PyErr_Format(PyExc_ValueError, "`%s' keypoint index %ld is out of range [0, %d)", Py_TYPE(self)->tp_name, k, M);
+        return 0;
+      }
+      mask[k] = 1;
+    }
+    if (PyErr_Occurred()) return 0;
   }
 
-  // converts to OpenCV's IplImage
-  boost::shared_ptr<IplImage> cv_image(cvCreateImage(cvSize(image->shape[1], image->shape[0]), IPL_DEPTH_8U, 1), std::ptr_fun(delete_image));
-
-  // copy image data aligned (see http://chi3x10.wordpress.com/2008/05/07/be-aware-of-memory-alignment-of-iplimage-in-opencv)
-  for (int yy = 0; yy < image->shape[0]; ++yy)
-    std::copy(reinterpret_cast<char*>(image->data) + yy * image->shape[1], reinterpret_cast<char*>(image->data) + (yy+1) * image->shape[1], cv_image->imageData + yy * cv_image->widthStep);
+  auto cv_image = to_iplimage(self, image);
+  if (!cv_image) return 0;
 
   //prepares the bbx vector
   boost::shared_array<int> bbx(new int[4]);
@@ -242,7 +434,11 @@ static PyObject* PyBobIpFlandmark_call_single(PyBobIpFlandmarkObject* self,
   bbx[2] = x + width;
   bbx[3] = y + height;
 
-  PyObject* retval = call(self, cv_image, 1, bbx);
+  int with_score = PyObject_IsTrue(return_score);
+  if (with_score < 0) return 0;
+
+  double score = 0.;
+  PyObject* retval = call(self, cv_image, 1, bbx, threshold, &score, mask.empty() ? 0 : &mask[0]);
   if (!retval) return 0;
 
   //gets the first entry, return it
@@ -252,10 +448,145 @@ static PyObject* PyBobIpFlandmark_call_single(PyBobIpFlandmarkObject* self,
   Py_INCREF(retval0);
   Py_DECREF(retval);
 
+  if (with_score) return Py_BuildValue("(Nd)", retval0, score);
+
   return retval0;
 
 };
 
+static auto s_locate_many = bob::extension::FunctionDoc(
+    "locate_many",
+    "Locates keypoints on several facial bounding-boxes of the same image",
+    "The keypoints of every face are those of :py:meth:`locate`. "
+    "With ``pyramid``, the image is reduced by successive 2x2 averages, "
+    "once for all faces and only as far as the largest face needs, and "
+    "each face is resampled from the smallest of these images that still "
+    "has more pixels across the face than the normalized face frame. Large "
+    "faces are then smoothed rather than subsampled, but their keypoints "
+    "may differ from the ones of :py:meth:`locate`, whose normalization "
+    "the model was trained with."
+    )
+    .add_prototype("image, boxes, [threshold], [pyramid]", "landmarks")
+    .add_parameter("image", "array-like (2D, uint8)",
+      "The image Flandmark will operate on; it is read in place, without a copy, unless the pixels of its rows are not contiguous (e.g. ``image[:,::2]`` or ``image.T``)")
+    .add_parameter("boxes", "[(int, int, int, int)]", "The bounding boxes of the faces, each as ``(y, x, height, width)`` (see :py:meth:`locate`)")
+    .add_parameter("threshold", "float, optional", "If given, faces whose score is below are rejected (see :py:meth:`locate`)")
+    .add_parameter("pyramid", "bool, optional", "If ``True``, faces are resampled from the reduced images, see above; ``False`` by default")
+    .add_return("landmarks", "tuple", "For every bounding box, the keypoints as returned by :py:meth:`locate`, or ``None`` if the face was rejected")
+    ;
+
+static PyObject* PyBobIpFlandmark_locate_many(PyBobIpFlandmarkObject* self,
+    PyObject *args, PyObject* kwds) {
+
+  /* Parses input arguments in a single shot */
+  static const char* const_kwlist[] = {"image", "boxes", "threshold", "pyramid", 0};
+  static char** kwlist = const_cast<char**>(const_kwlist);
+
+  PyBlitzArrayObject* image = 0;
+  PyObject* boxes = 0;
+  double threshold = FLANDMARK_NO_THRESHOLD;
+  PyObject* pyramid = Py_False;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&O|dO", kwlist,
+        &PyBlitzArray_Converter, &image, &boxes, &threshold, &pyramid)) return 0;
+
+  auto image_ = make_safe(image);
+
+  int use_pyramid = PyObject_IsTrue(pyramid);
+  if (use_pyramid < 0) return 0;
+
+  //prepares the bbx vector from the (y, x, height, width) boxes
+  std::vector<int> bbx;
+  PyObject* iterator = PyObject_GetIter(boxes);
+  if (!iterator) return 0;
+  auto iterator_ = make_safe(iterator);
+  while (PyObject* item = PyIter_Next(iterator)) {
+    auto item_ = make_safe(item);
+    PyObject* box = PySequence_Fast(item, "bounding boxes must be sequences of (y, x, height, width)");
+    if (!box) return 0;
+    auto box_ = make_safe(box);
+    if (PySequence_Fast_GET_SIZE(box) != 4) {
+      PyErr_Format(PyExc_ValueError, "`%s' bounding boxes must have 4 entries (y, x, height, width), but one has %" PY_FORMAT_SIZE_T "d", Py_TYPE(self)->tp_name, PySequence_Fast_GET_SIZE(box));
+      return 0;
+    }
+    long v[4];
+    for (int k = 0; k < 4; ++k) {
+      v[k] = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(box, k), PyExc_OverflowError);
+      if (PyErr_Occurred()) return 0;
+    }
+    bbx.push_back(v[1]);
+    bbx.push_back(v[0]);
+    bbx.push_back(v[1] + v[3]);
+    bbx.push_back(v[0] + v[2]);
+  }
+  if (PyErr_Occurred()) return 0;
+
+  auto cv_image = to_iplimage(self, image);
+  if (!cv_image) return 0;
+
+  boost::shared_ptr<FLANDMARK_ImagePyramid> octaves;
+  if (use_pyramid) {
+    octaves.reset(flandmark_image_pyramid_create(cv_image.get()), flandmark_image_pyramid_free);
+    if (!octaves) return PyErr_NoMemory();
+  }
+
+  const int nbbx = bbx.size() / 4;
+  boost::shared_array<int> bbx_(new int[bbx.size()]);
+  std::copy(bbx.begin(), bbx.end(), bbx_.get());
+
+  return call(self, cv_image, nbbx, bbx_, threshold, 0, 0, octaves.get());
+
+};
+
+static auto s_save_quantized = bob::extension::FunctionDoc(
+    "save_quantized",
+    "Saves the quantized weights of the model",
+    "The file is the one a locator constructed with ``quantized=True`` "
+    "reads instead of quantizing the model again."
+    )
+    .add_prototype("[filename]", "")
+    .add_parameter("filename", "str (path), optional", "Where to save the weights; by default, the model path with the ``.q16`` extension appended")
+    ;
+
+static PyObject* PyBobIpFlandmark_save_quantized(PyBobIpFlandmarkObject* self,
+    PyObject *args, PyObject* kwds) {
+
+  /* Parses input arguments in a single shot */
+  static const char* const_kwlist[] = {"filename", 0};
+  static char** kwlist = const_cast<char**>(const_kwlist);
+
+  PyObject* filename = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O&", kwlist,
+        &PyBobIo_FilenameConverter, &filename)) return 0;
+
+  auto filename_ = make_xsafe(filename);
+
+  if (!self->flandmark->quant) {
+    PyErr_Format(PyExc_RuntimeError, "`%s' has no quantized weights to save, construct it with `quantized=True'", Py_TYPE(self)->tp_name);
+    return 0;
+  }
+
+  std::string c_filename;
+  if (filename) {
+# if PY_VERSION_HEX >= 0x03000000
+    c_filename = PyBytes_AS_STRING(filename);
+# else
+    c_filename = PyString_AS_STRING(filename);
+# endif
+  } else {
+    c_filename = std::string(self->filename) + FLANDMARK_QUANTIZED_SUFFIX;
+  }
+
+  if (flandmark_write_quantized(c_filename.c_str(), self->flandmark)) {
+    PyErr_Format(PyExc_IOError, "`%s' could not save the quantized weights to `%s'", Py_TYPE(self)->tp_name, c_filename.c_str());
+    return 0;
+  }
+
+  Py_RETURN_NONE;
+
+};
+
 static PyMethodDef PyBobIpFlandmark_methods[] = {
   {
     s_call.name(),
@@ -263,6 +594,61 @@ static PyMethodDef PyBobIpFlandmark_methods[] = {
     METH_VARARGS|METH_KEYWORDS,
     s_call.doc()
   },
+  {
+    s_locate_many.name(),
+    (PyCFunction)PyBobIpFlandmark_locate_many,
+    METH_VARARGS|METH_KEYWORDS,
+    s_locate_many.doc()
+  },
+  {
+    s_save_quantized.name(),
+    (PyCFunction)PyBobIpFlandmark_save_quantized,
+    METH_VARARGS|METH_KEYWORDS,
+    s_save_quantized.doc()
+  },
+  {0} /* Sentinel */
+};
+
+static auto s_coarse_to_fine_stats = bob::extension::VariableDoc(
+    "coarse_to_fine_stats",
+    "(int, int)",
+    "The number of localizations run in coarse-to-fine mode so far, and how many of them fell back to the exhaustive search"
+    );
+
+static PyObject* PyBobIpFlandmark_coarse_to_fine_stats(PyBobIpFlandmarkObject* self, void*) {
+  unsigned long runs = 0, fallbacks = 0;
+  for (auto it = self->contexts->begin(); it != self->contexts->end(); ++it) {
+    runs += (*it)->workspace->coarseRuns;
+    fallbacks += (*it)->workspace->coarseFallbacks;
+  }
+  return Py_BuildValue("(kk)", runs, fallbacks);
+}
+
+static auto s_interpolation = bob::extension::VariableDoc(
+    "interpolation",
+    "str",
+    "How faces are resampled into the normalized face frame, as given to the constructor"
+    );
+
+static PyObject* PyBobIpFlandmark_interpolation(PyBobIpFlandmarkObject* self, void*) {
+  return Py_BuildValue("s", s_interpolations[self->interpolation]);
+}
+
+static PyGetSetDef PyBobIpFlandmark_getseters[] = {
+  {
+    s_coarse_to_fine_stats.name(),
+    (getter)PyBobIpFlandmark_coarse_to_fine_stats,
+    0,
+    s_coarse_to_fine_stats.doc(),
+    0
+  },
+  {
+    s_interpolation.name(),
+    (getter)PyBobIpFlandmark_interpolation,
+    0,
+    s_interpolation.doc(),
+    0
+  },
   {0} /* Sentinel */
 };
 
@@ -318,7 +704,7 @@ PyTypeObject PyBobIpFlandmark_Type = {
     0,                                         /* tp_iternext */
     PyBobIpFlandmark_methods,                  /* tp_methods */
     0,                                         /* tp_members */
-    0,                                         /* tp_getset */
+    PyBobIpFlandmark_getseters,                /* tp_getset */
     0,                                         /* tp_base */
     0,                                         /* tp_dict */
     0,                                         /* tp_descr_get */
@@ -0,0 +1,303 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Detection of several normalized faces at once, one face per SIMD lane.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "liblbp.h"
+#include "liblbp_engine.h"
+#include "flandmark_detector.h"
+
+// Detection of several faces at once. Every buffer stores FLANDMARK_BATCH_LANES consecutive values per
+// element, one per face, and all loops over faces are innermost so that they map onto SIMD lanes. The
+// arithmetic of each lane is the one of flandmark_detect_base on a double precision model without flags,
+// threshold or mask, so the results are the same as for that detection.
+
+#define LANES FLANDMARK_BATCH_LANES
+
+template <class Geometry>
+static void flandmark_batch_windows(const Geometry& geom, const FLANDMARK_LBP* lbp, const uint8_t* codes, const uint8_t* mirrored,
+		uint32_t im_H, uint32_t size, const double* W, double* q)
+{
+	for (int i = 0; i < lbp->WINS_COLS; ++i)
+	{
+		uint32_t x1 = lbp->wins[INDEX(1,i,4)]-1;
+		uint32_t y1 = lbp->wins[INDEX(2,i,4)]-1;
+		liblbp_dotprod_lanes_consumer<LANES> consumer;
+		consumer.vec = W;
+		for (int l = 0; l < LANES; ++l)
+			consumer.dot_prod[l] = 0.0;
+
+		if (lbp->wins[INDEX(3,i,4)])
+		{
+			liblbp_codemap_lanes_source<true, LANES> src = {mirrored + INDEX(y1, x1, im_H)*LANES, im_H, size, (uint32_t)lbp->winSize[1]};
+			liblbp_pyr_engine(geom, src, consumer);
+		} else {
+			liblbp_codemap_lanes_source<false, LANES> src = {codes + INDEX(y1, x1, im_H)*LANES, im_H, size, (uint32_t)lbp->winSize[1]};
+			liblbp_pyr_engine(geom, src, consumer);
+		}
+
+		for (int l = 0; l < LANES; ++l)
+			q[i*LANES+l] = consumer.dot_prod[l];
+	}
+}
+
+struct flandmark_batch_body
+{
+	const FLANDMARK_LBP * lbp;
+	const uint8_t * codes, * mirrored;
+	uint32_t im_H, size;
+	const double * W;
+	double * q;
+
+	template <class Geometry>
+	void operator()(const Geometry& geom) { flandmark_batch_windows(geom, lbp, codes, mirrored, im_H, size, W, q); }
+};
+
+// flandmark_argmax for LANES faces, scores and best hold LANES values per position; smax holds LANES
+// consecutive [2 x M] arrays
+static void flandmark_batch_argmax(double *smax, const FLANDMARK_Model *model, double **q, double **scores, int **best)
+{
+	const int M = model->data.options.M;
+	int received[256] = {0};
+
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+
+		const double * child = q[edge->child];
+		if (received[edge->child])
+		{
+			double * s = scores[edge->child];
+			for (int j = 0; j < model->data.lbp[edge->child].WINS_COLS*LANES; ++j)
+			{
+				s[j] += child[j];
+			}
+			child = s;
+		}
+
+		double * message = scores[edge->parent];
+		for (int i = 0; i < edge->nParent; ++i)
+		{
+			const double * costs = &edge->costs[i*edge->nChild];
+			double maximum[LANES];
+			int * idx = &best[e][i*LANES];
+			for (int l = 0; l < LANES; ++l)
+			{
+				maximum[l] = -FLT_MAX;
+				idx[l] = -1;
+			}
+			for (int j = 0; j < edge->cols[i]; ++j)
+			{
+				for (int l = 0; l < LANES; ++l)
+				{
+					double value = child[j*LANES+l]+costs[j];
+					idx[l] = maximum[l] < value ? j : idx[l];
+					maximum[l] = maximum[l] < value ? value : maximum[l];
+				}
+			}
+			for (int l = 0; l < LANES; ++l)
+				message[i*LANES+l] = received[edge->parent] ? message[i*LANES+l] + maximum[l] : maximum[l];
+		}
+		received[edge->parent] = 1;
+	}
+
+	const int root = model->edges[model->nEdges-1].parent;
+	double maxs0[LANES];
+	int maxs0_idx[LANES];
+	for (int l = 0; l < LANES; ++l)
+	{
+		maxs0[l] = -FLT_MAX;
+		maxs0_idx[l] = -1;
+	}
+	for (int i = 0; i < model->data.lbp[root].WINS_COLS; ++i)
+	{
+		for (int l = 0; l < LANES; ++l)
+		{
+			double s0 = scores[root][i*LANES+l]+q[root][i*LANES+l];
+			maxs0_idx[l] = maxs0[l] < s0 ? i : maxs0_idx[l];
+			maxs0[l] = maxs0[l] < s0 ? s0 : maxs0[l];
+		}
+	}
+
+	// get indices and convert them to 2D coordinates of estimated positions
+	const int * optionsS = model->data.options.S;
+	int indices[256];
+	for (int l = 0; l < LANES; ++l)
+	{
+		indices[root] = maxs0_idx[l];
+		for (int e = model->nEdges-1; e >= 0; --e)
+			indices[model->edges[e].child] = best[e][indices[model->edges[e].parent]*LANES+l];
+
+		double * lm = smax + 2*M*l;
+		for (int i = 0; i < M; ++i)
+		{
+			int rows = optionsS[INDEX(3, i, 4)] - optionsS[INDEX(1, i, 4)] + 1;
+			lm[INDEX(0, i, 2)] = float(COL(indices[i]+1, rows) + optionsS[INDEX(0, i, 4)]);
+			lm[INDEX(1, i, 2)] = float(ROW(indices[i]+1, rows) + optionsS[INDEX(1, i, 4)]);
+		}
+	}
+}
+
+// frees what flandmark_detect_base_batch allocated, any of it may be missing
+static void flandmark_batch_free(const FLANDMARK_Model *model, uint8_t *codes, uint8_t *mirrored, uint32_t *sums, double **q, double **scores, int **best, double *smax)
+{
+	for (int i = 0; i < model->data.options.M; ++i)
+	{
+		if (q)
+			free(q[i]);
+		if (scores)
+			free(scores[i]);
+	}
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		if (best)
+			free(best[e]);
+	}
+	free(q);
+	free(scores);
+	free(best);
+	free(smax);
+	free(codes);
+	free(mirrored);
+	free(sums);
+}
+
+int flandmark_detect_base_batch(uint8_t * const *face_images, int nFaces, const FLANDMARK_Model *model, double *landmarks)
+{
+	const int M = model->data.options.M;
+	const int * mapTable = model->data.mapTable;
+	const uint32_t im_H = (uint32_t)model->data.imSize[0], size = im_H*(uint32_t)model->data.imSize[1];
+
+	const int nLevels = flandmark_lbp_pyramid_levels(model);
+
+	uint8_t * codes = (uint8_t*)malloc(nLevels*size*LANES*sizeof(uint8_t));
+	uint8_t * mirrored = (uint8_t*)malloc(nLevels*size*LANES*sizeof(uint8_t));
+	uint32_t * sums = (uint32_t*)malloc(size*LANES*sizeof(uint32_t));
+	double ** q = (double**)calloc(M, sizeof(double*));
+	double ** scores = (double**)calloc(M, sizeof(double*));
+	int ** best = (int**)calloc(model->nEdges, sizeof(int*));
+	double * smax = (double*)malloc(2*M*LANES*sizeof(double));
+	bool allocated = codes && mirrored && sums && q && scores && best && smax;
+	for (int idx = 0; allocated && idx < M; ++idx)
+	{
+		q[idx] = (double*)malloc(model->data.lbp[idx].WINS_COLS*LANES*sizeof(double));
+		scores[idx] = (double*)malloc(model->data.lbp[idx].WINS_COLS*LANES*sizeof(double));
+		allocated = q[idx] && scores[idx];
+	}
+	for (int e = 0; allocated && e < model->nEdges; ++e)
+	{
+		best[e] = (int*)malloc(model->edges[e].nParent*LANES*sizeof(int));
+		allocated = best[e] != NULL;
+	}
+	if (!allocated)
+	{
+		flandmark_batch_free(model, codes, mirrored, sums, q, scores, best, smax);
+		return 1;
+	}
+
+	for (int first = 0; first < nFaces; first += LANES)
+	{
+		// pad the last group by repeating its last face
+		const uint8_t * faces[LANES];
+		for (int l = 0; l < LANES; ++l)
+			faces[l] = face_images[first+l < nFaces ? first+l : nFaces-1];
+
+		liblbp_pyr_codemaps_lanes<LANES>(codes, mirrored, sums, faces, im_H, model->data.imSize[1], nLevels);
+
+		for (int idx = 0; idx < M; ++idx)
+		{
+			const FLANDMARK_LBP * lbp = &model->data.lbp[idx];
+			uint32_t nCells = liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256;
+			flandmark_batch_body body = {lbp, codes, mirrored, im_H, size, model->W+mapTable[INDEX(idx, 0, M)]-1, q[idx]};
+			liblbp_geometry_dispatch(lbp->winSize[0], lbp->winSize[1], liblbp_pyr_levels(lbp->winSize[0], lbp->winSize[1], nCells), body);
+		}
+
+		flandmark_batch_argmax(smax, model, q, scores, best);
+
+		int n = nFaces - first < LANES ? nFaces - first : LANES;
+		memcpy(landmarks + 2*M*first, smax, 2*M*n*sizeof(double));
+	}
+
+	flandmark_batch_free(model, codes, mirrored, sums, q, scores, best, smax);
+
+	return 0;
+}
+
+int flandmark_detect_batch_ctx(IplImage *img, int nFaces, const int *bbox, const FLANDMARK_Model *model, FLANDMARK_Context *context, double *landmarks, int *results)
+{
+	const int M = model->data.options.M;
+	const int * bw = model->data.options.bw;
+
+	// the batch engine only knows the exhaustive search of a double precision model over the whole tree
+	if (nFaces < 2 || context->flags || context->threshold > FLANDMARK_NO_THRESHOLD || context->mask || model->Wf || model->quant)
+	{
+		for (int i = 0; i < nFaces; ++i)
+		{
+			int box[4] = {bbox[4*i], bbox[4*i+1], bbox[4*i+2], bbox[4*i+3]};
+			results[i] = flandmark_detect_ctx(img, box, model, context, landmarks + 2*M*i);
+		}
+		return 0;
+	}
+
+	const int size = bw[0]*bw[1];
+	uint8_t * frames = (uint8_t*)malloc(nFaces*size*sizeof(uint8_t));
+	uint8_t ** faces = (uint8_t**)malloc(nFaces*sizeof(uint8_t*));
+	double * bb = (double*)malloc(4*nFaces*sizeof(double));
+	int * index = (int*)malloc(nFaces*sizeof(int));
+	double * found = (double*)malloc(2*M*nFaces*sizeof(double));
+	if (!frames || !faces || !bb || !index || !found)
+	{
+		free(frames);
+		free(faces);
+		free(bb);
+		free(index);
+		free(found);
+		return 1;
+	}
+
+	// faces whose frame cannot be normalized are left out of the batch
+	int nFound = 0;
+	for (int i = 0; i < nFaces; ++i)
+	{
+		results[i] = flandmark_get_normalized_image_frame(img, &bbox[4*i], &bb[4*i], &frames[i*size], model, 0, context->workspace, context->pyramid, context->interpolation) ? 1 : 0;
+		if (!results[i])
+		{
+			faces[nFound] = &frames[i*size];
+			index[nFound++] = i;
+		}
+	}
+
+	int retval = nFound ? flandmark_detect_base_batch(faces, nFound, model, found) : 0;
+	for (int k = 0; !retval && k < nFound; ++k)
+	{
+		// transform coordinates of detected landmarks from normalized image frame back to the original image,
+		// as flandmark_detect_ctx does
+		const int i = index[k];
+		const double * face_bb = &bb[4*i];
+		float sf[2];
+		sf[0] = (float)(face_bb[2]-face_bb[0])/bw[0];
+		sf[1] = (float)(face_bb[3]-face_bb[1])/bw[1];
+		for (int j = 0; j < 2*M; j += 2)
+		{
+			landmarks[2*M*i+j]   = found[2*M*k+j]*sf[0] + face_bb[0];
+			landmarks[2*M*i+j+1] = found[2*M*k+j+1]*sf[1] + face_bb[1];
+		}
+	}
+
+	free(frames);
+	free(faces);
+	free(bb);
+	free(index);
+	free(found);
+
+	return retval;
+}
@@ -12,13 +12,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <float.h>
+#include <math.h>
 
 #include "liblbp.h"
+#include "liblbp_engine.h"
 #include "flandmark_detector.h"
 
+#define FLANDMARK_MAX(A,B) ((A) > (B) ? (A) : (B))
+#define FLANDMARK_MIN(A,B) ((A) < (B) ? (A) : (B))
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FLANDMARK_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+// writes tsize PsiG entries: ROWS, COLS and the displacements of each
+static int flandmark_write_psig(FILE *fout, const FLANDMARK_PSIG *PsiGi, int tsize)
+{
+	for (int idx = 0; idx < tsize; ++idx)
+	{
+		if (fwrite(&PsiGi[idx].ROWS, sizeof(int), 1, fout) != 1 || fwrite(&PsiGi[idx].COLS, sizeof(int), 1, fout) != 1
+				|| fwrite(PsiGi[idx].disp, PsiGi[idx].ROWS*PsiGi[idx].COLS*sizeof(int), 1, fout) != 1)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void flandmark_write_model(const char* filename, FLANDMARK_Model* model)
 {
-	int * p_int = 0, tsize = -1, tmp_tsize = -1;
+	int * p_int = 0, tsize = -1;
 	uint8_t * p_uint8 = 0;
 	uint32_t * p_uint32 = 0;
 
@@ -146,40 +170,81 @@ void flandmark_write_model(const char* filename, FLANDMARK_Model* model)
 
 		printf("tsize = %d\n", tsize);
 
-		for (int idx = 0; idx < tsize; ++idx)
+		if (flandmark_write_psig(fout, PsiGi, tsize))
 		{
-			// write ROWS and COLS size
-			p_int = &PsiGi[idx].ROWS;
-			if (fwrite(p_int, sizeof(int), 1, fout) != 1)
-			{
-				fclose(fout);
-				printf( "Error writing file %s\n", filename);
-				exit(1);
-			}
-			p_int = &PsiGi[idx].COLS;
-			if (fwrite(p_int, sizeof(int), 1, fout) != 1)
-			{
-				fclose(fout);
-				printf( "Error writing file %s\n", filename);
-				exit(1);
-			}
-			// write disp
-			tmp_tsize = PsiGi[idx].ROWS*PsiGi[idx].COLS;
-			if (fwrite(PsiGi[idx].disp, tmp_tsize*sizeof(int), 1, fout) != 1)
-			{
-				fclose(fout);
-				printf( "Error writing file %s\n", filename);
-				exit(1);
-			}
+			fclose(fout);
+			printf( "Error writing file %s\n", filename);
+			exit(1);
+		}
+	}
+
+	// write the topology block of trees other than the 8-point one -----------
+	const FLANDMARK_Options * options = &model->data.options;
+	if (options->nEdges > 0)
+	{
+		int tag = FLANDMARK_TOPOLOGY_TAG;
+		bool ok = fwrite(&tag, sizeof(int), 1, fout) == 1 && fwrite(&options->nEdges, sizeof(int), 1, fout) == 1
+				&& fwrite(options->edges, 4*options->nEdges*sizeof(int), 1, fout) == 1
+				&& fwrite(&options->nPsiGX, sizeof(int), 1, fout) == 1;
+		for (int t = 0; t < options->nPsiGX && ok; ++t)
+		{
+			ok = fwrite(&options->PSIGX_ROWS[t], sizeof(int), 1, fout) == 1 && fwrite(&options->PSIGX_COLS[t], sizeof(int), 1, fout) == 1
+					&& !flandmark_write_psig(fout, options->PsiGX[t], options->PSIGX_ROWS[t]*options->PSIGX_COLS[t]);
+		}
+		if (!ok)
+		{
+			fclose(fout);
+			printf( "Error writing file %s\n", filename);
+			exit(1);
 		}
 	}
 
 	fclose(fout);
 }
 
-FLANDMARK_Model * flandmark_init(const char* filename)
+// reads tsize PsiG entries; all their displacements are kept in one block, in file order, which is freed with
+// the first one
+static int flandmark_read_psig(FILE *fin, FLANDMARK_PSIG *PsiGi, int tsize)
+{
+	size_t * offsets = (size_t*)malloc(tsize*sizeof(size_t));
+	int * block = NULL;
+	size_t used = 0, capacity = 0;
+	for (int idx = 0; idx < tsize; ++idx)
+	{
+		// disp ROWS and COLS
+		if (fread(&PsiGi[idx].ROWS, sizeof(int), 1, fin) != 1 || fread(&PsiGi[idx].COLS, sizeof(int), 1, fin) != 1)
+		{
+			free(offsets);
+			free(block);
+			return 1;
+		}
+		// disp
+		size_t tmp_tsize = PsiGi[idx].ROWS*PsiGi[idx].COLS;
+		if (used + tmp_tsize > capacity)
+		{
+			capacity = 2*capacity + tmp_tsize;
+			block = (int*)realloc(block, capacity*sizeof(int));
+		}
+		offsets[idx] = used;
+		if (fread(block + used, tmp_tsize*sizeof(int), 1, fin) != 1)
+		{
+			free(offsets);
+			free(block);
+			return 1;
+		}
+		used += tmp_tsize;
+	}
+	for (int idx = 0; idx < tsize; ++idx)
+	{
+		PsiGi[idx].disp = block + offsets[idx];
+	}
+	free(offsets);
+	return 0;
+}
+
+FLANDMARK_Model * flandmark_init(const char* filename, int flags)
 {
-	int *p_int = 0, tsize = -1, tmp_tsize = -1;
+	int *p_int = 0, tsize = -1;
 	uint8_t *p_uint8 = 0;
 
 	FILE *fin;
@@ -333,36 +398,52 @@ FLANDMARK_Model * flandmark_init(const char* filename)
 				break;
 		}
 
-		for (int idx = 0; idx < tsize; ++idx)
+		if (flandmark_read_psig(fin, PsiGi, tsize))
 		{
-			// disp ROWS
-			p_int = (int*)malloc(sizeof(int));
-			if (fread(p_int, sizeof(int), 1, fin) != 1)
-			{
-				printf( "Error reading file %s\n", filename);
-				return 0;
-				//exit(1);
-			}
-			PsiGi[idx].ROWS = p_int[0];
-			free(p_int);
-			// disp COLS
-			p_int = (int*)malloc(sizeof(int));
-			if (fread(p_int, sizeof(int), 1, fin) != 1)
+			printf( "Error reading file %s\n", filename);
+			return 0;
+		}
+	}
+
+	// load the topology block, if any; other trailing data is ignored ----------
+	tst->data.options.nEdges = 0;
+	tst->data.options.edges = 0;
+	tst->data.options.nPsiGX = 0;
+	tst->data.options.PsiGX = 0;
+	tst->data.options.PSIGX_ROWS = 0;
+	tst->data.options.PSIGX_COLS = 0;
+	int tag;
+	if (fread(&tag, sizeof(int), 1, fin) == 1 && tag == FLANDMARK_TOPOLOGY_TAG)
+	{
+		FLANDMARK_Options * options = &tst->data.options;
+		if (fread(&options->nEdges, sizeof(int), 1, fin) != 1 || options->nEdges <= 0 || options->nEdges > 255)
+		{
+			printf( "Error reading the topology of file %s\n", filename);
+			return 0;
+		}
+		options->edges = (int*)malloc(4*options->nEdges*sizeof(int));
+		if (fread(options->edges, 4*options->nEdges*sizeof(int), 1, fin) != 1
+				|| fread(&options->nPsiGX, sizeof(int), 1, fin) != 1 || options->nPsiGX < 0 || options->nPsiGX > 255)
+		{
+			printf( "Error reading the topology of file %s\n", filename);
+			return 0;
+		}
+		options->PsiGX = (FLANDMARK_PSIG**)calloc(options->nPsiGX, sizeof(FLANDMARK_PSIG*));
+		options->PSIGX_ROWS = (int*)calloc(options->nPsiGX, sizeof(int));
+		options->PSIGX_COLS = (int*)calloc(options->nPsiGX, sizeof(int));
+		for (int t = 0; t < options->nPsiGX; ++t)
+		{
+			if (fread(&options->PSIGX_ROWS[t], sizeof(int), 1, fin) != 1 || fread(&options->PSIGX_COLS[t], sizeof(int), 1, fin) != 1)
 			{
-				printf( "Error reading file %s\n", filename);
+				printf( "Error reading the topology of file %s\n", filename);
 				return 0;
-				//exit(1);
 			}
-			PsiGi[idx].COLS = p_int[0];
-			free(p_int);
-			// disp
-			tmp_tsize = PsiGi[idx].ROWS*PsiGi[idx].COLS;
-			PsiGi[idx].disp = (int*)malloc(tmp_tsize*sizeof(int));
-			if (fread(PsiGi[idx].disp, tmp_tsize*sizeof(int), 1, fin) != 1)
+			tsize = options->PSIGX_ROWS[t]*options->PSIGX_COLS[t];
+			options->PsiGX[t] = (FLANDMARK_PSIG*)malloc(tsize*sizeof(FLANDMARK_PSIG));
+			if (flandmark_read_psig(fin, options->PsiGX[t], tsize))
 			{
-				printf( "Error reading file %s\n", filename);
+				printf( "Error reading the topology of file %s\n", filename);
 				return 0;
-				//exit(1);
 			}
 		}
 	}
@@ -375,611 +456,2578 @@ FLANDMARK_Model * flandmark_init(const char* filename)
 
     tst->sf = (float*)calloc(2, sizeof(float));
 
+	// filled from W by flandmark_precompute_edges
+	tst->Wf = 0;
+	if ((flags & FLANDMARK_SINGLE_PRECISION) && !(flags & FLANDMARK_QUANTIZED))
+	{
+		tst->Wf = (float*)malloc(tst->W_ROWS * sizeof(float));
+		if (tst->Wf == NULL)
+		{
+			printf( "Not enough memory for the single precision weights of model %s\n", filename);
+			return 0;
+		}
+	}
+
+	tst->quant = 0;
+	tst->edges = 0;
+	tst->nEdges = 0;
+	tst->qBound = 0;
+	tst->boundMargin = 0.0;
+	if (flandmark_precompute_edges(tst))
+	{
+		printf( "Error preparing the deformation costs of model %s\n", filename);
+		return 0;
+	}
+
+	tst->cells = 0;
+	if (flandmark_precompute_cells(tst))
+	{
+		printf( "Error preparing the LBP cells of model %s\n", filename);
+		return 0;
+	}
+
+	if (flags & FLANDMARK_QUANTIZED)
+	{
+		// prefer the quantized weights saved next to the model
+		char * qfilename = (char*)malloc(strlen(filename)+strlen(FLANDMARK_QUANTIZED_SUFFIX)+1);
+		if (qfilename == NULL)
+		{
+			printf( "Not enough memory for quantizing model %s\n", filename);
+			return 0;
+		}
+		strcpy(qfilename, filename);
+		strcat(qfilename, FLANDMARK_QUANTIZED_SUFFIX);
+
+		// a missing or unreadable file only costs the quantization
+		int error = 1;
+		FILE * fq = fopen(qfilename, "rb");
+		if (fq != NULL)
+		{
+			fclose(fq);
+			error = flandmark_read_quantized(qfilename, tst);
+		}
+		if (error)
+		{
+			error = flandmark_quantize(tst);
+		}
+		if (error)
+		{
+			printf( "Error quantizing model %s\n", filename);
+			free(qfilename);
+			return 0;
+		}
+		free(qfilename);
+	}
+
 	return tst;
 }
 
-EError_T flandmark_check_model(FLANDMARK_Model* model, FLANDMARK_Model* tst)
+static int flandmark_int_compare(const void *a, const void *b)
 {
-	bool flag = false;
-	int tsize = -1, tmp_tsize = -1;
+	int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
 
-	// check model->data.options.M
-	printf("Checking mode->data.options.M...");
-	flag = true;
-	if (model->data.options.M != tst->data.options.M)
+// ascending query points -s*(u + beta) of the distinct offsets u[i], and q[i] the point of u[i]
+static int flandmark_edge_queries(const int *u, int n, int s, double beta, double **p, int **q, int *np)
+{
+	int * sorted = (int*)malloc(n*sizeof(int));
+	if (sorted == NULL)
 	{
-		flag = false;
-		printf("\n: %d ; %d", model->data.options.M, tst->data.options.M);
+		return 1;
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
+	memcpy(sorted, u, n*sizeof(int));
+	qsort(sorted, n, sizeof(int), flandmark_int_compare);
+	int m = 0;
+	for (int i = 0; i < n; ++i)
 	{
-		return ERROR_M;
+		if (m == 0 || sorted[m-1] != sorted[i])
+			sorted[m++] = sorted[i];
 	}
 
-	int M = model->data.options.M;
-
-	// chceck model->data.options.bw
-	printf("Checking mode->data.options.bw...");
-	flag = true;
-	if (model->data.options.bw[0] != tst->data.options.bw[0] ||
-			model->data.options.bw[1] != tst->data.options.bw[1])
+	*p = (double*)malloc(m*sizeof(double));
+	*q = (int*)malloc(n*sizeof(int));
+	if (*p == NULL || *q == NULL)
 	{
-		flag = false;
-		printf("\n: %d ; %d", model->data.options.bw[0], tst->data.options.bw[0]);
-		printf("\n: %d ; %d", model->data.options.bw[1], tst->data.options.bw[1]);
+		free(sorted);
+		return 1;
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
+	// the points decrease with u for s = 1
+	for (int k = 0; k < m; ++k)
 	{
-		return ERROR_BW;
+		(*p)[k] = -s*(sorted[s > 0 ? m-1-k : k] + beta);
+	}
+	for (int i = 0; i < n; ++i)
+	{
+		int pos = (int)((const int*)bsearch(&u[i], sorted, m, sizeof(int), flandmark_int_compare) - sorted);
+		(*q)[i] = s > 0 ? m-1-pos : pos;
 	}
+	*np = m;
 
-	// chceck model->data.options.bw_margin
-	printf("Checking mode->data.options.bw_margin...");
-	flag = true;
-	if (model->data.options.bw_margin[0] != tst->data.options.bw_margin[0] ||
-			model->data.options.bw_margin[1] != tst->data.options.bw_margin[1])
+	free(sorted);
+	return 0;
+}
+
+// checks that for every parent position the displacements are (dx, dy, dx^2, dy^2) with dx = sx*cx + ux and
+// dy = sy*cy + uy over the whole child grid, and that the weights of dx^2 and dy^2 are negative
+static void flandmark_edge_quadratic(FLANDMARK_EDGE *edge, const FLANDMARK_Model *model, const FLANDMARK_PSIG *PsiG, int col, int rows, const double *g)
+{
+	const int * S = &model->data.options.S[4*edge->child];
+	const int childRows = S[3]-S[1]+1, childCols = S[2]-S[0]+1;
+
+	edge->quadratic = 0;
+	if (childRows*childCols != edge->nChild || !(g[2] < 0.0) || !(g[3] < 0.0))
 	{
-		flag = false;
-		printf("\n: %d ; %d", model->data.options.bw_margin[0], tst->data.options.bw_margin[0]);
-		printf("\n: %d ; %d", model->data.options.bw_margin[1], tst->data.options.bw_margin[1]);
+		return;
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
+
+	int * ux = (int*)malloc(edge->nParent*sizeof(int));
+	int * uy = (int*)malloc(edge->nParent*sizeof(int));
+	if (ux == NULL || uy == NULL)
 	{
-		return ERROR_BW_MARGIN;
+		free(ux); free(uy);
+		return;
 	}
 
-	// check model->W
-	printf( "Checking model->W... ");
-	flag = true;
-	for (int i = 0; i < tst->W_ROWS; ++i)
+	int sx = 0, sy = 0;
+	bool quadratic = true;
+	for (int i = 0; i < edge->nParent && quadratic; ++i)
 	{
-		if (model->W[i] != tst->W[i])
+		const FLANDMARK_PSIG * psig = &PsiG[INDEX(i, col, rows)];
+		const int * disp = psig->disp;
+		if (psig->ROWS != 4 || psig->COLS != edge->nChild)
 		{
-			flag = false;
-			printf( "\n%d: %f ; %f", i, model->W[i], tst->W[i]);
-			printf( "Error.");
+			quadratic = false;
+			break;
+		}
+		ux[i] = disp[0];
+		uy[i] = disp[1];
+		int six = childCols > 1 ? disp[4*childRows] - disp[0] : 1;
+		int siy = childRows > 1 ? disp[4+1] - disp[1] : 1;
+		if (i == 0)
+		{
+			sx = six;
+			sy = siy;
+		}
+		if ((sx != 1 && sx != -1) || (sy != 1 && sy != -1) || six != sx || siy != sy)
+		{
+			quadratic = false;
+			break;
+		}
+		for (int j = 0; j < edge->nChild; ++j)
+		{
+			int dx = sx*(j / childRows) + ux[i], dy = sy*(j % childRows) + uy[i];
+			if (disp[4*j] != dx || disp[4*j+1] != dy || disp[4*j+2] != dx*dx || disp[4*j+3] != dy*dy)
+			{
+				quadratic = false;
+				break;
+			}
 		}
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
+
+	// g[0]*dx + g[2]*dx^2 = g[2]*(dx + g[0]/(2*g[2]))^2 + const, so the apex is at cx = -sx*(ux + g[0]/(2*g[2]))
+	if (quadratic
+			&& !flandmark_edge_queries(ux, edge->nParent, sx, g[0]/(2.0*g[2]), &edge->px, &edge->qx, &edge->nPx)
+			&& !flandmark_edge_queries(uy, edge->nParent, sy, g[1]/(2.0*g[3]), &edge->py, &edge->qy, &edge->nPy))
 	{
-		return ERROR_W;
+		edge->quadratic = 1;
+		edge->childRows = childRows;
+		edge->childCols = childCols;
+		edge->wx = -g[2];
+		edge->wy = -g[3];
 	}
 
-	// check model->data.mapTable
-	printf( "Checking model->data.mapTable... ");
-	flag = true;
-	for (int i = 0; i < M*4; ++i)
+	free(ux);
+	free(uy);
+}
+
+// the largest magnitude any score of the tree can reach in fixed point: the sum of the largest unary scores
+// of all components and the largest costs of all edges
+static int64_t flandmark_quant_bound(const FLANDMARK_Model* model)
+{
+	const int M = model->data.options.M;
+	const FLANDMARK_QUANT * quant = model->quant;
+	int64_t bound = 0;
+	for (int idx = 0; idx < M; ++idx)
 	{
-		if (model->data.mapTable[i] != tst->data.mapTable[i])
+		const FLANDMARK_LBP * lbp = &model->data.lbp[idx];
+		int64_t maximum = 0;
+		for (int j = model->data.mapTable[INDEX(idx, 0, M)]-1; j < model->data.mapTable[INDEX(idx, 1, M)]; ++j)
 		{
-			flag = false;
-			printf( "\n%d: %d ; %d", i, model->data.mapTable[i], tst->data.mapTable[i]);
-			printf( "Error.");
+			maximum = FLANDMARK_MAX(maximum, (int64_t)abs(quant->W[j]));
 		}
+		int64_t nCells = liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256;
+		bound += (nCells*maximum) << (quant->scale - quant->shift[idx]);
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
-	{
-		return ERROR_DATA_MAPTABLE;
-	}
-
-	// load model->data.lbp ---------------------------------------------------
-	for (int idx = 0; idx < model->data.options.M; ++idx)
+	for (int e = 0; e < model->nEdges; ++e)
 	{
-		flag = true;
-		printf( "checking lbp[%d]... ", idx);
-
-		for (int i = 0; i < 2; ++i)
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+		int64_t maximum = 0;
+		for (int i = 0; i < edge->nParent; ++i)
 		{
-			if (tst->data.lbp[idx].winSize[i] != model->data.lbp[idx].winSize[i])
+			for (int j = 0; j < edge->cols[i]; ++j)
 			{
-				flag = false;
-				printf( "\n%d: %d ; %d", i, model->data.lbp[idx].winSize[i], tst->data.lbp[idx].winSize[i]);
-				printf( "Error.");
+				maximum = FLANDMARK_MAX(maximum, (int64_t)abs(edge->costsi[i*edge->nChild + j]));
 			}
 		}
+		bound += maximum;
+	}
+	return bound;
+}
 
-		// lbp{idx}.hop
-		if (tst->data.lbp[idx].hop != model->data.lbp[idx].hop)
+// checks that the edges of tree span all M components, and that every child sends its message once, after all
+// the messages it receives; the root, which never sends, is the parent of the last edge
+static int flandmark_check_tree(int M, const int *tree, int nEdges)
+{
+	if (nEdges != M-1 || nEdges <= 0)
+	{
+		return 1;
+	}
+	int sent[256] = {0};
+	const int root = tree[INDEX(1, nEdges-1, 4)];
+	for (int e = 0; e < nEdges; ++e)
+	{
+		const int child = tree[INDEX(0, e, 4)], parent = tree[INDEX(1, e, 4)];
+		if (child < 0 || child >= M || parent < 0 || parent >= M || child == parent || child == root || sent[child] || sent[parent])
 		{
-			flag = false;
-			printf( "\n %d ; %d", model->data.lbp[idx].hop, tst->data.lbp[idx].hop);
-			printf( "Error.");
+			return 1;
 		}
+		sent[child] = 1;
+	}
+	return 0;
+}
 
-		// lbp{idx}.wins
-		tsize = tst->data.lbp[idx].WINS_ROWS*tst->data.lbp[idx].WINS_COLS;
-		for (int i = 0; i < tsize; ++i)
-		{
-			if (model->data.lbp[idx].wins[i] != tst->data.lbp[idx].wins[i])
-			{
-				flag = false;
-				printf( "\n%d: %d ; %d", i, model->data.lbp[idx].wins[i], tst->data.lbp[idx].wins[i]);
-				printf( "Error.");
-			}
-		}
-		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-		if (!flag)
+int flandmark_precompute_edges(FLANDMARK_Model* model)
+{
+	// the 8-point tree of models without topology block: child, parent, PsiG table and its column of every edge,
+	// from the leaves to the root
+	static const int defaultTree[] = {
+		5, 1, 1, 0,  6, 2, 2, 0,
+		1, 0, 0, 0,  2, 0, 0, 1,  3, 0, 0, 2,  4, 0, 0, 3,  7, 0, 0, 4
+	};
+
+	const FLANDMARK_Options * options = &model->data.options;
+	const int M = options->M;
+	const int * mapTable = model->data.mapTable;
+	const int * tree = options->nEdges > 0 ? options->edges : defaultTree;
+	const int nEdges = options->nEdges > 0 ? options->nEdges : (int)(sizeof(defaultTree)/sizeof(defaultTree[0])/4);
+
+	// PsiGS0-2, then the extra tables of the topology block
+	const FLANDMARK_PSIG * PsiG[3+255] = {options->PsiGS0, options->PsiGS1, options->PsiGS2};
+	int PsiGRows[3+255] = {options->PSIG_ROWS[0], options->PSIG_ROWS[1], options->PSIG_ROWS[2]};
+	int PsiGCols[3+255] = {options->PSIG_COLS[0], options->PSIG_COLS[1], options->PSIG_COLS[2]};
+	const int nTables = 3 + options->nPsiGX;
+	for (int t = 0; t < options->nPsiGX; ++t)
+	{
+		PsiG[3+t] = options->PsiGX[t];
+		PsiGRows[3+t] = options->PSIGX_ROWS[t];
+		PsiGCols[3+t] = options->PSIGX_COLS[t];
+	}
+
+	flandmark_free_edges(model);
+	if (flandmark_check_tree(M, tree, nEdges))
+	{
+		return 1;
+	}
+	for (int e = 0; e < nEdges; ++e)
+	{
+		const int table = tree[INDEX(2, e, 4)], col = tree[INDEX(3, e, 4)];
+		if (table < 0 || table >= nTables || col < 0 || col >= PsiGCols[table])
 		{
-			return ERROR_DATA_LBP;
+			return 1;
 		}
 	}
 
-	// check model->data.options.S
-	printf( "Checking model->data.options.S... ");
-	flag = true;
-	for (int i = 0; i < 4*M; ++i)
+	if (model->Wf)
 	{
-		if (model->data.options.S[i] != tst->data.options.S[i])
+		for (int i = 0; i < model->W_ROWS; ++i)
 		{
-			flag = false;
-			printf( "\n%d: %d ; %d", i, model->data.options.S[i], tst->data.options.S[i]);
-			printf("Error.");
+			model->Wf[i] = (float)model->W[i];
 		}
 	}
-	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-	if (!flag)
+
+	model->edges = (FLANDMARK_EDGE*)calloc(nEdges, sizeof(FLANDMARK_EDGE));
+	if (model->edges == NULL)
 	{
-		return ERROR_DATA_OPTIONS_S;
+		return 1;
 	}
+	model->nEdges = nEdges;
 
-	// check model->data.options.PsiG
-	FLANDMARK_PSIG *PsiGi = NULL, *PsiGiTst = NULL;
-	for (int psig_idx = 0; psig_idx < 3; ++psig_idx)
+	for (int e = 0; e < nEdges; ++e)
 	{
-		switch(psig_idx)
+		FLANDMARK_EDGE * edge = &model->edges[e];
+		const int table = tree[INDEX(2, e, 4)], col = tree[INDEX(3, e, 4)];
+		const int rows = PsiGRows[table];
+		edge->parent = tree[INDEX(1, e, 4)];
+		edge->child = tree[INDEX(0, e, 4)];
+		const double * g = model->W+mapTable[INDEX(edge->child, 2, M)]-1;
+		const int tsize = mapTable[INDEX(edge->child, 3, M)] - mapTable[INDEX(edge->child, 2, M)] + 1;
+
+		edge->nParent = rows;
+		edge->nChild = model->data.lbp[edge->child].WINS_COLS;
+		if (edge->nParent != model->data.lbp[edge->parent].WINS_COLS)
 		{
-			case 0:
-				PsiGi = (model->data.options.PsiGS0);
-				PsiGiTst = (tst->data.options.PsiGS0);
-				break;
-			case 1:
-				PsiGi = (model->data.options.PsiGS1);
-				PsiGiTst = (tst->data.options.PsiGS1);
-				break;
-			case 2:
-				PsiGi = (model->data.options.PsiGS2);
-				PsiGiTst = (tst->data.options.PsiGS2);
-				break;
+			flandmark_free_edges(model);
+			return 1;
 		}
-		flag = true;
-		printf( "Checking model->data.options.PsiGS%d\n", psig_idx);
+
+		// rows are filled up to cols[i] only; the rest of the tables stays zero
+		edge->cols = (int*)malloc(edge->nParent*sizeof(int));
+		edge->costs = (double*)calloc(edge->nParent*edge->nChild, sizeof(double));
+		if (edge->cols == NULL || edge->costs == NULL)
+		{
+			flandmark_free_edges(model);
+			return 1;
+		}
+
+		for (int i = 0; i < edge->nParent; ++i)
+		{
+			const FLANDMARK_PSIG * psig = &PsiG[table][INDEX(i, col, rows)];
+			if (psig->COLS > edge->nChild || psig->ROWS != tsize)
+			{
+				flandmark_free_edges(model);
+				return 1;
+			}
+			edge->cols[i] = psig->COLS;
+
+			// same summation as flandmark_maximize_gdotprod
+			double * costs = &edge->costs[i*edge->nChild];
+			for (int dp_i = 0; dp_i < psig->COLS; ++dp_i)
+			{
+				double dotprod = 0.0f;
+				for (int dp_j = 0; dp_j < tsize; ++dp_j)
+				{
+					dotprod += g[dp_j]*(double)(psig->disp[dp_i*tsize+dp_j]);
+				}
+				costs[dp_i] = dotprod;
+			}
+		}
+
+		if (model->Wf)
+		{
+			edge->costsf = (float*)calloc(edge->nParent*edge->nChild, sizeof(float));
+			if (edge->costsf == NULL)
+			{
+				flandmark_free_edges(model);
+				return 1;
+			}
+			for (int j = 0; j < edge->nParent*edge->nChild; ++j)
+			{
+				edge->costsf[j] = (float)edge->costs[j];
+			}
+		}
+
+		if (model->quant)
+		{
+			// costs rounded to the units of the scores
+			edge->costsi = (int32_t*)calloc(edge->nParent*edge->nChild, sizeof(int32_t));
+			if (edge->costsi == NULL)
+			{
+				flandmark_free_edges(model);
+				return 1;
+			}
+			for (int i = 0; i < edge->nParent; ++i)
+			{
+				for (int j = 0; j < edge->cols[i]; ++j)
+				{
+					double cost = ldexp(edge->costs[i*edge->nChild + j], model->quant->scale);
+					if (fabs(cost) > INT32_MAX)
+					{
+						flandmark_free_edges(model);
+						return 1;
+					}
+					edge->costsi[i*edge->nChild + j] = (int32_t)lround(cost);
+				}
+			}
+		}
+
+		flandmark_edge_quadratic(edge, model, PsiG[table], col, rows, g);
+
+		edge->rowMax = (double*)malloc(edge->nParent*sizeof(double));
+		if (edge->rowMax == NULL)
+		{
+			flandmark_free_edges(model);
+			return 1;
+		}
+		edge->maxCost = -DBL_MAX;
+		for (int i = 0; i < edge->nParent; ++i)
+		{
+			edge->rowMax[i] = -DBL_MAX;
+			for (int j = 0; j < edge->cols[i]; ++j)
+			{
+				edge->rowMax[i] = FLANDMARK_MAX(edge->rowMax[i], edge->costs[i*edge->nChild + j]);
+			}
+			edge->maxCost = FLANDMARK_MAX(edge->maxCost, edge->rowMax[i]);
+		}
+	}
+
+	// a window gets at most the largest weight of every cell
+	model->qBound = (double*)malloc(M*sizeof(double));
+	if (model->qBound == NULL)
+	{
+		flandmark_free_edges(model);
+		return 1;
+	}
+	for (int idx = 0; idx < M; ++idx)
+	{
+		const double * W = model->W + mapTable[INDEX(idx, 0, M)]-1;
+		const int length = mapTable[INDEX(idx, 1, M)] - mapTable[INDEX(idx, 0, M)] + 1;
+		model->qBound[idx] = 0.0;
+		for (int cell = 0; cell < length/256; ++cell)
+		{
+			double maximum = -DBL_MAX;
+			for (int pattern = 0; pattern < 256; ++pattern)
+			{
+				maximum = FLANDMARK_MAX(maximum, W[256*cell + pattern]);
+			}
+			model->qBound[idx] += maximum;
+		}
+	}
+
+	// scores are computed in the precision of the model while the bounds above are in double: in fixed point,
+	// every cell weight may be rounded up by half a unit of its component and every cost by half a unit of the
+	// scores; in floating point, every cell, component and edge adds at most one rounding of the largest
+	// magnitude a tree can reach
+	model->boundMargin = 0.0;
+	if (model->quant)
+	{
+		for (int idx = 0; idx < M; ++idx)
+		{
+			const int length = mapTable[INDEX(idx, 1, M)] - mapTable[INDEX(idx, 0, M)] + 1;
+			model->boundMargin += (length/256)*ldexp(0.5, -model->quant->shift[idx]);
+		}
+		model->boundMargin += model->nEdges*ldexp(0.5, -model->quant->scale);
+	} else {
+		double magnitude = 0.0;
+		int nTerms = M + model->nEdges;
+		for (int idx = 0; idx < M; ++idx)
+		{
+			const double * W = model->W + mapTable[INDEX(idx, 0, M)]-1;
+			const int length = mapTable[INDEX(idx, 1, M)] - mapTable[INDEX(idx, 0, M)] + 1;
+			double maximum = 0.0;
+			for (int j = 0; j < length; ++j)
+			{
+				maximum = FLANDMARK_MAX(maximum, fabs(W[j]));
+			}
+			magnitude += (length/256)*maximum;
+			nTerms += length/256;
+		}
+		for (int e = 0; e < model->nEdges; ++e)
+		{
+			const FLANDMARK_EDGE * edge = &model->edges[e];
+			double maximum = 0.0;
+			for (int i = 0; i < edge->nParent; ++i)
+			{
+				for (int j = 0; j < edge->cols[i]; ++j)
+				{
+					maximum = FLANDMARK_MAX(maximum, fabs(edge->costs[i*edge->nChild + j]));
+				}
+			}
+			magnitude += maximum;
+		}
+		model->boundMargin = nTerms*(model->Wf ? FLT_EPSILON : DBL_EPSILON)*magnitude;
+	}
+
+	if (model->quant && flandmark_quant_bound(model) > INT32_MAX)
+	{
+		flandmark_free_edges(model);
+		return 1;
+	}
+
+	return 0;
+}
+
+void flandmark_free_edges(FLANDMARK_Model* model)
+{
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		free(model->edges[e].cols);
+		free(model->edges[e].costs);
+		free(model->edges[e].costsf);
+		free(model->edges[e].costsi);
+		free(model->edges[e].rowMax);
+		free(model->edges[e].px);
+		free(model->edges[e].py);
+		free(model->edges[e].qx);
+		free(model->edges[e].qy);
+	}
+	free(model->edges);
+	model->edges = 0;
+	model->nEdges = 0;
+	free(model->qBound);
+	model->qBound = 0;
+}
+
+// offset of the code of every cell from the window corner, read as liblbp_codemap_source reads the pattern
+template <bool MIRRORED>
+struct flandmark_cell_source
+{
+	uint32_t nRows, planeSize, winCols;
+
+	uint32_t pattern(uint32_t level, uint32_t y, uint32_t x) const
+	{
+		uint32_t s = 1u << level;
+		uint32_t col = MIRRORED ? winCols - s*(x+1) : s*x;
+		return level*planeSize + col*nRows + s*y;
+	}
+	void reduce(uint32_t, uint32_t) {}
+};
+
+struct flandmark_cell_consumer
+{
+	uint32_t *offsets;
+	uint32_t nCells, count;
+
+	void operator()(uint32_t cell, uint32_t offset)
+	{
+		if (cell < nCells)
+		{
+			offsets[cell] = offset;
+		}
+		++count;
+	}
+};
+
+int flandmark_precompute_cells(FLANDMARK_Model* model)
+{
+	const int M = model->data.options.M;
+	const uint32_t nRows = model->data.imSize[0], planeSize = nRows*model->data.imSize[1];
+
+	flandmark_free_cells(model);
+	model->cells = (uint32_t**)calloc(M, sizeof(uint32_t*));
+	if (model->cells == NULL)
+	{
+		return 1;
+	}
+	for (int idx = 0; idx < M; ++idx)
+	{
+		const FLANDMARK_LBP * lbp = &model->data.lbp[idx];
+		const uint32_t nCells = liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256;
+		model->cells[idx] = (uint32_t*)malloc(2*nCells*sizeof(uint32_t));
+		if (model->cells[idx] == NULL)
+		{
+			flandmark_free_cells(model);
+			return 1;
+		}
+
+		liblbp_dynamic_geometry geom(lbp->winSize[0], lbp->winSize[1], liblbp_pyr_levels(lbp->winSize[0], lbp->winSize[1], nCells));
+		flandmark_cell_source<false> plain = {nRows, planeSize, (uint32_t)lbp->winSize[1]};
+		flandmark_cell_source<true> mirrored = {nRows, planeSize, (uint32_t)lbp->winSize[1]};
+		flandmark_cell_consumer cells = {model->cells[idx], nCells, 0};
+		liblbp_pyr_engine(geom, plain, cells);
+		flandmark_cell_consumer mirroredCells = {model->cells[idx] + nCells, nCells, 0};
+		liblbp_pyr_engine(geom, mirrored, mirroredCells);
+		if (cells.count != nCells || mirroredCells.count != nCells)
+		{
+			flandmark_free_cells(model);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void flandmark_free_cells(FLANDMARK_Model* model)
+{
+	if (!model->cells)
+	{
+		return;
+	}
+	for (int idx = 0; idx < model->data.options.M; ++idx)
+	{
+		free(model->cells[idx]);
+	}
+	free(model->cells);
+	model->cells = 0;
+}
+
+int flandmark_quantize(FLANDMARK_Model* model)
+{
+	const int M = model->data.options.M;
+	const int * mapTable = model->data.mapTable;
+
+	flandmark_free_quantized(model);
+	if (model->nEdges == 0)
+	{
+		return 1;
+	}
+
+	FLANDMARK_QUANT * quant = (FLANDMARK_QUANT*)calloc(1, sizeof(FLANDMARK_QUANT));
+	if (quant == NULL)
+	{
+		return 1;
+	}
+	quant->W = (int16_t*)calloc(model->W_ROWS, sizeof(int16_t));
+	quant->shift = (int*)malloc(M*sizeof(int));
+	if (quant->W == NULL || quant->shift == NULL)
+	{
+		free(quant->W);
+		free(quant->shift);
+		free(quant);
+		return 1;
+	}
+
+	// the finest power of two at which the largest appearance weight of every component fits int16, and the
+	// largest score of the tree in the units of W (see flandmark_quant_bound)
+	double bound = 0.0;
+	quant->scale = -1000;
+	for (int idx = 0; idx < M; ++idx)
+	{
+		double maximum = 0.0;
+		for (int j = mapTable[INDEX(idx, 0, M)]-1; j < mapTable[INDEX(idx, 1, M)]; ++j)
+		{
+			maximum = FLANDMARK_MAX(maximum, fabs(model->W[j]));
+		}
+		int exponent;
+		frexp(maximum, &exponent);
+		int shift = 15 - exponent;
+		if (lround(ldexp(maximum, shift)) > INT16_MAX)
+		{
+			--shift;
+		}
+		quant->shift[idx] = shift;
+		quant->scale = FLANDMARK_MAX(quant->scale, shift);
+
+		const FLANDMARK_LBP * lbp = &model->data.lbp[idx];
+		bound += maximum*(liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256);
+	}
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+		double maximum = 0.0;
+		for (int i = 0; i < edge->nParent; ++i)
+		{
+			for (int j = 0; j < edge->cols[i]; ++j)
+			{
+				maximum = FLANDMARK_MAX(maximum, fabs(edge->costs[i*edge->nChild + j]));
+			}
+		}
+		bound += maximum;
+	}
+
+	// the finest unit for which twice the bound fits int32, the margin covers the rounding; components finer
+	// than the unit are rounded at the unit
+	while (ldexp(2.0*bound, quant->scale) > INT32_MAX)
+	{
+		--quant->scale;
+	}
+	int error = 0;
+	for (int idx = 0; idx < M; ++idx)
+	{
+		quant->shift[idx] = FLANDMARK_MIN(quant->shift[idx], quant->scale);
+		error |= quant->scale - quant->shift[idx] > 30;
+	}
+	if (error)
+	{
+		free(quant->W);
+		free(quant->shift);
+		free(quant);
+		return 1;
+	}
+
+	for (int idx = 0; idx < M; ++idx)
+	{
+		for (int j = mapTable[INDEX(idx, 0, M)]-1; j < mapTable[INDEX(idx, 1, M)]; ++j)
+		{
+			quant->W[j] = (int16_t)lround(ldexp(model->W[j], quant->shift[idx]));
+		}
+	}
+
+	model->quant = quant;
+	if (flandmark_precompute_edges(model))
+	{
+		flandmark_free_quantized(model);
+		return 1;
+	}
+
+	return 0;
+}
+
+int flandmark_write_quantized(const char* filename, const FLANDMARK_Model* model)
+{
+	const int M = model->data.options.M;
+	const FLANDMARK_QUANT * quant = model->quant;
+	if (quant == NULL)
+	{
+		return 1;
+	}
+
+	FILE *fout;
+	if ((fout = fopen(filename, "wb")) == NULL)
+	{
+		printf("Error opening file %s\n", filename);
+		return 1;
+	}
+
+	// tag and sizes of the model it belongs to, then the scales and the weights
+	const int header[4] = {FLANDMARK_QUANTIZED_TAG, model->W_ROWS, M, quant->scale};
+	int error = fwrite(header, sizeof(header), 1, fout) != 1 ||
+		fwrite(quant->shift, M*sizeof(int), 1, fout) != 1 ||
+		fwrite(quant->W, model->W_ROWS*sizeof(int16_t), 1, fout) != 1;
+	if (fclose(fout) != 0 || error)
+	{
+		printf("Error writing file %s\n", filename);
+		return 1;
+	}
+
+	return 0;
+}
+
+int flandmark_read_quantized(const char* filename, FLANDMARK_Model* model)
+{
+	const int M = model->data.options.M;
+
+	FILE *fin;
+	if ((fin = fopen(filename, "rb")) == NULL)
+	{
+		printf("Error opening file %s\n", filename);
+		return 1;
+	}
+
+	int header[4];
+	if (fread(header, sizeof(header), 1, fin) != 1 || header[0] != FLANDMARK_QUANTIZED_TAG ||
+		header[1] != model->W_ROWS || header[2] != M)
+	{
+		fclose(fin);
+		printf("Error reading file %s\n", filename);
+		return 1;
+	}
+	const int W_ROWS = header[1], scale = header[3];
+
+	FLANDMARK_QUANT * quant = (FLANDMARK_QUANT*)calloc(1, sizeof(FLANDMARK_QUANT));
+	if (quant == NULL)
+	{
+		fclose(fin);
+		return 1;
+	}
+	quant->scale = scale;
+	quant->W = (int16_t*)malloc(W_ROWS*sizeof(int16_t));
+	quant->shift = (int*)malloc(M*sizeof(int));
+	int error = quant->W == NULL || quant->shift == NULL ||
+		fread(quant->shift, M*sizeof(int), 1, fin) != 1 ||
+		fread(quant->W, W_ROWS*sizeof(int16_t), 1, fin) != 1;
+	fclose(fin);
+	for (int idx = 0; !error && idx < M; ++idx)
+	{
+		error = quant->shift[idx] > scale || scale - quant->shift[idx] > 30;
+	}
+	if (error)
+	{
+		printf("Error reading file %s\n", filename);
+		free(quant->W);
+		free(quant->shift);
+		free(quant);
+		return 1;
+	}
+
+	flandmark_free_quantized(model);
+	model->quant = quant;
+	if (flandmark_precompute_edges(model))
+	{
+		flandmark_free_quantized(model);
+		return 1;
+	}
+
+	return 0;
+}
+
+void flandmark_free_quantized(FLANDMARK_Model* model)
+{
+	if (!model->quant)
+		return;
+
+	free(model->quant->W);
+	free(model->quant->shift);
+	free(model->quant);
+	model->quant = 0;
+}
+
+EError_T flandmark_check_model(FLANDMARK_Model* model, FLANDMARK_Model* tst)
+{
+	bool flag = false;
+	int tsize = -1, tmp_tsize = -1;
+
+	// check model->data.options.M
+	printf("Checking mode->data.options.M...");
+	flag = true;
+	if (model->data.options.M != tst->data.options.M)
+	{
+		flag = false;
+		printf("\n: %d ; %d", model->data.options.M, tst->data.options.M);
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_M;
+	}
+
+	int M = model->data.options.M;
+
+	// chceck model->data.options.bw
+	printf("Checking mode->data.options.bw...");
+	flag = true;
+	if (model->data.options.bw[0] != tst->data.options.bw[0] ||
+			model->data.options.bw[1] != tst->data.options.bw[1])
+	{
+		flag = false;
+		printf("\n: %d ; %d", model->data.options.bw[0], tst->data.options.bw[0]);
+		printf("\n: %d ; %d", model->data.options.bw[1], tst->data.options.bw[1]);
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_BW;
+	}
+
+	// chceck model->data.options.bw_margin
+	printf("Checking mode->data.options.bw_margin...");
+	flag = true;
+	if (model->data.options.bw_margin[0] != tst->data.options.bw_margin[0] ||
+			model->data.options.bw_margin[1] != tst->data.options.bw_margin[1])
+	{
+		flag = false;
+		printf("\n: %d ; %d", model->data.options.bw_margin[0], tst->data.options.bw_margin[0]);
+		printf("\n: %d ; %d", model->data.options.bw_margin[1], tst->data.options.bw_margin[1]);
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_BW_MARGIN;
+	}
+
+	// check model->W
+	printf( "Checking model->W... ");
+	flag = true;
+	for (int i = 0; i < tst->W_ROWS; ++i)
+	{
+		if (model->W[i] != tst->W[i])
+		{
+			flag = false;
+			printf( "\n%d: %f ; %f", i, model->W[i], tst->W[i]);
+			printf( "Error.");
+		}
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_W;
+	}
+
+	// check model->data.mapTable
+	printf( "Checking model->data.mapTable... ");
+	flag = true;
+	for (int i = 0; i < M*4; ++i)
+	{
+		if (model->data.mapTable[i] != tst->data.mapTable[i])
+		{
+			flag = false;
+			printf( "\n%d: %d ; %d", i, model->data.mapTable[i], tst->data.mapTable[i]);
+			printf( "Error.");
+		}
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_DATA_MAPTABLE;
+	}
+
+	// load model->data.lbp ---------------------------------------------------
+	for (int idx = 0; idx < model->data.options.M; ++idx)
+	{
+		flag = true;
+		printf( "checking lbp[%d]... ", idx);
+
+		for (int i = 0; i < 2; ++i)
+		{
+			if (tst->data.lbp[idx].winSize[i] != model->data.lbp[idx].winSize[i])
+			{
+				flag = false;
+				printf( "\n%d: %d ; %d", i, model->data.lbp[idx].winSize[i], tst->data.lbp[idx].winSize[i]);
+				printf( "Error.");
+			}
+		}
+
+		// lbp{idx}.hop
+		if (tst->data.lbp[idx].hop != model->data.lbp[idx].hop)
+		{
+			flag = false;
+			printf( "\n %d ; %d", model->data.lbp[idx].hop, tst->data.lbp[idx].hop);
+			printf( "Error.");
+		}
+
+		// lbp{idx}.wins
+		tsize = tst->data.lbp[idx].WINS_ROWS*tst->data.lbp[idx].WINS_COLS;
+		for (int i = 0; i < tsize; ++i)
+		{
+			if (model->data.lbp[idx].wins[i] != tst->data.lbp[idx].wins[i])
+			{
+				flag = false;
+				printf( "\n%d: %d ; %d", i, model->data.lbp[idx].wins[i], tst->data.lbp[idx].wins[i]);
+				printf( "Error.");
+			}
+		}
+		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+		if (!flag)
+		{
+			return ERROR_DATA_LBP;
+		}
+	}
+
+	// check model->data.options.S
+	printf( "Checking model->data.options.S... ");
+	flag = true;
+	for (int i = 0; i < 4*M; ++i)
+	{
+		if (model->data.options.S[i] != tst->data.options.S[i])
+		{
+			flag = false;
+			printf( "\n%d: %d ; %d", i, model->data.options.S[i], tst->data.options.S[i]);
+			printf("Error.");
+		}
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_DATA_OPTIONS_S;
+	}
+
+	// check model->data.options.PsiG
+	FLANDMARK_PSIG *PsiGi = NULL, *PsiGiTst = NULL;
+	for (int psig_idx = 0; psig_idx < 3; ++psig_idx)
+	{
+		switch(psig_idx)
+		{
+			case 0:
+				PsiGi = (model->data.options.PsiGS0);
+				PsiGiTst = (tst->data.options.PsiGS0);
+				break;
+			case 1:
+				PsiGi = (model->data.options.PsiGS1);
+				PsiGiTst = (tst->data.options.PsiGS1);
+				break;
+			case 2:
+				PsiGi = (model->data.options.PsiGS2);
+				PsiGiTst = (tst->data.options.PsiGS2);
+				break;
+		}
+		flag = true;
+		printf( "Checking model->data.options.PsiGS%d\n", psig_idx);
 		printf( "options.PSIG_ROWS[%d]; options.PSIG_COLS[%d]... ", psig_idx, psig_idx);
 		if (model->data.options.PSIG_ROWS[psig_idx] != tst->data.options.PSIG_ROWS[psig_idx] ||
 				model->data.options.PSIG_COLS[psig_idx] != tst->data.options.PSIG_COLS[psig_idx])
 		{
-			flag = false;
-			printf("Error.");
+			flag = false;
+			printf("Error.");
+		}
+		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+		if (!flag)
+		{
+			return ERROR_DATA_OPTIONS_PSIG;
+		}
+		// disp
+		flag = true;
+		tsize = tst->data.options.PSIG_ROWS[psig_idx]*tst->data.options.PSIG_COLS[psig_idx];
+		printf( "options.PsiGS%d...", psig_idx);
+		for (int idx = 0; idx < tsize; ++idx)
+		{
+			if (PsiGi[idx].ROWS != PsiGiTst[idx].ROWS ||
+					PsiGi[idx].COLS != PsiGiTst[idx].COLS)
+			{
+                printf( "\nPsiGS%d[%d].ROWS\n", psig_idx, idx);
+				flag = false;
+				printf("Error.");
+			}
+			tmp_tsize = PsiGiTst[idx].ROWS*PsiGiTst[idx].COLS;
+			for (int i = 0; i < tmp_tsize; ++i)
+			{
+				if (PsiGi[idx].disp[i] != PsiGiTst[idx].disp[i])
+				{
+					flag = false;
+					printf( "\nPsiGS%d[%d] =  %d; %d\n", psig_idx, idx, PsiGi[idx].disp[i], PsiGiTst[idx].disp[i]);
+					printf( "Error.");
+				}
+			}
+		}
+		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+		if (!flag)
+		{
+			return ERROR_DATA_OPTIONS_PSIG;
+		}
+	}
+
+	// check model->data.options topology
+	printf( "Checking model->data.options topology... ");
+	const FLANDMARK_Options * options = &model->data.options, * optionsTst = &tst->data.options;
+	flag = options->nEdges == optionsTst->nEdges && options->nPsiGX == optionsTst->nPsiGX
+			&& (options->nEdges == 0 || !memcmp(options->edges, optionsTst->edges, 4*options->nEdges*sizeof(int)));
+	for (int t = 0; t < options->nPsiGX && flag; ++t)
+	{
+		flag = options->PSIGX_ROWS[t] == optionsTst->PSIGX_ROWS[t] && options->PSIGX_COLS[t] == optionsTst->PSIGX_COLS[t];
+		for (int idx = 0; idx < options->PSIGX_ROWS[t]*options->PSIGX_COLS[t] && flag; ++idx)
+		{
+			const FLANDMARK_PSIG * a = &options->PsiGX[t][idx], * b = &optionsTst->PsiGX[t][idx];
+			flag = a->ROWS == b->ROWS && a->COLS == b->COLS && !memcmp(a->disp, b->disp, a->ROWS*a->COLS*sizeof(int));
+		}
+	}
+	flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
+	if (!flag)
+	{
+		return ERROR_DATA_OPTIONS_TREE;
+	}
+	return NO_ERR;
+}
+
+void flandmark_free(FLANDMARK_Model* model)
+{
+	FLANDMARK_PSIG *PsiGi = NULL;
+	for (int psig_idx = 0; psig_idx < 3; ++psig_idx)
+	{
+		switch(psig_idx)
+		{
+			case 0:
+				PsiGi = (model->data.options.PsiGS0);
+				break;
+			case 1:
+				PsiGi = (model->data.options.PsiGS1);
+				break;
+			case 2:
+				PsiGi = (model->data.options.PsiGS2);
+				break;
+		}
+
+		// all disp share the block starting at the first one (see flandmark_init)
+		int tsize = model->data.options.PSIG_ROWS[psig_idx] * model->data.options.PSIG_COLS[psig_idx];
+		if (tsize > 0)
+		{
+			free(PsiGi[0].disp);
+		}
+		free(PsiGi);
+	}
+	for (int t = 0; t < model->data.options.nPsiGX; ++t)
+	{
+		if (model->data.options.PSIGX_ROWS[t]*model->data.options.PSIGX_COLS[t] > 0)
+		{
+			free(model->data.options.PsiGX[t][0].disp);
+		}
+		free(model->data.options.PsiGX[t]);
+	}
+	free(model->data.options.PsiGX);
+	free(model->data.options.PSIGX_ROWS);
+	free(model->data.options.PSIGX_COLS);
+	free(model->data.options.edges);
+
+	free(model->W);
+	free(model->Wf);
+	flandmark_free_quantized(model);
+	for (int i = 0; i < model->data.options.M; ++i)
+	{
+		free(model->data.lbp[i].wins);
+	}
+	free(model->data.lbp);
+	free(model->data.options.S);
+	free(model->data.mapTable);
+
+    //if (model->croppedImage)
+    //	cvReleaseImage(&model->croppedImage);
+
+    //if (model->resizedImage)
+    //	cvReleaseImage(&model->resizedImage);
+
+    if (model->normalizedImageFrame)
+		free(model->normalizedImageFrame);
+
+    if (model->bb)
+		free(model->bb);
+
+    if (model->sf)
+		free(model->sf);
+
+	flandmark_free_edges(model);
+	flandmark_free_cells(model);
+
+	free(model);
+}
+
+FLANDMARK_Context * flandmark_context_create(const FLANDMARK_Model* model)
+{
+	FLANDMARK_Context * context = (FLANDMARK_Context*)calloc(1, sizeof(FLANDMARK_Context));
+	if (context == NULL)
+	{
+		return 0;
+	}
+
+	context->normalizedImageFrame = (uint8_t*)calloc(model->data.options.bw[0]*model->data.options.bw[1], sizeof(uint8_t));
+	context->bb = (double*)calloc(4, sizeof(double));
+	context->sf = (float*)calloc(2, sizeof(float));
+	context->threshold = FLANDMARK_NO_THRESHOLD;
+	context->workspace = flandmark_workspace_create(model);
+	if (context->normalizedImageFrame == NULL || context->bb == NULL || context->sf == NULL || context->workspace == NULL)
+	{
+		flandmark_context_free(context);
+		return 0;
+	}
+
+	return context;
+}
+
+void flandmark_context_free(FLANDMARK_Context* context)
+{
+	if (!context)
+		return;
+
+	free(context->normalizedImageFrame);
+	free(context->bb);
+	free(context->sf);
+	flandmark_workspace_free(context->workspace);
+	free(context);
+}
+
+// reserves bytes at the next 64-byte boundary of the arena; with arena == 0 it only counts
+static void * flandmark_arena_take(char *arena, size_t *offset, size_t bytes)
+{
+	size_t start = (*offset + 63) & ~(size_t)63;
+	*offset = start + bytes;
+	return arena ? arena + start : 0;
+}
+
+// places nTables tables and the row buffer of a resampler into the frame bw in arena
+static void flandmark_resampler_layout(FLANDMARK_RESAMPLER *r, const int bw[2], int nTables, char *arena, size_t *offset)
+{
+	for (int t = 0; t < nTables; ++t)
+	{
+		FLANDMARK_RESAMPLER_TABLES * tables = &r->tables[t];
+		tables->width = tables->height = 0;
+		tables->interpolation = FLANDMARK_INTER_CUBIC;
+		tables->taps = 4;
+		tables->xofs = (int*)flandmark_arena_take(arena, offset, 4*bw[0]*sizeof(int));
+		tables->alpha = (int16_t*)flandmark_arena_take(arena, offset, 4*bw[0]*sizeof(int16_t));
+		tables->srcRows = (int*)flandmark_arena_take(arena, offset, 4*bw[1]*sizeof(int));
+		tables->yofs = (int*)flandmark_arena_take(arena, offset, 4*bw[1]*sizeof(int));
+		tables->beta = (float*)flandmark_arena_take(arena, offset, 4*bw[1]*sizeof(float));
+	}
+	r->nTables = nTables;
+	r->next = 0;
+	r->rows = (int32_t*)flandmark_arena_take(arena, offset, 4*bw[0]*bw[1]*sizeof(int32_t));
+}
+
+// places all buffers of the workspace in arena and returns the size they need
+static size_t flandmark_workspace_layout(FLANDMARK_Workspace *ws, const FLANDMARK_Model *model, char *arena)
+{
+	const int M = model->data.options.M;
+	const size_t size = ws->pyr.ROWS*ws->pyr.COLS;
+	size_t offset = 0;
+
+	ws->pyr.codes = (uint8_t*)flandmark_arena_take(arena, &offset, ws->pyr.nLevels*size*sizeof(uint8_t));
+	ws->pyr.mirrored = (uint8_t*)flandmark_arena_take(arena, &offset, ws->pyr.nLevels*size*sizeof(uint8_t));
+	ws->pyr.sums = (uint32_t*)flandmark_arena_take(arena, &offset, ws->pyr.nLevels*size*sizeof(uint32_t));
+
+	ws->q = (double**)flandmark_arena_take(arena, &offset, M*sizeof(double*));
+	ws->scores = (double**)flandmark_arena_take(arena, &offset, M*sizeof(double*));
+	for (int idx = 0; idx < M; ++idx)
+	{
+		double * q = (double*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(double));
+		double * scores = (double*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(double));
+		if (arena)
+		{
+			ws->q[idx] = q;
+			ws->scores[idx] = scores;
 		}
-		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-		if (!flag)
+	}
+
+	// single precision models score in float
+	ws->qf = 0;
+	ws->scoresf = 0;
+	if (model->Wf)
+	{
+		ws->qf = (float**)flandmark_arena_take(arena, &offset, M*sizeof(float*));
+		ws->scoresf = (float**)flandmark_arena_take(arena, &offset, M*sizeof(float*));
+		for (int idx = 0; idx < M; ++idx)
 		{
-			return ERROR_DATA_OPTIONS_PSIG;
+			float * q = (float*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(float));
+			float * scores = (float*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(float));
+			if (arena)
+			{
+				ws->qf[idx] = q;
+				ws->scoresf[idx] = scores;
+			}
 		}
-		// disp
-		flag = true;
-		tsize = tst->data.options.PSIG_ROWS[psig_idx]*tst->data.options.PSIG_COLS[psig_idx];
-		printf( "options.PsiGS%d...", psig_idx);
-		for (int idx = 0; idx < tsize; ++idx)
+	}
+
+	// quantized models score in fixed point
+	ws->qi = 0;
+	ws->scoresi = 0;
+	if (model->quant)
+	{
+		ws->qi = (int32_t**)flandmark_arena_take(arena, &offset, M*sizeof(int32_t*));
+		ws->scoresi = (int32_t**)flandmark_arena_take(arena, &offset, M*sizeof(int32_t*));
+		for (int idx = 0; idx < M; ++idx)
 		{
-			if (PsiGi[idx].ROWS != PsiGiTst[idx].ROWS ||
-					PsiGi[idx].COLS != PsiGiTst[idx].COLS)
+			int32_t * q = (int32_t*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(int32_t));
+			int32_t * scores = (int32_t*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(int32_t));
+			if (arena)
 			{
-                printf( "\nPsiGS%d[%d].ROWS\n", psig_idx, idx);
-				flag = false;
-				printf("Error.");
+				ws->qi[idx] = q;
+				ws->scoresi[idx] = scores;
+			}
+		}
+	}
+
+	ws->best = (int**)flandmark_arena_take(arena, &offset, model->nEdges*sizeof(int*));
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		int * best = (int*)flandmark_arena_take(arena, &offset, model->edges[e].nParent*sizeof(int));
+		if (arena)
+			ws->best[e] = best;
+	}
+	ws->indices = (int*)flandmark_arena_take(arena, &offset, M*sizeof(int));
+
+	size_t dtScores = 0, dtBest = 0, dtSites = 0;
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+		if (!edge->quadratic)
+			continue;
+		dtScores = FLANDMARK_MAX(dtScores, (size_t)(edge->nPy*edge->childCols + edge->nPx));
+		dtBest = FLANDMARK_MAX(dtBest, (size_t)(edge->nPy*edge->childCols + edge->nPx*edge->nPy));
+		dtSites = FLANDMARK_MAX(dtSites, (size_t)FLANDMARK_MAX(edge->childRows, edge->childCols));
+	}
+	ws->dtScores = (double*)flandmark_arena_take(arena, &offset, dtScores*sizeof(double));
+	ws->dtBounds = (double*)flandmark_arena_take(arena, &offset, (dtSites+1)*sizeof(double));
+	ws->dtBest = (int*)flandmark_arena_take(arena, &offset, dtBest*sizeof(int));
+	ws->dtSites = (int*)flandmark_arena_take(arena, &offset, dtSites*sizeof(int));
+
+	flandmark_resampler_layout(&ws->resampler, model->data.options.bw, FLANDMARK_RESAMPLER_CACHE, arena, &offset);
+
+	const int root = model->nEdges ? model->edges[model->nEdges-1].parent : 0;
+	ws->candidates = (FLANDMARK_CANDIDATE*)flandmark_arena_take(arena, &offset, model->data.lbp[root].WINS_COLS*sizeof(FLANDMARK_CANDIDATE));
+
+	ws->windows = (int**)flandmark_arena_take(arena, &offset, M*sizeof(int*));
+	ws->nWindows = (int*)flandmark_arena_take(arena, &offset, M*sizeof(int));
+	for (int idx = 0; idx < M; ++idx)
+	{
+		int * windows = (int*)flandmark_arena_take(arena, &offset, model->data.lbp[idx].WINS_COLS*sizeof(int));
+		if (arena)
+			ws->windows[idx] = windows;
+	}
+
+	return offset;
+}
+
+FLANDMARK_Workspace * flandmark_workspace_create(const FLANDMARK_Model* model)
+{
+	FLANDMARK_Workspace * ws = (FLANDMARK_Workspace*)calloc(1, sizeof(FLANDMARK_Workspace));
+	if (ws == NULL)
+	{
+		return 0;
+	}
+
+	ws->pyr.ROWS = model->data.imSize[0];
+	ws->pyr.COLS = model->data.imSize[1];
+	ws->pyr.nLevels = flandmark_lbp_pyramid_levels(model);
+
+	ws->arena = (char*)malloc(flandmark_workspace_layout(ws, model, 0));
+	if (ws->arena == NULL)
+	{
+		flandmark_workspace_free(ws);
+		return 0;
+	}
+	flandmark_workspace_layout(ws, model, ws->arena);
+
+	return ws;
+}
+
+void flandmark_workspace_free(FLANDMARK_Workspace* workspace)
+{
+	if (!workspace)
+		return;
+
+	free(workspace->arena);
+	free(workspace);
+}
+
+void flandmark_get_psi_mat(FLANDMARK_PSI* Psi, FLANDMARK_Model* model, int lbpidx)
+{
+	char * Features;
+    const uint8_t * Images = model->normalizedImageFrame;
+	uint32_t im_H = (uint32_t)model->data.imSize[0]; uint32_t im_W = (uint32_t)model->data.imSize[1];
+    const uint32_t * Wins = model->data.lbp[lbpidx].wins;
+	uint16_t win_H = (uint16_t)model->data.lbp[lbpidx].winSize[0]; uint16_t win_W = (uint16_t)model->data.lbp[lbpidx].winSize[1];
+	uint16_t nPyramids = model->data.lbp[lbpidx].hop;
+	uint32_t nDim = liblbp_pyr_get_dim(win_H, win_W, nPyramids); uint32_t nData = model->data.lbp[lbpidx].WINS_COLS;
+
+	Features = (char*)calloc(nDim*nData, sizeof(char));
+	if (Features == NULL)
+	{
+		printf( "Not enough memory for LBP features.\n");
+		exit(1);
+	}
+	Psi->PSI_ROWS = nDim; Psi->PSI_COLS = nData;
+
+    uint32_t cnt0, mirror, x, x1, y, y1, idx, *win;
+    const uint8_t *img_ptr;
+
+	win = (uint32_t*)malloc(win_H*win_W*sizeof(uint32_t));
+	if(win == NULL)
+	{
+		printf( "Not enough memory for cropped_window.\n");
+		exit(1);
+	}
+
+	for(uint32_t i = 0; i < nData; ++i)
+	{
+		idx = Wins[INDEX(0,i,4)]-1;
+		x1  = Wins[INDEX(1,i,4)]-1;
+		y1  = Wins[INDEX(2,i,4)]-1;
+		mirror = Wins[INDEX(3,i,4)];
+
+		img_ptr = &Images[idx*im_H*im_W];
+
+		cnt0 = 0;
+
+		if(mirror == 0)
+		{
+			for(x=x1; x < x1+win_W; x++)
+				for(y=y1; y < y1+win_H; y++)
+					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+		} else {
+			for(x=x1+win_W-1; x >= x1; x--)
+				for(y=y1; y < y1+win_H; y++)
+					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+		}
+		liblbp_pyr_features(&Features[nDim*i], nDim, win, win_H, win_W);
+	}
+	free(win);
+
+	Psi->data = Features;
+}
+
+void flandmark_get_psi_mat_sparse(FLANDMARK_PSI_SPARSE* Psi, FLANDMARK_Model* model, int lbpidx)
+{
+	t_index * Features;
+	uint8_t * Images = model->normalizedImageFrame;
+	uint32_t im_H = (uint32_t)model->data.imSize[0];
+	uint32_t im_W = (uint32_t)model->data.imSize[1];
+	uint32_t * Wins = model->data.lbp[lbpidx].wins;
+	uint16_t win_H = (uint16_t)model->data.lbp[lbpidx].winSize[0];
+	uint16_t win_W = (uint16_t)model->data.lbp[lbpidx].winSize[1];
+	uint16_t nPyramids = model->data.lbp[lbpidx].hop;
+	uint32_t nDim = liblbp_pyr_get_dim(win_H, win_W, nPyramids)/256;
+	uint32_t nData = model->data.lbp[lbpidx].WINS_COLS;
+
+    uint32_t cnt0, mirror, x, x1, y, y1, idx, *win;
+	uint8_t *img_ptr;
+
+	Features = (t_index*)calloc(nDim*nData, sizeof(t_index));
+	if (Features == NULL)
+	{
+		printf( "Not enough memory for LBP features.\n");
+		exit(1);
+	}
+
+	win = (uint32_t*)calloc(win_H*win_W, sizeof(uint32_t));
+	if(win == NULL)
+	{
+		printf( "Not enough memory for cropped_window.\n");
+		exit(1);
+	}
+
+	for(uint32_t i = 0; i < nData; ++i)
+	{
+		idx = Wins[INDEX(0,i,4)]-1;
+		x1  = Wins[INDEX(1,i,4)]-1;
+		y1  = Wins[INDEX(2,i,4)]-1;
+		mirror = Wins[INDEX(3,i,4)];
+
+		img_ptr = &Images[idx*im_H*im_W];
+
+		cnt0 = 0;
+
+		if(mirror == 0)
+		{
+			for(x=x1; x < x1+win_W; x++)
+				for(y=y1; y < y1+win_H; y++)
+					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+		} else {
+			for(x=x1+win_W-1; x >= x1; x--)
+				for(y=y1; y < y1+win_H; y++)
+					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+		}
+		liblbp_pyr_features_sparse(&Features[nDim*i], nDim, win, win_H, win_W);
+	}
+
+	Psi->PSI_COLS = nData;
+	Psi->PSI_ROWS = nDim;
+	Psi->idxs = Features;
+
+	free(win);
+}
+
+int flandmark_lbp_pyramid_levels(const FLANDMARK_Model* model)
+{
+	int nLevels = 0;
+	for (int idx = 0; idx < model->data.options.M; ++idx)
+	{
+		const FLANDMARK_LBP * lbp = &model->data.lbp[idx];
+		int levels = liblbp_pyr_levels(lbp->winSize[0], lbp->winSize[1], liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256);
+		if (levels > nLevels)
+			nLevels = levels;
+	}
+	return nLevels;
+}
+
+void flandmark_get_lbp_pyramid(FLANDMARK_LBP_PYRAMID* pyr, const uint8_t* face_img, const FLANDMARK_Model* model)
+{
+	pyr->ROWS = model->data.imSize[0];
+	pyr->COLS = model->data.imSize[1];
+	pyr->nLevels = flandmark_lbp_pyramid_levels(model);
+
+	uint32_t size = pyr->ROWS*pyr->COLS;
+	pyr->codes = (uint8_t*)malloc(pyr->nLevels*size*sizeof(uint8_t));
+	pyr->mirrored = (uint8_t*)malloc(pyr->nLevels*size*sizeof(uint8_t));
+	pyr->sums = (uint32_t*)malloc(size*sizeof(uint32_t));
+	if (pyr->codes == NULL || pyr->mirrored == NULL || pyr->sums == NULL)
+	{
+		printf( "Not enough memory for LBP pyramid.\n");
+		exit(1);
+	}
+
+	liblbp_pyr_codemaps(pyr->codes, pyr->mirrored, pyr->sums, face_img, pyr->ROWS, pyr->COLS, pyr->nLevels);
+}
+
+void flandmark_free_lbp_pyramid(FLANDMARK_LBP_PYRAMID* pyr)
+{
+	free(pyr->codes);
+	free(pyr->mirrored);
+	free(pyr->sums);
+	pyr->codes = pyr->mirrored = 0;
+	pyr->sums = 0;
+}
+
+// runs the LBP engine over every window of one component, reading the codes from the frame pyramid
+// one consumer per window kept in an array
+template <class Consumer>
+struct flandmark_consumer_array
+{
+	typedef Consumer consumer_type;
+	Consumer * consumers;
+
+	Consumer start(int i) const { return consumers[i]; }
+	void finish(int i, const Consumer& consumer) { consumers[i] = consumer; }
+};
+
+template <class Windows>
+struct flandmark_windows_body
+{
+	const FLANDMARK_LBP * lbp;
+	const FLANDMARK_LBP_PYRAMID * pyr;
+	Windows windows;
+	const int * list;  // windows to run, all if 0
+	int nList;
+
+	template <class Geometry>
+	void operator()(const Geometry& geom)
+	{
+		uint32_t im_H = (uint32_t)pyr->ROWS, size = im_H*(uint32_t)pyr->COLS;
+		const int n = list ? nList : lbp->WINS_COLS;
+		for (int k = 0; k < n; ++k)
+		{
+			const int i = list ? list[k] : k;
+			uint32_t x1 = lbp->wins[INDEX(1,i,4)]-1;
+			uint32_t y1 = lbp->wins[INDEX(2,i,4)]-1;
+			// work on a local copy so that accumulators stay in registers
+			typename Windows::consumer_type consumer = windows.start(i);
+			if (lbp->wins[INDEX(3,i,4)])
+			{
+				liblbp_codemap_source<true> src = {pyr->mirrored + INDEX(y1, x1, im_H), im_H, size, (uint32_t)lbp->winSize[1]};
+				liblbp_pyr_engine(geom, src, consumer);
+			} else {
+				liblbp_codemap_source<false> src = {pyr->codes + INDEX(y1, x1, im_H), im_H, size, (uint32_t)lbp->winSize[1]};
+				liblbp_pyr_engine(geom, src, consumer);
+			}
+			windows.finish(i, consumer);
+		}
+	}
+};
+
+template <class Windows>
+static void flandmark_run_windows(const FLANDMARK_LBP* lbp, const FLANDMARK_LBP_PYRAMID* pyr, const Windows& windows, const int* list = 0, int nList = 0)
+{
+	uint32_t nCells = liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256;
+	flandmark_windows_body<Windows> body = {lbp, pyr, windows, list, nList};
+	liblbp_geometry_dispatch(lbp->winSize[0], lbp->winSize[1], liblbp_pyr_levels(lbp->winSize[0], lbp->winSize[1], nCells), body);
+}
+
+void flandmark_get_psi_mat_sparse_pyr(FLANDMARK_PSI_SPARSE* Psi, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr)
+{
+	t_index * Features;
+	const FLANDMARK_LBP * lbp = &model->data.lbp[lbpidx];
+	uint32_t nDim = liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256;
+	uint32_t nData = lbp->WINS_COLS;
+
+	Features = (t_index*)malloc(nDim*nData*sizeof(t_index));
+	liblbp_index_consumer * consumers = (liblbp_index_consumer*)malloc(nData*sizeof(liblbp_index_consumer));
+	if (Features == NULL || consumers == NULL)
+	{
+		printf( "Not enough memory for LBP features.\n");
+		exit(1);
+	}
+
+	for (uint32_t i = 0; i < nData; ++i)
+	{
+		consumers[i].vec = &Features[nDim*i];
+	}
+	flandmark_consumer_array<liblbp_index_consumer> windows = {consumers};
+	flandmark_run_windows(lbp, pyr, windows);
+	free(consumers);
+
+	Psi->PSI_COLS = nData;
+	Psi->PSI_ROWS = nDim;
+	Psi->idxs = Features;
+}
+
+// windows accumulated together by flandmark_get_q_cells
+#define FLANDMARK_CELL_BLOCK 256
+
+// q[i] = unit*(sum over the cells of W[256*cell + code of the cell in window i]), cell by cell for a block of
+// windows at a time: the 256 weights of a cell stay in L1 while every window of the block reads its code at the
+// offset of the cell from its corner, which is a correlation of the table with the code map
+template <typename Wt, typename Acc, typename T>
+static void flandmark_get_q_cells(T* q, const Wt* W, T unit, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows, int nWindows)
+{
+	const FLANDMARK_LBP * lbp = &model->data.lbp[lbpidx];
+	const int nCells = (int)(liblbp_pyr_get_dim(lbp->winSize[0], lbp->winSize[1], lbp->hop)/256);
+	const uint32_t im_H = (uint32_t)pyr->ROWS;
+	const int n = windows ? nWindows : lbp->WINS_COLS;
+	const uint8_t * corner[FLANDMARK_CELL_BLOCK];
+	int index[FLANDMARK_CELL_BLOCK];
+	Acc acc[FLANDMARK_CELL_BLOCK];
+
+	// plain windows, then mirrored ones, which read the mirrored codes at their own offsets
+	for (int mirrored = 0; mirrored < 2; ++mirrored)
+	{
+		const uint8_t * planes = mirrored ? pyr->mirrored : pyr->codes;
+		const uint32_t * offsets = model->cells[lbpidx] + mirrored*nCells;
+		for (int k = 0; k < n; )
+		{
+			int nBlock = 0;
+			for (; k < n && nBlock < FLANDMARK_CELL_BLOCK; ++k)
+			{
+				const int i = windows ? windows[k] : k;
+				if ((lbp->wins[INDEX(3,i,4)] != 0) == (mirrored != 0))
+				{
+					uint32_t x1 = lbp->wins[INDEX(1,i,4)]-1;
+					uint32_t y1 = lbp->wins[INDEX(2,i,4)]-1;
+					corner[nBlock] = planes + INDEX(y1, x1, im_H);
+					index[nBlock] = i;
+					acc[nBlock] = 0;
+					++nBlock;
+				}
 			}
-			tmp_tsize = PsiGiTst[idx].ROWS*PsiGiTst[idx].COLS;
-			for (int i = 0; i < tmp_tsize; ++i)
+
+			for (int cell = 0; cell < nCells; ++cell)
 			{
-				if (PsiGi[idx].disp[i] != PsiGiTst[idx].disp[i])
+				const Wt * table = W + 256*cell;
+				const uint32_t offset = offsets[cell];
+				for (int b = 0; b < nBlock; ++b)
 				{
-					flag = false;
-					printf( "\nPsiGS%d[%d] =  %d; %d\n", psig_idx, idx, PsiGi[idx].disp[i], PsiGiTst[idx].disp[i]);
-					printf( "Error.");
+					acc[b] += table[corner[b][offset]];
 				}
 			}
+
+			for (int b = 0; b < nBlock; ++b)
+			{
+				q[index[b]] = acc[b]*unit;
+			}
 		}
-		flag == true ? printf( "passed. \n") : printf( "NOT passed.\n");
-		if (!flag)
+	}
+}
+
+void flandmark_get_q_pyr(double* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows, int nWindows)
+{
+	const int M = model->data.options.M;
+	const double * W = model->W + model->data.mapTable[INDEX(lbpidx, 0, M)]-1;
+	flandmark_get_q_cells<double, double>(q, W, 1.0, model, lbpidx, pyr, windows, nWindows);
+}
+
+void flandmark_get_q_pyr(float* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows, int nWindows)
+{
+	const int M = model->data.options.M;
+	const float * W = model->Wf + model->data.mapTable[INDEX(lbpidx, 0, M)]-1;
+	flandmark_get_q_cells<float, float>(q, W, 1.0f, model, lbpidx, pyr, windows, nWindows);
+}
+
+void flandmark_get_q_pyr(int32_t* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows, int nWindows)
+{
+	const FLANDMARK_QUANT * quant = model->quant;
+	const int M = model->data.options.M;
+	const int16_t * W = quant->W + model->data.mapTable[INDEX(lbpidx, 0, M)]-1;
+
+	// int16 weights accumulated in int32 and brought to the units of the scores
+	flandmark_get_q_cells<int16_t, int32_t>(q, W, (int32_t)1 << (quant->scale - quant->shift[lbpidx]), model, lbpidx, pyr, windows, nWindows);
+}
+
+/*-----------------------------------------------------------------------
+  Max-plus kernels: maximum and first index of child[j]+costs[j], j < cols.
+
+  The vector kernels keep one running maximum per lane with the strict
+  comparison of the scalar loop, so every lane holds the first maximum of
+  its subsequence; the lanes are then merged preferring the smaller index
+  and the tail is finished by the scalar loop. The result is the same as
+  the one of the scalar loop. The float and int32 kernels have twice the
+  lanes.
+  -----------------------------------------------------------------------*/
+template <typename T>
+struct flandmark_maxplus
+{
+	typedef void (*fn)(T *maximum, int *idx, const T *child, const T *costs, int cols);
+	static T lowest() { return -FLT_MAX; }  // start of the maximization
+	static T unscored() { return -FLT_MAX/16; }  // positions left out, low enough to lose and to add up
+};
+
+template <>
+inline int32_t flandmark_maxplus<int32_t>::lowest() { return INT32_MIN; }
+template <>
+inline int32_t flandmark_maxplus<int32_t>::unscored() { return INT32_MIN/32; }
+
+template <typename T>
+static inline void flandmark_maxplus_tail(T *maximum, int *idx, const T *child, const T *costs, int start, int cols)
+{
+	for (int j = start; j < cols; ++j)
+	{
+		if (*maximum < child[j]+costs[j])
 		{
-			return ERROR_DATA_OPTIONS_PSIG;
+			*idx = j;
+			*maximum = child[j]+costs[j];
 		}
 	}
-	return NO_ERR;
 }
 
-void flandmark_free(FLANDMARK_Model* model)
+template <typename T>
+static void flandmark_maxplus_scalar(T *maximum, int *idx, const T *child, const T *costs, int cols)
 {
-	FLANDMARK_PSIG *PsiGi = NULL;
-	for (int psig_idx = 0; psig_idx < 3; ++psig_idx)
+	*maximum = flandmark_maxplus<T>::lowest();
+	*idx = -1;
+	flandmark_maxplus_tail(maximum, idx, child, costs, 0, cols);
+}
+
+#ifdef FLANDMARK_X86_DISPATCH
+
+template <typename T, typename I>
+static inline void flandmark_maxplus_merge(T *maximum, int *idx, const T *lane_max, const I *lane_idx, int lanes)
+{
+	*maximum = flandmark_maxplus<T>::lowest();
+	*idx = -1;
+	for (int l = 0; l < lanes; ++l)
 	{
-		switch(psig_idx)
+		if (*maximum < lane_max[l] || (*maximum == lane_max[l] && lane_idx[l] < *idx))
 		{
-			case 0:
-				PsiGi = (model->data.options.PsiGS0);
-				break;
-			case 1:
-				PsiGi = (model->data.options.PsiGS1);
-				break;
-			case 2:
-				PsiGi = (model->data.options.PsiGS2);
-				break;
+			*idx = (int)lane_idx[l];
+			*maximum = lane_max[l];
 		}
+	}
+}
 
-		int tsize = model->data.options.PSIG_ROWS[psig_idx] * model->data.options.PSIG_COLS[psig_idx];
-		for (int i = 0; i < tsize; ++i)
+__attribute__((target("sse2")))
+static void flandmark_maxplus_sse2(double *maximum, int *idx, const double *child, const double *costs, int cols)
+{
+	__m128d vmax = _mm_set1_pd(-FLT_MAX);
+	__m128i vidx = _mm_set1_epi64x(-1), vj = _mm_set_epi64x(1, 0);
+	const __m128i step = _mm_set1_epi64x(2);
+	int j = 0;
+	for (; j+2 <= cols; j += 2)
+	{
+		__m128d value = _mm_add_pd(_mm_loadu_pd(child+j), _mm_loadu_pd(costs+j));
+		__m128d greater_pd = _mm_cmplt_pd(vmax, value);
+		__m128i greater = _mm_castpd_si128(greater_pd);
+		vmax = _mm_or_pd(_mm_and_pd(greater_pd, value), _mm_andnot_pd(greater_pd, vmax));
+		vidx = _mm_or_si128(_mm_and_si128(greater, vj), _mm_andnot_si128(greater, vidx));
+		vj = _mm_add_epi64(vj, step);
+	}
+	double lane_max[2];
+	int64_t lane_idx[2];
+	_mm_storeu_pd(lane_max, vmax);
+	_mm_storeu_si128((__m128i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 2);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+__attribute__((target("sse2")))
+static void flandmark_maxplus_sse2(float *maximum, int *idx, const float *child, const float *costs, int cols)
+{
+	__m128 vmax = _mm_set1_ps(-FLT_MAX);
+	__m128i vidx = _mm_set1_epi32(-1), vj = _mm_set_epi32(3, 2, 1, 0);
+	const __m128i step = _mm_set1_epi32(4);
+	int j = 0;
+	for (; j+4 <= cols; j += 4)
+	{
+		__m128 value = _mm_add_ps(_mm_loadu_ps(child+j), _mm_loadu_ps(costs+j));
+		__m128 greater_ps = _mm_cmplt_ps(vmax, value);
+		__m128i greater = _mm_castps_si128(greater_ps);
+		vmax = _mm_or_ps(_mm_and_ps(greater_ps, value), _mm_andnot_ps(greater_ps, vmax));
+		vidx = _mm_or_si128(_mm_and_si128(greater, vj), _mm_andnot_si128(greater, vidx));
+		vj = _mm_add_epi32(vj, step);
+	}
+	float lane_max[4];
+	int32_t lane_idx[4];
+	_mm_storeu_ps(lane_max, vmax);
+	_mm_storeu_si128((__m128i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 4);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+__attribute__((target("sse2")))
+static void flandmark_maxplus_sse2(int32_t *maximum, int *idx, const int32_t *child, const int32_t *costs, int cols)
+{
+	__m128i vmax = _mm_set1_epi32(INT32_MIN);
+	__m128i vidx = _mm_set1_epi32(-1), vj = _mm_set_epi32(3, 2, 1, 0);
+	const __m128i step = _mm_set1_epi32(4);
+	int j = 0;
+	for (; j+4 <= cols; j += 4)
+	{
+		__m128i value = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(child+j)), _mm_loadu_si128((const __m128i*)(costs+j)));
+		__m128i greater = _mm_cmpgt_epi32(value, vmax);
+		vmax = _mm_or_si128(_mm_and_si128(greater, value), _mm_andnot_si128(greater, vmax));
+		vidx = _mm_or_si128(_mm_and_si128(greater, vj), _mm_andnot_si128(greater, vidx));
+		vj = _mm_add_epi32(vj, step);
+	}
+	int32_t lane_max[4], lane_idx[4];
+	_mm_storeu_si128((__m128i*)lane_max, vmax);
+	_mm_storeu_si128((__m128i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 4);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+__attribute__((target("avx2")))
+static void flandmark_maxplus_avx2(double *maximum, int *idx, const double *child, const double *costs, int cols)
+{
+	__m256d vmax = _mm256_set1_pd(-FLT_MAX);
+	__m256i vidx = _mm256_set1_epi64x(-1), vj = _mm256_set_epi64x(3, 2, 1, 0);
+	const __m256i step = _mm256_set1_epi64x(4);
+	int j = 0;
+	for (; j+4 <= cols; j += 4)
+	{
+		__m256d value = _mm256_add_pd(_mm256_loadu_pd(child+j), _mm256_loadu_pd(costs+j));
+		__m256d greater = _mm256_cmp_pd(vmax, value, _CMP_LT_OQ);
+		vmax = _mm256_blendv_pd(vmax, value, greater);
+		vidx = _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(vidx), _mm256_castsi256_pd(vj), greater));
+		vj = _mm256_add_epi64(vj, step);
+	}
+	double lane_max[4];
+	int64_t lane_idx[4];
+	_mm256_storeu_pd(lane_max, vmax);
+	_mm256_storeu_si256((__m256i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 4);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+__attribute__((target("avx2")))
+static void flandmark_maxplus_avx2(float *maximum, int *idx, const float *child, const float *costs, int cols)
+{
+	__m256 vmax = _mm256_set1_ps(-FLT_MAX);
+	__m256i vidx = _mm256_set1_epi32(-1), vj = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i step = _mm256_set1_epi32(8);
+	int j = 0;
+	for (; j+8 <= cols; j += 8)
+	{
+		__m256 value = _mm256_add_ps(_mm256_loadu_ps(child+j), _mm256_loadu_ps(costs+j));
+		__m256 greater = _mm256_cmp_ps(vmax, value, _CMP_LT_OQ);
+		vmax = _mm256_blendv_ps(vmax, value, greater);
+		vidx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(vidx), _mm256_castsi256_ps(vj), greater));
+		vj = _mm256_add_epi32(vj, step);
+	}
+	float lane_max[8];
+	int32_t lane_idx[8];
+	_mm256_storeu_ps(lane_max, vmax);
+	_mm256_storeu_si256((__m256i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 8);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+__attribute__((target("avx2")))
+static void flandmark_maxplus_avx2(int32_t *maximum, int *idx, const int32_t *child, const int32_t *costs, int cols)
+{
+	__m256i vmax = _mm256_set1_epi32(INT32_MIN);
+	__m256i vidx = _mm256_set1_epi32(-1), vj = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i step = _mm256_set1_epi32(8);
+	int j = 0;
+	for (; j+8 <= cols; j += 8)
+	{
+		__m256i value = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(child+j)), _mm256_loadu_si256((const __m256i*)(costs+j)));
+		__m256i greater = _mm256_cmpgt_epi32(value, vmax);
+		vmax = _mm256_blendv_epi8(vmax, value, greater);
+		vidx = _mm256_blendv_epi8(vidx, vj, greater);
+		vj = _mm256_add_epi32(vj, step);
+	}
+	int32_t lane_max[8], lane_idx[8];
+	_mm256_storeu_si256((__m256i*)lane_max, vmax);
+	_mm256_storeu_si256((__m256i*)lane_idx, vidx);
+	flandmark_maxplus_merge(maximum, idx, lane_max, lane_idx, 8);
+	flandmark_maxplus_tail(maximum, idx, child, costs, j, cols);
+}
+
+// T selects the kernels of the precision
+template <typename T>
+static typename flandmark_maxplus<T>::fn flandmark_select_maxplus(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return flandmark_maxplus_avx2;
+	if (__builtin_cpu_supports("sse2")) return flandmark_maxplus_sse2;
+	return flandmark_maxplus_scalar<T>;
+}
+
+#endif /* FLANDMARK_X86_DISPATCH */
+
+/* Upper envelope of the parabolas h[c] - w*(x - c)^2, c < n (Felzenszwalb & Huttenlocher), evaluated at the
+   ascending points p; the best c of point k goes to best[k*stride] and its value to out[k*stride] */
+template <typename T>
+static void flandmark_dt1d(const T *h, int n, double w, const double *p, int np, double *out, int *best, int stride, int *v, double *z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -DBL_MAX;
+	z[1] = DBL_MAX;
+	for (int c = 1; c < n; ++c)
+	{
+		int r = v[k];
+		double s = ((double)c*c - (double)r*r - (h[c]-h[r])/w) / (2.0*(c - r));
+		while (k > 0 && s <= z[k])
 		{
-			free(PsiGi[i].disp);
+			r = v[--k];
+			s = ((double)c*c - (double)r*r - (h[c]-h[r])/w) / (2.0*(c - r));
 		}
-		free(PsiGi);
+		v[++k] = c;
+		z[k] = s;
+		z[k+1] = DBL_MAX;
 	}
 
-	free(model->W);
-	for (int i = 0; i < model->data.options.M; ++i)
+	k = 0;
+	for (int i = 0; i < np; ++i)
 	{
-		free(model->data.lbp[i].wins);
+		while (z[k+1] < p[i])
+			++k;
+		best[i*stride] = v[k];
+		out[i*stride] = h[v[k]] - w*(p[i]-v[k])*(p[i]-v[k]);
 	}
-	free(model->data.lbp);
-	free(model->data.options.S);
-	free(model->data.mapTable);
+}
 
-    //if (model->croppedImage)
-    //	cvReleaseImage(&model->croppedImage);
+// best child positions of a quadratic edge by a 2-D distance transform: along y within every column of the
+// child grid, then along x; the message itself is taken from the cost table. unit is the value of 1 in the
+// scores
+template <typename T>
+static void flandmark_edge_transform(T *message, int *best, bool received, const FLANDMARK_EDGE *edge, const T *child, const T *costs, double unit, FLANDMARK_Workspace *ws)
+{
+	const int rows = edge->childRows, cols = edge->childCols;
+	double * colScores = ws->dtScores, * rowScores = ws->dtScores + edge->nPy*cols;
+	int * bestY = ws->dtBest, * bestX = ws->dtBest + edge->nPy*cols;
 
-    //if (model->resizedImage)
-    //	cvReleaseImage(&model->resizedImage);
+	for (int cx = 0; cx < cols; ++cx)
+	{
+		flandmark_dt1d(child + cx*rows, rows, edge->wy*unit, edge->py, edge->nPy, colScores + cx, bestY + cx, cols, ws->dtSites, ws->dtBounds);
+	}
+	for (int ky = 0; ky < edge->nPy; ++ky)
+	{
+		flandmark_dt1d(colScores + ky*cols, cols, edge->wx*unit, edge->px, edge->nPx, rowScores, bestX + ky*edge->nPx, 1, ws->dtSites, ws->dtBounds);
+	}
 
-    if (model->normalizedImageFrame)
-		free(model->normalizedImageFrame);
+	for (int i = 0; i < edge->nParent; ++i)
+	{
+		int ky = edge->qy[i];
+		int cx = bestX[ky*edge->nPx + edge->qx[i]];
+		int j = cx*rows + bestY[ky*cols + cx];
+		T maximum = child[j]+costs[i*edge->nChild + j];
+		best[i] = j;
+		message[i] = received ? message[i] + maximum : maximum;
+	}
+}
 
-    if (model->bb)
-		free(model->bb);
+// deformation costs of the edges in the precision of T
+static inline const double * flandmark_edge_costs(const FLANDMARK_EDGE *edge, const double *) { return edge->costs; }
+static inline const float * flandmark_edge_costs(const FLANDMARK_EDGE *edge, const float *) { return edge->costsf; }
+static inline const int32_t * flandmark_edge_costs(const FLANDMARK_EDGE *edge, const int32_t *) { return edge->costsi; }
 
-    if (model->sf)
-		free(model->sf);
+// value of 1 in the scores of the precision of T
+static inline double flandmark_score_unit(const FLANDMARK_Model *, const double *) { return 1.0; }
+static inline double flandmark_score_unit(const FLANDMARK_Model *, const float *) { return 1.0; }
+static inline double flandmark_score_unit(const FLANDMARK_Model *model, const int32_t *) { return ldexp(1.0, model->quant->scale); }
 
-	free(model);
-}
+// a cost of the double tables in the precision of T, rounded the way the tables of T are
+static inline double flandmark_cost(const FLANDMARK_Model *, double cost, const double *) { return cost; }
+static inline float flandmark_cost(const FLANDMARK_Model *, double cost, const float *) { return (float)cost; }
+static inline int32_t flandmark_cost(const FLANDMARK_Model *model, double cost, const int32_t *) { return (int32_t)lround(ldexp(cost, model->quant->scale)); }
 
-void flandmark_get_psi_mat(FLANDMARK_PSI* Psi, FLANDMARK_Model* model, int lbpidx)
+// higher bounds first, then lower positions, which win ties
+static int flandmark_candidate_compare(const void *a, const void *b)
 {
-	char * Features;
-    const uint8_t * Images = model->normalizedImageFrame;
-	uint32_t im_H = (uint32_t)model->data.imSize[0]; uint32_t im_W = (uint32_t)model->data.imSize[1];
-    const uint32_t * Wins = model->data.lbp[lbpidx].wins;
-	uint16_t win_H = (uint16_t)model->data.lbp[lbpidx].winSize[0]; uint16_t win_W = (uint16_t)model->data.lbp[lbpidx].winSize[1];
-	uint16_t nPyramids = model->data.lbp[lbpidx].hop;
-	uint32_t nDim = liblbp_pyr_get_dim(win_H, win_W, nPyramids); uint32_t nData = model->data.lbp[lbpidx].WINS_COLS;
+	const FLANDMARK_CANDIDATE * x = (const FLANDMARK_CANDIDATE*)a, * y = (const FLANDMARK_CANDIDATE*)b;
+	if (x->bound != y->bound)
+		return x->bound < y->bound ? 1 : -1;
+	return (x->position > y->position) - (x->position < y->position);
+}
 
-	Features = (char*)calloc(nDim*nData, sizeof(char));
-	if (Features == NULL)
+// components solved when only the landmarks of mask are requested: those, the ones on their paths to the root
+// and the root; all of them without mask
+static void flandmark_tree_needed(const FLANDMARK_Model *model, const int *mask, int *needed)
+{
+	for (int idx = 0; idx < model->data.options.M; ++idx)
 	{
-		printf( "Not enough memory for LBP features.\n");
-		exit(1);
+		needed[idx] = mask ? mask[idx] != 0 : 1;
 	}
-	Psi->PSI_ROWS = nDim; Psi->PSI_COLS = nData;
+	needed[model->edges[model->nEdges-1].parent] = 1;
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		if (needed[model->edges[e].child])
+			needed[model->edges[e].parent] = 1;
+	}
+}
 
-    uint32_t cnt0, mirror, x, x1, y, y1, idx, *win;
-    const uint8_t *img_ptr;
+// positions of the needed components from the best root position and workspace->best, NaN for the others
+static void flandmark_argmax_backtrack(double *smax, const FLANDMARK_Model *model, FLANDMARK_Workspace *workspace, int root_idx, const int *needed)
+{
+	const int M = model->data.options.M;
 
-	win = (uint32_t*)malloc(win_H*win_W*sizeof(uint32_t));
-	if(win == NULL)
+	// get indices, from the root back to the leaves
+	int * indices = workspace->indices;
+	indices[model->edges[model->nEdges-1].parent] = root_idx;
+	for (int e = model->nEdges-1; e >= 0; --e)
 	{
-		printf( "Not enough memory for cropped_window.\n");
-		exit(1);
+		if (needed[model->edges[e].child])
+			indices[model->edges[e].child] = workspace->best[e][indices[model->edges[e].parent]];
 	}
 
-	for(uint32_t i = 0; i < nData; ++i)
+	// convert 1D indices to 2D coordinates of estimated positions
+	const int * optionsS = model->data.options.S;
+	for (int i = 0; i < M; ++i)
 	{
-		idx = Wins[INDEX(0,i,4)]-1;
-		x1  = Wins[INDEX(1,i,4)]-1;
-		y1  = Wins[INDEX(2,i,4)]-1;
-		mirror = Wins[INDEX(3,i,4)];
+		if (!needed[i])
+		{
+			smax[INDEX(0, i, 2)] = smax[INDEX(1, i, 2)] = NAN;
+			continue;
+		}
+		int rows = optionsS[INDEX(3, i, 4)] - optionsS[INDEX(1, i, 4)] + 1;
+		smax[INDEX(0, i, 2)] = float(COL(indices[i]+1, rows) + optionsS[INDEX(0, i, 4)]);
+		smax[INDEX(1, i, 2)] = float(ROW(indices[i]+1, rows) + optionsS[INDEX(1, i, 4)]);
+	}
+}
 
-		img_ptr = &Images[idx*im_H*im_W];
+// best root position of FLANDMARK_BRANCH_AND_BOUND, given the scores child[k] of the children of the root
+// edges edges[k]; the messages are summed in the order of flandmark_argmax, so that the scores are the same
+template <typename T>
+static int flandmark_argmax_root_bound(T *maxs0, const FLANDMARK_Model *model, int root, const T *q, const int *edges, const T * const *child, int nEdges,
+		typename flandmark_maxplus<T>::fn maxplus, FLANDMARK_Workspace *workspace)
+{
+	const int nRoot = model->data.lbp[root].WINS_COLS;
 
-		cnt0 = 0;
+	// no message exceeds the best score of the child plus the largest cost of the row, and the sums are
+	// rounded monotonically, so the bounds hold in every precision
+	T childMax[256];
+	for (int k = 0; k < nEdges; ++k)
+	{
+		const FLANDMARK_EDGE * edge = &model->edges[edges[k]];
+		childMax[k] = child[k][0];
+		for (int j = 1; j < edge->nChild; ++j)
+		{
+			childMax[k] = FLANDMARK_MAX(childMax[k], child[k][j]);
+		}
+	}
+	FLANDMARK_CANDIDATE * candidates = workspace->candidates;
+	for (int i = 0; i < nRoot; ++i)
+	{
+		T bound = 0;
+		for (int k = 0; k < nEdges; ++k)
+		{
+			const FLANDMARK_EDGE * edge = &model->edges[edges[k]];
+			T maximum = childMax[k] + flandmark_cost(model, edge->rowMax[i], (const T*)0);
+			bound = k ? bound + maximum : maximum;
+		}
+		candidates[i].bound = bound + q[i];
+		candidates[i].position = i;
+	}
+	qsort(candidates, nRoot, sizeof(FLANDMARK_CANDIDATE), flandmark_candidate_compare);
 
-		if(mirror == 0)
+	*maxs0 = flandmark_maxplus<T>::lowest();
+	int maxs0_idx = -1;
+	for (int c = 0; c < nRoot; ++c)
+	{
+		// a position bounded by the best score can still win a tie with a lower index
+		const int i = candidates[c].position;
+		if (maxs0_idx >= 0 && candidates[c].bound < *maxs0)
 		{
-			for(x=x1; x < x1+win_W; x++)
-				for(y=y1; y < y1+win_H; y++)
-					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
-		} else {
-			for(x=x1+win_W-1; x >= x1; x--)
-				for(y=y1; y < y1+win_H; y++)
-					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+			break;
+		}
+
+		T message = 0;
+		for (int k = 0; k < nEdges; ++k)
+		{
+			const FLANDMARK_EDGE * edge = &model->edges[edges[k]];
+			const T * costs = flandmark_edge_costs(edge, (const T*)0);
+			T maximum;
+			maxplus(&maximum, &workspace->best[edges[k]][i], child[k], &costs[i*edge->nChild], edge->cols[i]);
+			message = k ? message + maximum : maximum;
+		}
+		T score = message+q[i];
+		if (*maxs0 < score || (*maxs0 == score && i < maxs0_idx))
+		{
+			maxs0_idx = i;
+			*maxs0 = score;
 		}
-		liblbp_pyr_features(&Features[nDim*i], nDim, win, win_H, win_W);
 	}
-	free(win);
 
-	Psi->data = Features;
+	return maxs0_idx;
 }
 
-void flandmark_get_psi_mat_sparse(FLANDMARK_PSI_SPARSE* Psi, FLANDMARK_Model* model, int lbpidx)
+// the max-plus kernel of T for this CPU
+template <typename T>
+static typename flandmark_maxplus<T>::fn flandmark_maxplus_kernel(void)
 {
-	t_index * Features;
-	uint8_t * Images = model->normalizedImageFrame;
-	uint32_t im_H = (uint32_t)model->data.imSize[0];
-	uint32_t im_W = (uint32_t)model->data.imSize[1];
-	uint32_t * Wins = model->data.lbp[lbpidx].wins;
-	uint16_t win_H = (uint16_t)model->data.lbp[lbpidx].winSize[0];
-	uint16_t win_W = (uint16_t)model->data.lbp[lbpidx].winSize[1];
-	uint16_t nPyramids = model->data.lbp[lbpidx].hop;
-	uint32_t nDim = liblbp_pyr_get_dim(win_H, win_W, nPyramids)/256;
-	uint32_t nData = model->data.lbp[lbpidx].WINS_COLS;
+#ifdef FLANDMARK_X86_DISPATCH
+	static const typename flandmark_maxplus<T>::fn maxplus = flandmark_select_maxplus<T>();
+	return maxplus;
+#else
+	return flandmark_maxplus_scalar<T>;
+#endif
+}
 
-    uint32_t cnt0, mirror, x, x1, y, y1, idx, *win;
-	uint8_t *img_ptr;
+// scores of the child of edge, which has received all its messages: its own plus these
+template <typename T>
+static const T * flandmark_edge_child(const FLANDMARK_Model *model, const FLANDMARK_EDGE *edge, T **q, T **scores, const int *received)
+{
+	const T * child = q[edge->child];
+	if (received[edge->child])
+	{
+		T * s = scores[edge->child];
+		for (int j = 0; j < model->data.lbp[edge->child].WINS_COLS; ++j)
+		{
+			s[j] += child[j];
+		}
+		child = s;
+	}
+	return child;
+}
 
-	Features = (t_index*)calloc(nDim*nData, sizeof(t_index));
-	if (Features == NULL)
+// message of edge e to the parent positions [begin, end), added to the ones the parent has received; the
+// distance transform solves all positions
+template <typename T>
+static void flandmark_edge_message(const FLANDMARK_Model *model, int e, const T *child, T **scores, FLANDMARK_Workspace *workspace, int flags, bool received, int begin, int end)
+{
+	const FLANDMARK_EDGE * edge = &model->edges[e];
+	const T * costs = flandmark_edge_costs(edge, (const T*)0);
+	T * message = scores[edge->parent];
+	int * best = workspace->best[e];
+	if (edge->quadratic && (flags & FLANDMARK_DISTANCE_TRANSFORM))
 	{
-		printf( "Not enough memory for LBP features.\n");
-		exit(1);
+		flandmark_edge_transform(message, best, received, edge, child, costs, flandmark_score_unit(model, (const T*)0), workspace);
+		return;
 	}
 
-	win = (uint32_t*)calloc(win_H*win_W, sizeof(uint32_t));
-	if(win == NULL)
+	const typename flandmark_maxplus<T>::fn maxplus = flandmark_maxplus_kernel<T>();
+	for (int i = begin; i < end; ++i)
 	{
-		printf( "Not enough memory for cropped_window.\n");
-		exit(1);
+		T maximum;
+		maxplus(&maximum, &best[i], child, &costs[i*edge->nChild], edge->cols[i]);
+		message[i] = received ? message[i] + maximum : maximum;
 	}
+}
 
-	for(uint32_t i = 0; i < nData; ++i)
+// flandmark_argmax on workspace->pool: the branches of the root first, one task per child of the root, then
+// the edges of the root in chunks of root positions
+template <typename T>
+struct flandmark_argmax_job
+{
+	const FLANDMARK_Model * model;
+	T ** q, ** scores;
+	FLANDMARK_Workspace * workspace;
+	int flags;
+	const int * needed;
+	int * received;
+	int root;
+	const int * branch;  // per component, the child of the root it descends from
+	const int * rootEdges;
+	const T ** rootChildren;
+	int nRootEdges, chunk;
+};
+
+template <typename T>
+static void flandmark_argmax_branch_task(void *arg, int k)
+{
+	const flandmark_argmax_job<T> * job = (const flandmark_argmax_job<T>*)arg;
+	const FLANDMARK_Model * model = job->model;
+	const int top = model->edges[job->rootEdges[k]].child;
+	for (int e = 0; e < job->rootEdges[k]; ++e)
 	{
-		idx = Wins[INDEX(0,i,4)]-1;
-		x1  = Wins[INDEX(1,i,4)]-1;
-		y1  = Wins[INDEX(2,i,4)]-1;
-		mirror = Wins[INDEX(3,i,4)];
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+		if (!job->needed[edge->child] || job->branch[edge->child] != top || edge->parent == job->root)
+			continue;
+		const T * child = flandmark_edge_child(model, edge, job->q, job->scores, job->received);
+		flandmark_edge_message(model, e, child, job->scores, job->workspace, job->flags, job->received[edge->parent] != 0, 0, edge->nParent);
+		job->received[edge->parent] = 1;
+	}
+}
 
-		img_ptr = &Images[idx*im_H*im_W];
+template <typename T>
+static void flandmark_argmax_root_task(void *arg, int k)
+{
+	const flandmark_argmax_job<T> * job = (const flandmark_argmax_job<T>*)arg;
+	const FLANDMARK_Model * model = job->model;
+	const int nRoot = model->edges[model->nEdges-1].nParent;
+	for (int r = 0; r < job->nRootEdges; ++r)
+	{
+		flandmark_edge_message(model, job->rootEdges[r], job->rootChildren[r], job->scores, job->workspace, job->flags, r > 0, k*job->chunk, FLANDMARK_MIN((k+1)*job->chunk, nRoot));
+	}
+}
 
-		cnt0 = 0;
+template <typename T>
+static void flandmark_argmax(double *smax, const FLANDMARK_Model *model, T **q, T **scores, FLANDMARK_Workspace *workspace, int flags, double *score, const int *needed)
+{
+	const int root = model->edges[model->nEdges-1].parent;
+	int received[256] = {0};
 
-		if(mirror == 0)
+	// with branch and bound, the edges of the root are solved after all others, at the root positions that
+	// need them only
+	bool bound = (flags & FLANDMARK_BRANCH_AND_BOUND) != 0;
+	for (int e = 0; e < model->nEdges && bound; ++e)
+	{
+		if (model->edges[e].parent == root && model->edges[e].quadratic && (flags & FLANDMARK_DISTANCE_TRANSFORM))
+			bound = false;
+	}
+	int rootEdges[256];
+	const T * rootChildren[256];
+	int nRootEdges = 0;
+
+	if (workspace->pool && !(flags & FLANDMARK_DISTANCE_TRANSFORM))
+	{
+		// the branches share no component but the root, whose messages are summed per position in the
+		// order of the edges, as below
+		int branch[256];
+		for (int e = model->nEdges-1; e >= 0; --e)
 		{
-			for(x=x1; x < x1+win_W; x++)
-				for(y=y1; y < y1+win_H; y++)
-					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
-		} else {
-			for(x=x1+win_W-1; x >= x1; x--)
-				for(y=y1; y < y1+win_H; y++)
-					win[cnt0++] = img_ptr[INDEX(y,x,im_H)];
+			const FLANDMARK_EDGE * edge = &model->edges[e];
+			branch[edge->child] = edge->parent == root ? edge->child : branch[edge->parent];
+			if (edge->parent == root && needed[edge->child])
+				++nRootEdges;
+		}
+		for (int e = 0, r = 0; e < model->nEdges; ++e)
+		{
+			if (model->edges[e].parent == root && needed[model->edges[e].child])
+				rootEdges[r++] = e;
+		}
+
+		const int nTasks = flandmark_thread_pool_size(workspace->pool) + 1;
+		flandmark_argmax_job<T> job = {model, q, scores, workspace, flags, needed, received, root, branch, rootEdges, rootChildren, nRootEdges,
+			(model->data.lbp[root].WINS_COLS + nTasks-1) / nTasks};
+		flandmark_thread_pool_run(workspace->pool, nRootEdges, flandmark_argmax_branch_task<T>, &job);
+		for (int r = 0; r < nRootEdges; ++r)
+		{
+			rootChildren[r] = flandmark_edge_child(model, &model->edges[rootEdges[r]], q, scores, received);
+		}
+		if (!bound)
+		{
+			flandmark_thread_pool_run(workspace->pool, nRootEdges ? nTasks : 0, flandmark_argmax_root_task<T>, &job);
+			received[root] = nRootEdges > 0;
+		}
+	} else {
+		// pass messages from the leaves to the root; a child has received all its messages before it sends
+		// its own
+		for (int e = 0; e < model->nEdges; ++e)
+		{
+			const FLANDMARK_EDGE * edge = &model->edges[e];
+			if (!needed[edge->child])
+				continue;
+
+			const T * child = flandmark_edge_child(model, edge, q, scores, received);
+			if (bound && edge->parent == root)
+			{
+				rootEdges[nRootEdges] = e;
+				rootChildren[nRootEdges++] = child;
+				continue;
+			}
+			flandmark_edge_message(model, e, child, scores, workspace, flags, received[edge->parent] != 0, 0, edge->nParent);
+			received[edge->parent] = 1;
 		}
-		liblbp_pyr_features_sparse(&Features[nDim*i], nDim, win, win_H, win_W);
 	}
 
-	Psi->PSI_COLS = nData;
-	Psi->PSI_ROWS = nDim;
-	Psi->idxs = Features;
+	// the root and its best position
+	T maxs0 = flandmark_maxplus<T>::lowest();
+	int maxs0_idx = -1;
+	if (bound)
+	{
+		maxs0_idx = flandmark_argmax_root_bound(&maxs0, model, root, q[root], rootEdges, rootChildren, nRootEdges, flandmark_maxplus_kernel<T>(), workspace);
+	} else {
+		const T * s0 = scores[root];
+		for (int i = 0; i < model->data.lbp[root].WINS_COLS; ++i)
+		{
+			T score = received[root] ? s0[i]+q[root][i] : q[root][i];
+			if (maxs0 < score)
+			{
+				maxs0_idx = i;
+				maxs0 = score;
+			}
+		}
+	}
+	if (score)
+	{
+		*score = maxs0/flandmark_score_unit(model, (const T*)0);
+	}
 
-	free(win);
+	flandmark_argmax_backtrack(smax, model, workspace, maxs0_idx, needed);
 }
 
-void flandmark_argmax(double *smax, FLANDMARK_Options *options, const int *mapTable, FLANDMARK_PSI_SPARSE *Psi_sparse, double **q, double **g)
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, double **q, FLANDMARK_Workspace *workspace, int flags, double *score, const int *mask)
 {
-    uint8_t M = options->M;
+	int needed[256];
+	flandmark_tree_needed(model, mask, needed);
+	flandmark_argmax(smax, model, q, workspace->scores, workspace, flags, score, needed);
+}
 
-    // compute argmax
-    int * indices = (int*)malloc(M*sizeof(int));
-    int tsize = mapTable[INDEX(1, 3, M)] - mapTable[INDEX(1, 2, M)] + 1;
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, float **q, FLANDMARK_Workspace *workspace, int flags, double *score, const int *mask)
+{
+	int needed[256];
+	flandmark_tree_needed(model, mask, needed);
+	flandmark_argmax(smax, model, q, workspace->scoresf, workspace, flags, score, needed);
+}
 
-    // left branch - store maximum and index of s5 for all positions of s1
-    int q1_length = Psi_sparse[1].PSI_COLS;
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, int32_t **q, FLANDMARK_Workspace *workspace, int flags, double *score, const int *mask)
+{
+	int needed[256];
+	flandmark_tree_needed(model, mask, needed);
+	flandmark_argmax(smax, model, q, workspace->scoresi, workspace, flags, score, needed);
+}
 
-    double * s1 = (double *)calloc(2*q1_length, sizeof(double));
-    double * s1_maxs = (double *)calloc(q1_length, sizeof(double));
-    for (int i = 0; i < q1_length; ++i)
-    {
-        // dot product <g_5, PsiGS1>
-        flandmark_maximize_gdotprod(
-                //s2_maxs, s2_idxs,
-                &s1[INDEX(0, i, 2)], (double*)&s1[INDEX(1, i, 2)],
-                q[5], g[4], options->PsiGS1[INDEX(i, 0, options->PSIG_ROWS[1])].disp,
-                options->PsiGS1[INDEX(i, 0, options->PSIG_ROWS[1])].COLS, tsize
-                );
-        s1[INDEX(0, i, 2)] += q[1][i];
-    }
-    for (int i = 0; i < q1_length; ++i)
-    {
-        s1_maxs[i] = s1[INDEX(0, i, 2)];
-    }
+#define FLANDMARK_COARSE_STEP 2    // coarse positions are every STEP-th one in x and y
+#define FLANDMARK_COARSE_RADIUS 2  // fine positions are within RADIUS of the coarse optimum in x and y
 
-    // right branch (s2->s6) - store maximum and index of s6 for all positions of s2
-    int q2_length = Psi_sparse[2].PSI_COLS;
-    double * s2 = (double *)calloc(2*q2_length, sizeof(double));
-    double * s2_maxs = (double *)calloc(q2_length, sizeof(double));
-    for (int i = 0; i < q2_length; ++i)
-    {
-        // dot product <g_6, PsiGS2>
-        flandmark_maximize_gdotprod(
-                //s2_maxs, s2_idxs,
-                &s2[INDEX(0, i, 2)], (double*)&s2[INDEX(1, i, 2)],
-                q[6], g[5], options->PsiGS2[INDEX(i, 0, options->PSIG_ROWS[2])].disp,
-                options->PsiGS2[INDEX(i, 0, options->PSIG_ROWS[2])].COLS, tsize);
-        s2[INDEX(0, i, 2)] += q[2][i];
-    }
-    for (int i = 0; i < q2_length; ++i)
-    {
-        s2_maxs[i] = s2[INDEX(0, i, 2)];
-    }
+// flandmark_argmax over the positions workspace->windows of every component only, by brute force
+template <typename T>
+static void flandmark_argmax_windows(double *smax, const FLANDMARK_Model *model, T **q, T **scores, FLANDMARK_Workspace *workspace, double *score, const int *needed)
+{
+	int received[256] = {0};
 
-    // the root s0 and its connections
-    int q0_length = Psi_sparse[0].PSI_COLS;
-    double maxs0 = -FLT_MAX; int maxs0_idx = -1;
-    double maxq10 = -FLT_MAX, maxq20 = -FLT_MAX, maxq30 = -FLT_MAX, maxq40 = -FLT_MAX, maxq70 = -FLT_MAX;
-    double * s0 = (double *)calloc(M*q0_length, sizeof(double));
-    for (int i = 0; i < q0_length; ++i)
-    {
-        // q10
-        maxq10 = -FLT_MAX;
-        flandmark_maximize_gdotprod(
-                &maxq10, &s0[INDEX(1, i, M)],
-                s1_maxs, g[0], options->PsiGS0[INDEX(i, 0, options->PSIG_ROWS[0])].disp,
-                options->PsiGS0[INDEX(i, 0, options->PSIG_ROWS[0])].COLS, tsize);
-        s0[INDEX(5, i, M)] = s1[INDEX(1, (int)s0[INDEX(1, i, M)], 2)];
-        // q20
-        maxq20 = -FLT_MAX;
-        flandmark_maximize_gdotprod(
-                &maxq20, &s0[INDEX(2, i, M)],
-                s2_maxs, g[1], options->PsiGS0[INDEX(i, 1, options->PSIG_ROWS[0])].disp,
-                options->PsiGS0[INDEX(i, 1, options->PSIG_ROWS[0])].COLS, tsize);
-        s0[INDEX(6, i, M)] = s2[INDEX(1, (int)s0[INDEX(2, i, M)], 2)];
-        // q30
-        maxq30 = -FLT_MAX;
-        flandmark_maximize_gdotprod(
-                &maxq30, &s0[INDEX(3, i, M)],
-                q[3], g[2], options->PsiGS0[INDEX(i, 2, options->PSIG_ROWS[0])].disp,
-                options->PsiGS0[INDEX(i, 2, options->PSIG_ROWS[0])].COLS, tsize);
-        // q40
-        maxq40 = -FLT_MAX;
-        flandmark_maximize_gdotprod(
-                &maxq40, &s0[INDEX(4, i, M)],
-                q[4], g[3], options->PsiGS0[INDEX(i, 3, options->PSIG_ROWS[0])].disp,
-                options->PsiGS0[INDEX(i, 3, options->PSIG_ROWS[0])].COLS, tsize);
-        // q70
-        maxq70 = -FLT_MAX;
-        flandmark_maximize_gdotprod(
-                &maxq70, &s0[INDEX(7, i, M)],
-                q[7], g[6], options->PsiGS0[INDEX(i, 4, options->PSIG_ROWS[0])].disp,
-                options->PsiGS0[INDEX(i, 4, options->PSIG_ROWS[0])].COLS, tsize);
-        // sum q10+q20+q30+q40+q70
-        if (maxs0 < maxq10+maxq20+maxq30+maxq40+maxq70+q[0][i])
-        {
-            maxs0_idx = i;
-            s0[INDEX(0, i, M)] = i;
-            maxs0 = maxq10+maxq20+maxq30+maxq40+maxq70+q[0][i];
-        }
-    }
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		const FLANDMARK_EDGE * edge = &model->edges[e];
+		if (!needed[edge->child])
+			continue;
+		const T * costs = flandmark_edge_costs(edge, (const T*)0);
+		const int * children = workspace->windows[edge->child], nChildren = workspace->nWindows[edge->child];
+		const int * parents = workspace->windows[edge->parent], nParents = workspace->nWindows[edge->parent];
+
+		const T * child = q[edge->child];
+		if (received[edge->child])
+		{
+			T * s = scores[edge->child];
+			for (int k = 0; k < nChildren; ++k)
+			{
+				s[children[k]] += child[children[k]];
+			}
+			child = s;
+		}
 
-    // get indices
-    for (int i = 0; i < M; ++i)
-    {
-        indices[i] = (int)s0[INDEX(0, maxs0_idx, M)+i]+1;
-    }
+		T * message = scores[edge->parent];
+		int * best = workspace->best[e];
+		for (int k = 0; k < nParents; ++k)
+		{
+			const int i = parents[k];
+			const T * row = &costs[i*edge->nChild];
+			// a parent position without any allowed child keeps a low finite score and some child
+			T maximum = flandmark_maxplus<T>::unscored();
+			best[i] = children[0];
+			for (int l = 0; l < nChildren; ++l)
+			{
+				const int j = children[l];
+				if (j < edge->cols[i] && maximum < child[j]+row[j])
+				{
+					best[i] = j;
+					maximum = child[j]+row[j];
+				}
+			}
+			message[i] = received[edge->parent] ? message[i] + maximum : maximum;
+		}
+		received[edge->parent] = 1;
+	}
 
-    // cleanup temp variables
-    free(s0);
-    free(s1); free(s1_maxs);
-    free(s2); free(s2_maxs);
+	const int root = model->edges[model->nEdges-1].parent;
+	T maxs0 = flandmark_maxplus<T>::lowest();
+	int maxs0_idx = -1;
+	for (int k = 0; k < workspace->nWindows[root]; ++k)
+	{
+		const int i = workspace->windows[root][k];
+		T s0 = scores[root][i]+q[root][i];
+		if (maxs0 < s0)
+		{
+			maxs0_idx = i;
+			maxs0 = s0;
+		}
+	}
+	if (score)
+	{
+		*score = maxs0/flandmark_score_unit(model, (const T*)0);
+	}
 
-    // convert 1D indices to 2D coordinates of estimated positions
-    //int * optionsS = &options->S[0];
-    const int * optionsS = options->S;
-    for (int i = 0; i < M; ++i)
-    {
-        int rows = optionsS[INDEX(3, i, 4)] - optionsS[INDEX(1, i, 4)] + 1;
-        smax[INDEX(0, i, 2)] = float(COL(indices[i], rows) + optionsS[INDEX(0, i, 4)]);
-        smax[INDEX(1, i, 2)] = float(ROW(indices[i], rows) + optionsS[INDEX(1, i, 4)]);
-    }
-    free(indices);
+	flandmark_argmax_backtrack(smax, model, workspace, maxs0_idx, needed);
 }
 
-int flandmark_detect_base(uint8_t* face_image, FLANDMARK_Model* model, double * landmarks)
+// coarse-to-fine search of FLANDMARK_COARSE_TO_FINE; returns false, leaving q and landmarks undefined, when
+// the exhaustive search is needed
+template <typename T>
+static bool flandmark_coarse_to_fine(const FLANDMARK_Model* model, T **q, T **scores, FLANDMARK_Workspace *ws, double *landmarks, double *score, const int *needed)
 {
 	const int M = model->data.options.M;
-    const double * W = model->W;
-	int tsize = -1, cols = -1, rows = -1;
-    const int * mapTable = model->data.mapTable;
+	const int * S = model->data.options.S;
+	int coarse[256];
 
-	if (!model->normalizedImageFrame)
+	++ws->coarseRuns;
+
+	// window i of a component is at x = i / rows, y = i % rows of its search region
+	for (int idx = 0; idx < M; ++idx)
 	{
-		model->normalizedImageFrame = face_image;
-	} else {
-		//
+		if (!needed[idx])
+			continue;
+		const int rows = S[INDEX(3, idx, 4)] - S[INDEX(1, idx, 4)] + 1;
+		const int cols = S[INDEX(2, idx, 4)] - S[INDEX(0, idx, 4)] + 1;
+		if (rows*cols != model->data.lbp[idx].WINS_COLS)
+		{
+			++ws->coarseFallbacks;
+			return false;
+		}
+
+		int n = 0;
+		for (int x = 0; x < cols; x += FLANDMARK_COARSE_STEP)
+		{
+			for (int y = 0; y < rows; y += FLANDMARK_COARSE_STEP)
+			{
+				ws->windows[idx][n++] = x*rows + y;
+			}
+		}
+		ws->nWindows[idx] = n;
+		flandmark_get_q_pyr(q[idx], model, idx, &ws->pyr, ws->windows[idx], n);
 	}
+	flandmark_argmax_windows(landmarks, model, q, scores, ws, 0, needed);
+	memcpy(coarse, ws->indices, M*sizeof(int));
 
-	// get PSI matrix
-    FLANDMARK_PSI_SPARSE * Psi_sparse = (FLANDMARK_PSI_SPARSE*)malloc(M*sizeof(FLANDMARK_PSI_SPARSE));
+	// all positions around the coarse optimum, scoring those that are not scored yet
 	for (int idx = 0; idx < M; ++idx)
 	{
-		flandmark_get_psi_mat_sparse(&Psi_sparse[idx], model, idx);
+		if (!needed[idx])
+			continue;
+		const int rows = S[INDEX(3, idx, 4)] - S[INDEX(1, idx, 4)] + 1;
+		const int cols = S[INDEX(2, idx, 4)] - S[INDEX(0, idx, 4)] + 1;
+		const int cx = coarse[idx] / rows, cy = coarse[idx] % rows;
+		int * windows = ws->windows[idx];
+		int n = 0, nNew = 0;
+		for (int x = FLANDMARK_MAX(cx-FLANDMARK_COARSE_RADIUS, 0); x <= FLANDMARK_MIN(cx+FLANDMARK_COARSE_RADIUS, cols-1); ++x)
+		{
+			for (int y = FLANDMARK_MAX(cy-FLANDMARK_COARSE_RADIUS, 0); y <= FLANDMARK_MIN(cy+FLANDMARK_COARSE_RADIUS, rows-1); ++y)
+			{
+				// the new ones first
+				if (x % FLANDMARK_COARSE_STEP || y % FLANDMARK_COARSE_STEP)
+				{
+					windows[n++] = windows[nNew];
+					windows[nNew++] = x*rows + y;
+				} else {
+					windows[n++] = x*rows + y;
+				}
+			}
+		}
+		ws->nWindows[idx] = n;
+		flandmark_get_q_pyr(q[idx], model, idx, &ws->pyr, windows, nNew);
 	}
+	flandmark_argmax_windows(landmarks, model, q, scores, ws, score, needed);
 
-	// get Q and G
-	double ** q = (double**)calloc(M, sizeof(double*));
-	double ** g = (double**)calloc((M-1), sizeof(double*));
+	// a landmark on the rim of its neighbourhood, unless that is the border of the search region, may have a
+	// better position that was not scored
+	for (int idx = 0; idx < M; ++idx)
+	{
+		if (!needed[idx])
+			continue;
+		const int rows = S[INDEX(3, idx, 4)] - S[INDEX(1, idx, 4)] + 1;
+		const int cols = S[INDEX(2, idx, 4)] - S[INDEX(0, idx, 4)] + 1;
+		const int cx = coarse[idx] / rows, cy = coarse[idx] % rows;
+		const int x = ws->indices[idx] / rows, y = ws->indices[idx] % rows;
+		if ((x == cx-FLANDMARK_COARSE_RADIUS && x > 0) || (x == cx+FLANDMARK_COARSE_RADIUS && x < cols-1) ||
+			(y == cy-FLANDMARK_COARSE_RADIUS && y > 0) || (y == cy+FLANDMARK_COARSE_RADIUS && y < rows-1))
+		{
+			++ws->coarseFallbacks;
+			return false;
+		}
+	}
 
-	int idx_qtemp = 0;
+	return true;
+}
 
-	for (int idx = 0; idx < M; ++idx)
+// unary scores of the components of a list on workspace->pool, one task per component
+template <typename T>
+struct flandmark_q_job
+{
+	const FLANDMARK_Model * model;
+	T ** q;
+	const FLANDMARK_LBP_PYRAMID * pyr;
+	const int * components;
+};
+
+template <typename T>
+static void flandmark_q_task(void *arg, int k)
+{
+	const flandmark_q_job<T> * job = (const flandmark_q_job<T>*)arg;
+	const int idx = job->components[k];
+	flandmark_get_q_pyr(job->q[idx], job->model, idx, job->pyr);
+}
+
+// unary scores of the needed components, then the argmax; rejects the face as soon as an optimistic bound of
+// its score is below threshold
+template <typename T>
+static int flandmark_detect_base(const FLANDMARK_Model* model, T **q, T **scores, FLANDMARK_Workspace *ws, double *landmarks, int flags, double threshold, double *score, const int *needed)
+{
+	if (flags & FLANDMARK_COARSE_TO_FINE)
 	{
-		// Q
-		tsize = mapTable[INDEX(idx, 1, M)] - mapTable[INDEX(idx, 0, M)] + 1;
+		double s;
+		if (flandmark_coarse_to_fine(model, q, scores, ws, landmarks, &s, needed))
+		{
+			if (score)
+				*score = s;
+			return s < threshold ? FLANDMARK_REJECTED : 0;
+		}
+	}
+
+	const int M = model->data.options.M;
+	const int root = model->edges[model->nEdges-1].parent;
+	const double unit = flandmark_score_unit(model, (const T*)0);
 
-		double * q_temp = (double*)calloc(tsize, sizeof(double));
-		memcpy(q_temp, W+mapTable[INDEX(idx, 0, M)]-1, tsize*sizeof(double));
+	// a tree scores at most the largest unary score of every component plus the largest cost of every edge,
+	// plus the rounding of the precision of the model; the bound of a component is replaced by its actual
+	// maximum once its scores are known, the root first
+	double bound = model->boundMargin;
+	for (int idx = 0; idx < M; ++idx)
+	{
+		if (needed[idx])
+			bound += model->qBound[idx];
+	}
+	for (int e = 0; e < model->nEdges; ++e)
+	{
+		if (needed[model->edges[e].child])
+			bound += model->edges[e].maxCost;
+	}
 
-		// sparse dot product <W_q, PSI_q>
-		cols = Psi_sparse[idx].PSI_COLS; rows = Psi_sparse[idx].PSI_ROWS;
-		uint32_t *psi_temp = Psi_sparse[idx].idxs;
-		q[idx] = (double*)malloc(cols*sizeof(double));
-		for (int i = 0; i < cols; ++i)
+	// on a pool, all components are scored before the threshold is checked
+	if (ws->pool)
+	{
+		int components[256], nComponents = 0;
+		for (int idx = 0; idx < M; ++idx)
 		{
-			double dotprod = 0.0f;
-			for (int j = 0; j < rows; ++j)
-			{
-				idx_qtemp = psi_temp[(rows*i) + j];
-				dotprod += q_temp[ idx_qtemp ];
-			}
-			q[idx][i] = dotprod;
+			if (needed[idx])
+				components[nComponents++] = idx;
 		}
-		free(q_temp);
+		flandmark_q_job<T> job = {model, q, &ws->pyr, components};
+		flandmark_thread_pool_run(ws->pool, nComponents, flandmark_q_task<T>, &job);
+	}
 
-		// G
-		if (idx > 0)
+	for (int k = 0; k < M; ++k)
+	{
+		const int idx = k == 0 ? root : (k-1 < root ? k-1 : k);
+		if (!needed[idx])
+			continue;
+		if (!ws->pool)
+			flandmark_get_q_pyr(q[idx], model, idx, &ws->pyr);
+
+		if (threshold > FLANDMARK_NO_THRESHOLD)
 		{
-			tsize = mapTable[INDEX(idx, 3, M)] - mapTable[INDEX(idx, 2, M)] + 1;
-			g[idx - 1] = (double*)malloc(tsize*sizeof(double));
-			memcpy(g[idx - 1], W+mapTable[INDEX(idx, 2, M)]-1, tsize*sizeof(double));
+			T maximum = q[idx][0];
+			for (int i = 1; i < model->data.lbp[idx].WINS_COLS; ++i)
+			{
+				maximum = FLANDMARK_MAX(maximum, q[idx][i]);
+			}
+			bound += maximum/unit - model->qBound[idx];
+			if (bound < threshold)
+			{
+				if (score)
+					*score = bound;
+				return FLANDMARK_REJECTED;
+			}
 		}
 	}
 
-    // argmax
-    flandmark_argmax(landmarks, &model->data.options, mapTable, Psi_sparse, q, g);
+	double s;
+	flandmark_argmax(landmarks, model, q, scores, ws, flags, &s, needed);
+	if (score)
+		*score = s;
 
-	// cleanup Psi_sparse[].idxs
-	for (int i = 0; i < M; ++i)
+	return s < threshold ? FLANDMARK_REJECTED : 0;
+}
+
+// detection from the LBP code maps of the frame in ws->pyr
+static int flandmark_detect_codes(const FLANDMARK_Model* model, double * landmarks, FLANDMARK_Workspace * ws, int flags, double threshold, double * score, const int * mask)
+{
+	int needed[256];
+	flandmark_tree_needed(model, mask, needed);
+
+	// scored straight from the LBP codes, in fixed point for quantized models and in float for single
+	// precision models
+	if (model->quant)
 	{
-		free(Psi_sparse[i].idxs);
+		return flandmark_detect_base(model, ws->qi, ws->scoresi, ws, landmarks, flags, threshold, score, needed);
+	} else if (model->Wf) {
+		return flandmark_detect_base(model, ws->qf, ws->scoresf, ws, landmarks, flags, threshold, score, needed);
 	}
-	free(Psi_sparse);
+	return flandmark_detect_base(model, ws->q, ws->scores, ws, landmarks, flags, threshold, score, needed);
+}
 
-	// cleanup q
-	for (int i = 0; i < M; ++i)
+int flandmark_detect_base(const uint8_t* face_image, const FLANDMARK_Model* model, double * landmarks, FLANDMARK_Workspace * workspace, int flags, double threshold, double * score, const int * mask)
+{
+	FLANDMARK_Workspace * ws = workspace ? workspace : flandmark_workspace_create(model);
+	if (!ws)
 	{
-		free(q[i]);
+		return 1;
 	}
-	free(q);
-	// cleanup g
-	for (int i = 0; i < M - 1; ++i)
+
+	// LBP codes are computed once for the whole frame and shared by all windows
+	FLANDMARK_LBP_PYRAMID * pyr = &ws->pyr;
+	liblbp_pyr_codemaps(pyr->codes, pyr->mirrored, pyr->sums, face_image, pyr->ROWS, pyr->COLS, pyr->nLevels);
+
+	int retval = flandmark_detect_codes(model, landmarks, ws, flags, threshold, score, mask);
+
+	if (!workspace)
 	{
-		free(g[i]);
+		flandmark_workspace_free(ws);
 	}
-	free(g);
 
-	return 0;
+	return retval;
 }
 
-int flandmark_detect(IplImage *img, int *bbox, FLANDMARK_Model *model, double *landmarks, int *bw_margin)
+int flandmark_detect(IplImage *img, int *bbox, FLANDMARK_Model *model, double *landmarks, int *bw_margin, double *score)
 {
-    int retval = 0;
-
-    if (bw_margin)
+	// the buffers of the model serve as its own context
+	FLANDMARK_Context context;
+	context.normalizedImageFrame = model->normalizedImageFrame;
+	context.bb = model->bb;
+	context.sf = model->sf;
+	context.workspace = 0;
+	context.flags = 0;
+	context.threshold = FLANDMARK_NO_THRESHOLD;
+	context.mask = 0;
+	context.pyramid = 0;
+	context.interpolation = FLANDMARK_INTER_CUBIC;
+	context.score = NAN;
+
+	int retval = flandmark_detect_ctx(img, bbox, model, &context, landmarks, bw_margin);
+	if (score)
 	{
-		model->data.options.bw_margin[0] = bw_margin[0];
-		model->data.options.bw_margin[1] = bw_margin[1];
+		*score = retval == NO_ERR || retval == FLANDMARK_REJECTED ? context.score : NAN;
 	}
+	return retval;
+}
+
+static int flandmark_normalize(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, const FLANDMARK_Model *model, const int *bw_margin, FLANDMARK_Workspace *workspace, FLANDMARK_ImagePyramid *pyramid, int interpolation, FLANDMARK_LBP_PYRAMID *pyr);
+
+int flandmark_detect_ctx(IplImage *img, int *bbox, const FLANDMARK_Model *model, FLANDMARK_Context *context, double *landmarks, int *bw_margin)
+{
+    int retval = 0;
+
+	// only set by a detection that gets as far as scoring the face
+	context->score = NAN;
+
+	// with a workspace, the LBP codes of the frame are computed while it is resampled
+	FLANDMARK_Workspace * ws = context->workspace;
+	const bool fused = ws && ws->pyr.ROWS == model->data.options.bw[1] && ws->pyr.COLS == model->data.options.bw[0];
 
 	// Get normalized image frame
-    retval = flandmark_get_normalized_image_frame(img, bbox, model->bb, model->normalizedImageFrame, model);
+    retval = flandmark_normalize(img, bbox, context->bb, context->normalizedImageFrame, model, bw_margin, ws, context->pyramid, context->interpolation, fused ? &ws->pyr : 0);
     if (retval)
     {
         // flandmark_get_normlalized_image_frame ERROR;
@@ -987,20 +3035,30 @@ int flandmark_detect(IplImage *img, int *bbox, FLANDMARK_Model *model, double *l
     }
 
     // Call flandmark_detect_base
-    retval = flandmark_detect_base(model->normalizedImageFrame, model, landmarks);
+    if (fused)
+    {
+        retval = flandmark_detect_codes(model, landmarks, ws, context->flags, context->threshold, &context->score, context->mask);
+    } else {
+        retval = flandmark_detect_base(context->normalizedImageFrame, model, landmarks, ws, context->flags, context->threshold, &context->score, context->mask);
+    }
+    if (retval == FLANDMARK_REJECTED)
+    {
+        return FLANDMARK_REJECTED;
+    }
     if (retval)
     {
         // flandmark_detect_base ERROR
+        context->score = NAN;
         return 2;
     }
 
 	// transform coordinates of detected landmarks from normalized image frame back to the original image
-	model->sf[0] = (float)(model->bb[2]-model->bb[0])/model->data.options.bw[0];
-	model->sf[1] = (float)(model->bb[3]-model->bb[1])/model->data.options.bw[1];
+	context->sf[0] = (float)(context->bb[2]-context->bb[0])/model->data.options.bw[0];
+	context->sf[1] = (float)(context->bb[3]-context->bb[1])/model->data.options.bw[1];
 	for (int i = 0; i < 2*model->data.options.M; i += 2)
 	{
-		landmarks[i]   = landmarks[i]*model->sf[0] + model->bb[0];
-		landmarks[i+1] = landmarks[i+1]*model->sf[1] + model->bb[1];
+		landmarks[i]   = landmarks[i]*context->sf[0] + context->bb[0];
+		landmarks[i+1] = landmarks[i+1]*context->sf[1] + context->bb[1];
 	}
 
 	return 0;
@@ -1053,17 +3111,362 @@ int flandmark_imcrop(IplImage *input, IplImage *output, const CvRect region)
 	return 0;
 }
 
-int flandmark_get_normalized_image_frame(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, FLANDMARK_Model *model)
+/*-----------------------------------------------------------------------
+  Cubic resampling of the extended box into the normalized frame.
+
+  The arithmetic of cvResize(CV_INTER_CUBIC) on 8-bit images: Keys kernel
+  with A = -0.75 evaluated in float and rounded to 11 bits, border pixels
+  of the box replicated, an integer horizontal pass and a float vertical
+  pass rounded to nearest, as in its vectorized path. Only the 4 source
+  rows of every output row are read, each once, so the work depends on the
+  frame and not on the box, and no pixel outside the box is touched. The
+  frame is written column by column, as face_img is laid out.
+
+  The tables depend only on the box size, and face detectors return few
+  distinct sizes: the workspace keeps those of the last sizes seen.
+
+  Large boxes may instead be resampled from an octave of the image (see
+  FLANDMARK_ImagePyramid), the fraction of coarse pixel where the box
+  starts going into the tables.
+
+  Bilinear resampling goes through the same tables and passes with 2
+  taps instead of 4. Area resampling has no tables: every source row is
+  summed under the frame columns, then added to the frame rows it falls
+  under, both weighted by the fraction of the pixel that falls there.
+  Averaging a box smaller than the frame would copy every source pixel
+  to a block of frame pixels, so such boxes go through 2-tap tables with
+  the weights cvResize(CV_INTER_AREA) gives them instead.
+  -----------------------------------------------------------------------*/
+#define FLANDMARK_RESAMPLE_BITS 11
+
+// source pixels read by the n outputs of a side spanning span pixels from origin, clamped to [0, last], and their
+// weights rounded to 1/2^11 and multiplied by unit; taps of them per output, 4 for the cubic kernel and 2 for
+// the bilinear one and for the area one of boxes smaller than the frame, which goes to the pixel an output
+// starts in and to the next one by the fraction of that output past the start of the next (as cvResize)
+template <typename Weight>
+static void flandmark_resampler_side(int *ofs, Weight *weights, Weight unit, double origin, double span, int last, int n, int interpolation)
+{
+	const int taps = interpolation == FLANDMARK_INTER_CUBIC ? 4 : 2;
+	const double scale = 1./((double)n/span);
+	const float A = -0.75f;
+	for (int d = 0; d < n; ++d)
+	{
+		float x;
+		int s;
+		if (interpolation == FLANDMARK_INTER_AREA)
+		{
+			s = (int)floor(d*scale);
+			x = (float)((d+1) - (s+1)*((double)n/span));
+			x = x <= 0 ? 0.f : x - floorf(x);
+			if (s >= last)
+			{
+				s = last;
+				x = 0.f;
+			}
+		} else {
+			x = (float)((d+0.5)*scale - 0.5 + origin);
+			s = (int)floorf(x);
+			x -= s;
+		}
+
+		float c[4];
+		if (taps == 4)
+		{
+			c[0] = ((A*(x + 1) - 5*A)*(x + 1) + 8*A)*(x + 1) - 4*A;
+			c[1] = ((A + 2)*x - (A + 3))*x*x + 1;
+			c[2] = ((A + 2)*(1 - x) - (A + 3))*(1 - x)*(1 - x) + 1;
+			c[3] = 1.f - c[0] - c[1] - c[2];
+		} else {
+			c[0] = 1.f - x;
+			c[1] = x;
+		}
+		for (int k = 0; k < taps; ++k)
+		{
+			ofs[taps*d+k] = FLANDMARK_MIN(FLANDMARK_MAX(s-taps/2+1+k, 0), last);
+			weights[taps*d+k] = (Weight)lrintf(c[k]*(1 << FLANDMARK_RESAMPLE_BITS))*unit;
+		}
+	}
+}
+
+// origin, span and last pixel of the box in x, then in y
+static void flandmark_resampler_prepare(FLANDMARK_RESAMPLER_TABLES *tables, const double origin[2], const double span[2], const int last[2], const int bw[2], int interpolation)
+{
+	const int taps = interpolation == FLANDMARK_INTER_CUBIC ? 4 : 2;
+	tables->interpolation = interpolation;
+	tables->taps = taps;
+	flandmark_resampler_side(tables->xofs, tables->alpha, (int16_t)1, origin[0], span[0], last[0], bw[0], interpolation);
+	flandmark_resampler_side(tables->yofs, tables->beta, 1.f/(1 << 2*FLANDMARK_RESAMPLE_BITS), origin[1], span[1], last[1], bw[1], interpolation);
+
+	// the rows of every output row are consecutive and do not go back past those of the previous one, so a row
+	// is either past all rows so far or among them
+	tables->nRows = 0;
+	for (int i = 0; i < taps*bw[1]; ++i)
+	{
+		const int row = tables->yofs[i];
+		if (tables->nRows == 0 || row > tables->srcRows[tables->nRows-1])
+		{
+			tables->srcRows[tables->nRows++] = row;
+		}
+		int slot = tables->nRows-1;
+		while (slot > 0 && tables->srcRows[slot] != row)
+		{
+			--slot;
+		}
+		tables->yofs[i] = slot;
+	}
+}
+
+// tables of a box of width x height pixels, from the cache of r or replacing its oldest ones
+static const FLANDMARK_RESAMPLER_TABLES * flandmark_resampler_tables(FLANDMARK_RESAMPLER *r, int width, int height, const int bw[2], int interpolation)
+{
+	for (int t = 0; t < r->nTables; ++t)
+	{
+		if (r->tables[t].width == width && r->tables[t].height == height && r->tables[t].interpolation == interpolation)
+		{
+			return &r->tables[t];
+		}
+	}
+	FLANDMARK_RESAMPLER_TABLES * tables = &r->tables[r->next];
+	r->next = (r->next + 1) % r->nTables;
+	const double origin[2] = {0., 0.}, span[2] = {(double)width, (double)height};
+	const int last[2] = {width-1, height-1};
+	flandmark_resampler_prepare(tables, origin, span, last, bw, interpolation);
+	tables->width = width;
+	tables->height = height;
+	return tables;
+}
+
+// tables of the box at (x1, y1) of width x height pixels of level 0, resampled from the given octave; its origin
+// goes to xy, and its tables are not cached, they depend on where the box falls on the coarser grid
+static const FLANDMARK_RESAMPLER_TABLES * flandmark_resampler_octave_tables(FLANDMARK_RESAMPLER *r, const FLANDMARK_ImagePyramid *pyramid, int level, int x1, int y1, int width, int height, int xy[2], const int bw[2], int interpolation)
+{
+	const int f = 1 << level;
+	xy[0] = x1 >> level;
+	xy[1] = y1 >> level;
+	const double origin[2] = {(double)(x1 - xy[0]*f)/f, (double)(y1 - xy[1]*f)/f}, span[2] = {(double)width/f, (double)height/f};
+	const int last[2] = {FLANDMARK_MIN((x1+width-1) >> level, pyramid->width[level]-1) - xy[0],
+		FLANDMARK_MIN((y1+height-1) >> level, pyramid->height[level]-1) - xy[1]};
+
+	FLANDMARK_RESAMPLER_TABLES * tables = &r->tables[r->next];
+	r->next = (r->next + 1) % r->nTables;
+	flandmark_resampler_prepare(tables, origin, span, last, bw, interpolation);
+	tables->width = tables->height = 0;
+	return tables;
+}
+
+FLANDMARK_ImagePyramid * flandmark_image_pyramid_create(IplImage *image)
+{
+	if (image->depth != IPL_DEPTH_8U || image->nChannels != 1)
+	{
+		return 0;
+	}
+	FLANDMARK_ImagePyramid * pyramid = (FLANDMARK_ImagePyramid*)calloc(1, sizeof(FLANDMARK_ImagePyramid));
+	if (pyramid == NULL)
+	{
+		return 0;
+	}
+	pyramid->image = image;
+	pyramid->nLevels = 1;
+	pyramid->levels[0] = (uint8_t*)image->imageData;
+	pyramid->width[0] = image->width;
+	pyramid->height[0] = image->height;
+	pyramid->step[0] = image->widthStep;
+	return pyramid;
+}
+
+void flandmark_image_pyramid_free(FLANDMARK_ImagePyramid *pyramid)
+{
+	if (!pyramid)
+	{
+		return;
+	}
+	for (int level = 1; level < pyramid->nLevels; ++level)
+	{
+		free(pyramid->levels[level]);
+	}
+	free(pyramid);
+}
+
+// octave to resample a box of width x height pixels of level 0 from: the coarsest one on which the box still
+// spans the frame, built with the ones before it if needed (or the finest one memory allows)
+static int flandmark_image_pyramid_level(FLANDMARK_ImagePyramid *pyramid, int width, int height, const int bw[2])
+{
+	int level = 0;
+	while (level+1 < FLANDMARK_PYRAMID_LEVELS && (width >> (level+1)) >= bw[0] && (height >> (level+1)) >= bw[1])
+	{
+		++level;
+	}
+
+	while (pyramid->nLevels <= level)
+	{
+		const int l = pyramid->nLevels;
+		const int w = pyramid->width[l-1]/2, h = pyramid->height[l-1]/2, step = pyramid->step[l-1];
+		uint8_t * dst = (uint8_t*)malloc((size_t)w*h);
+		if (dst == NULL)
+		{
+			return l-1;
+		}
+		for (int y = 0; y < h; ++y)
+		{
+			const uint8_t * top = pyramid->levels[l-1] + (size_t)(2*y)*step;
+			const uint8_t * bottom = top + step;
+			for (int x = 0; x < w; ++x)
+			{
+				dst[(size_t)y*w + x] = (uint8_t)((top[2*x] + top[2*x+1] + bottom[2*x] + bottom[2*x+1] + 2) >> 2);
+			}
+		}
+		pyramid->levels[l] = dst;
+		pyramid->width[l] = w;
+		pyramid->height[l] = h;
+		pyramid->step[l] = w;
+		pyramid->nLevels = l+1;
+	}
+	return level;
+}
+
+// resamples the box of tables->width x tables->height pixels at src, rows step bytes apart, into face_img, with
+// TAPS = tables->taps; with a stream, every column of the frame is also handed to it as soon as it is written
+template <int TAPS>
+static void flandmark_resample(const FLANDMARK_RESAMPLER_TABLES *tables, int32_t *buffer, const uint8_t *src, int step, uint8_t *face_img, const int bw[2], liblbp_codemap_stream *stream)
+{
+	const int cols = bw[0], rows = bw[1], nRows = tables->nRows;
+
+	for (int i = 0; i < nRows; ++i)
+	{
+		const uint8_t * row = src + (size_t)tables->srcRows[i]*step;
+		for (int dx = 0; dx < cols; ++dx)
+		{
+			const int * xofs = tables->xofs + TAPS*dx;
+			const int16_t * alpha = tables->alpha + TAPS*dx;
+			int32_t value = 0;
+			for (int k = 0; k < TAPS; ++k)
+			{
+				value += row[xofs[k]]*alpha[k];
+			}
+			buffer[dx*nRows + i] = value;
+		}
+	}
+
+	for (int dx = 0; dx < cols; ++dx)
+	{
+		const int32_t * column = buffer + dx*nRows;
+		uint32_t * sums = stream ? stream->column(dx) : 0;
+		for (int dy = 0; dy < rows; ++dy)
+		{
+			const int * yofs = tables->yofs + TAPS*dy;
+			const float * beta = tables->beta + TAPS*dy;
+			float sum = (float)column[yofs[TAPS-1]]*beta[TAPS-1];
+			for (int k = TAPS-2; k >= 0; --k)
+			{
+				sum = (float)column[yofs[k]]*beta[k] + sum;
+			}
+			const long value = lrintf(sum);
+			const uint8_t pixel = (uint8_t)FLANDMARK_MIN(FLANDMARK_MAX(value, 0L), 255L);
+			face_img[INDEX(dy, dx, rows)] = pixel;
+			if (sums)
+				sums[dy] = pixel;
+		}
+		if (stream)
+			stream->push(dx);
+	}
+}
+
+static void flandmark_resample(const FLANDMARK_RESAMPLER_TABLES *tables, int32_t *buffer, const uint8_t *src, int step, uint8_t *face_img, const int bw[2], liblbp_codemap_stream *stream)
+{
+	if (tables->taps == 2)
+	{
+		flandmark_resample<2>(tables, buffer, src, step, face_img, bw, stream);
+	} else {
+		flandmark_resample<4>(tables, buffer, src, step, face_img, bw, stream);
+	}
+}
+
+// averages the source pixels under every frame pixel of the box of width x height pixels at src, rows step bytes
+// apart, into face_img; buffer holds bw[0]*(bw[1]+1) floats
+static void flandmark_resample_area(const uint8_t *src, int step, int width, int height, float *buffer, uint8_t *face_img, const int bw[2], liblbp_codemap_stream *stream)
+{
+	const int cols = bw[0], rows = bw[1];
+	const double sx = (double)width/cols, sy = (double)height/rows;
+	float * sums = buffer;  // column by column, as face_img
+	float * row = buffer + cols*rows;
+	memset(sums, 0, cols*rows*sizeof(float));
+
+	int first = 0;  // first frame row not complete yet
+	for (int y = 0; y < height; ++y)
+	{
+		// the source row under every frame column, the pixels on the edges of a column weighted by their share
+		const uint8_t * line = src + (size_t)y*step;
+		for (int dx = 0; dx < cols; ++dx)
+		{
+			const double x0 = dx*sx, x1 = x0 + sx;
+			const int left = (int)x0, right = FLANDMARK_MIN((int)ceil(x1), width) - 1;
+			if (left >= right)
+			{
+				row[dx] = (float)(line[left]*(x1 - x0));
+				continue;
+			}
+			int inner = 0;
+			for (int x = left+1; x < right; ++x)
+			{
+				inner += line[x];
+			}
+			row[dx] = (float)(line[left]*(left + 1 - x0) + inner + line[right]*(FLANDMARK_MIN(right + 1., x1) - right));
+		}
+
+		// added to the frame rows it falls under
+		for (int dy = first; dy < rows; ++dy)
+		{
+			const double top = dy*sy, bottom = top + sy;
+			if (top >= y+1)
+			{
+				break;
+			}
+			const float share = (float)(FLANDMARK_MIN(y + 1., bottom) - FLANDMARK_MAX((double)y, top));
+			for (int dx = 0; dx < cols; ++dx)
+			{
+				sums[dx*rows + dy] += share*row[dx];
+			}
+			if (bottom <= y+1)
+			{
+				first = dy+1;
+			}
+		}
+	}
+
+	const float scale = (float)(1./(sx*sy));
+	for (int dx = 0; dx < cols; ++dx)
+	{
+		uint32_t * column = stream ? stream->column(dx) : 0;
+		for (int dy = 0; dy < rows; ++dy)
+		{
+			const long value = lrintf(sums[dx*rows + dy]*scale);
+			const uint8_t pixel = (uint8_t)FLANDMARK_MIN(FLANDMARK_MAX(value, 0L), 255L);
+			face_img[INDEX(dy, dx, rows)] = pixel;
+			if (column)
+				column[dy] = pixel;
+		}
+		if (stream)
+			stream->push(dx);
+	}
+}
+
+// normalizes the face; with pyr, the LBP code maps of the frame are computed along (see liblbp_codemap_stream)
+static int flandmark_normalize(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, const FLANDMARK_Model *model, const int *bw_margin, FLANDMARK_Workspace *workspace, FLANDMARK_ImagePyramid *pyramid, int interpolation, FLANDMARK_LBP_PYRAMID *pyr)
 {
 	bool flag;
 	int d[2];
 	double c[2], nd[2];
 
+	if (!bw_margin)
+	{
+		bw_margin = model->data.options.bw_margin;
+	}
+
 	// extend bbox by bw_margin
 	d[0] = bbox[2]-bbox[0]+1;  d[1] = bbox[3]-bbox[1]+1;
 	c[0] = (bbox[2]+bbox[0])/2.0f; c[1] = (bbox[3]+bbox[1])/2.0f;
-	nd[0] = d[0]*model->data.options.bw_margin[0]/100.0f + d[0];
-	nd[1] = d[1]*model->data.options.bw_margin[1]/100.0f + d[1];
+	nd[0] = d[0]*bw_margin[0]/100.0f + d[0];
+	nd[1] = d[1]*bw_margin[1]/100.0f + d[1];
 
     bb[0] = (c[0] - nd[0]/2.0f);
     bb[1] = (c[1] - nd[1]/2.0f);
@@ -1078,30 +3481,66 @@ int flandmark_get_normalized_image_frame(IplImage *input, const int bbox[], doub
 		return 1;
 	}
 
-    IplImage *croppedImage = cvCreateImage(cvSize(input->width, input->height), IPL_DEPTH_8U, 1);
-
-    IplImage *resizedImage = cvCreateImage(cvSize(model->data.options.bw[0], model->data.options.bw[1]), IPL_DEPTH_8U, 1);
-
-	// crop and resize image to normalized frame
-    if(flandmark_imcrop(input, croppedImage, cvRect((int)bb[0], (int)bb[1], (int)bb[2]-(int)bb[0]+1, (int)bb[3]-(int)bb[1]+1)))
+	// resample straight from the region of the input, or of the octave it comes from
+	const int x1 = (int)bb[0], y1 = (int)bb[1];
+	const int width = (int)bb[2]-x1+1, height = (int)bb[3]-y1+1;
+	if (width <= 0 || height <= 0 || input->depth != IPL_DEPTH_8U || input->nChannels != 1)
 	{
-		// something was bad
 		return 1;
 	}
-    // resize
-    cvResize(croppedImage, resizedImage, CV_INTER_CUBIC);
+	const int * bw = model->data.options.bw;
+	const bool octaves = pyramid && pyramid->image == input && interpolation != FLANDMARK_INTER_AREA;
+	const int level = octaves ? flandmark_image_pyramid_level(pyramid, width, height, bw) : 0;
 
-	// tranform IplImage to simple 1D uint8 array representing 2D uint8 normalized image frame
-	for (int x = 0; x < model->data.options.bw[0]; ++x)
+	FLANDMARK_RESAMPLER local, * resampler = workspace ? &workspace->resampler : &local;
+	char * buffer = 0;
+	if (!workspace)
 	{
-		for (int y = 0; y < model->data.options.bw[1]; ++y)
+		size_t size = 0;
+		flandmark_resampler_layout(&local, bw, 1, 0, &size);
+		buffer = (char*)malloc(size);
+		if (buffer == NULL)
 		{
-            face_img[INDEX(x, y, model->data.options.bw[1])] = (uint8_t)((resizedImage->imageData + resizedImage->widthStep*x)[y]);
+			return 1;
 		}
+		size = 0;
+		flandmark_resampler_layout(&local, bw, 1, buffer, &size);
+	}
+
+	liblbp_codemap_stream stream, * encoder = 0;
+	if (pyr)
+	{
+		stream.codes = pyr->codes;
+		stream.mirrored = pyr->mirrored;
+		stream.sums = pyr->sums;
+		stream.nRows = pyr->ROWS;
+		stream.nCols = pyr->COLS;
+		stream.nLevels = pyr->nLevels;
+		stream.begin();
+		encoder = &stream;
 	}
 
-    cvReleaseImage(&croppedImage);
-    cvReleaseImage(&resizedImage);
+	// like cvResize, area resampling only averages boxes at least as large as the frame on both sides
+	if (interpolation == FLANDMARK_INTER_AREA && width >= bw[0] && height >= bw[1])
+	{
+		// the row buffer of the resampler holds the sums
+		const uint8_t * src = (const uint8_t*)input->imageData + (size_t)y1*input->widthStep + x1;
+		flandmark_resample_area(src, input->widthStep, width, height, (float*)resampler->rows, face_img, bw, encoder);
+	} else if (level == 0) {
+		const uint8_t * src = (const uint8_t*)input->imageData + (size_t)y1*input->widthStep + x1;
+		flandmark_resample(flandmark_resampler_tables(resampler, width, height, bw, interpolation), resampler->rows, src, input->widthStep, face_img, bw, encoder);
+	} else {
+		int xy[2];
+		const FLANDMARK_RESAMPLER_TABLES * tables = flandmark_resampler_octave_tables(resampler, pyramid, level, x1, y1, width, height, xy, bw, interpolation);
+		const uint8_t * src = pyramid->levels[level] + (size_t)xy[1]*pyramid->step[level] + xy[0];
+		flandmark_resample(tables, resampler->rows, src, pyramid->step[level], face_img, bw, encoder);
+	}
+	free(buffer);
 
 	return 0;
 }
+
+int flandmark_get_normalized_image_frame(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, const FLANDMARK_Model *model, const int *bw_margin, FLANDMARK_Workspace *workspace, FLANDMARK_ImagePyramid *pyramid, int interpolation)
+{
+	return flandmark_normalize(input, bbox, bb, face_img, model, bw_margin, workspace, pyramid, interpolation, 0);
+}
@@ -12,9 +12,42 @@
 #define __FLANDMARK_DETECTOR_H_
 
 #include <stdint.h>
+#include <float.h>
 #include <cv.h>
 #include <cvaux.h>
 
+// number of faces processed side by side by flandmark_detect_base_batch
+#ifndef FLANDMARK_BATCH_LANES
+#define FLANDMARK_BATCH_LANES 4
+#endif
+
+// flags of FLANDMARK_Context
+#define FLANDMARK_DISTANCE_TRANSFORM 0x01  // use the distance transform on quadratic edges (ties may resolve differently)
+#define FLANDMARK_COARSE_TO_FINE 0x02      // score every other position first, then around the best ones (see flandmark_detect_base)
+#define FLANDMARK_BRANCH_AND_BOUND 0x04    // solve the root only at positions that can still win (see flandmark_argmax)
+
+// flags of flandmark_init
+#define FLANDMARK_SINGLE_PRECISION 0x01  // score and maximize in float (landmarks may move, see flandmark_init)
+#define FLANDMARK_QUANTIZED 0x02         // score and maximize in fixed point (landmarks may move, see flandmark_init)
+
+// marks the optional topology block at the end of the model file, see flandmark_write_model
+#define FLANDMARK_TOPOLOGY_TAG 0x45455254  // "TREE"
+
+// file next to the model holding its quantized weights and the tag it starts with, see flandmark_write_quantized
+#define FLANDMARK_QUANTIZED_SUFFIX ".q16"
+#define FLANDMARK_QUANTIZED_TAG 0x36315451  // "QT16"
+
+// interpolation of the normalized frame, see flandmark_get_normalized_image_frame
+#define FLANDMARK_INTER_CUBIC 0     // as cvResize(CV_INTER_CUBIC), the one the models are trained with
+#define FLANDMARK_INTER_BILINEAR 1  // 2x2 source pixels per frame pixel
+#define FLANDMARK_INTER_AREA 2      // as cvResize(CV_INTER_AREA): average of the source pixels under every frame pixel
+
+// detection score threshold that rejects nothing
+#define FLANDMARK_NO_THRESHOLD (-DBL_MAX)
+
+// return value of the detection functions when the score of the face is below the threshold
+#define FLANDMARK_REJECTED 3
+
 // index row-order matrices
 #define INDEX(ROW, COL, NUM_ROWS) ((COL)*(NUM_ROWS)+(ROW))
 #define ROW(IDX, ROWS) (((IDX)-1) % (ROWS))
@@ -31,6 +64,12 @@ typedef struct options_struct {
     int bw[2], bw_margin[2];
     FLANDMARK_PSIG *PsiGS0, *PsiGS1, *PsiGS2;
     int PSIG_ROWS[3], PSIG_COLS[3];
+    // topology block of the model file (see flandmark_write_model); nEdges = 0 for the 8-point tree
+    int nEdges;
+    int *edges;  // [4 x nEdges]: child, parent, PsiG table and its column of every edge, from the leaves to the root
+    int nPsiGX;  // tables 3, 4, ... that edges may refer to besides PsiGS0-2
+    FLANDMARK_PSIG **PsiGX;
+    int *PSIGX_ROWS, *PSIGX_COLS;
 } FLANDMARK_Options;
 
 typedef struct lbp_struct {
@@ -47,10 +86,48 @@ typedef struct data_struct {
     FLANDMARK_Options options;
 } FLANDMARK_Data;
 
+// pairwise term of one edge of the tree: costs[i*nChild + j] = <g_child, PsiG(i).disp(:, j)> for parent
+// position i and child position j (j < cols[i])
+typedef struct edge_struct {
+    int parent, child;
+    int nParent, nChild;
+    int *cols;
+    double *costs;
+    float *costsf;  // costs in float, single precision models only
+    int32_t *costsi;  // costs in fixed point, quantized models only
+    double maxCost;   // largest of the costs
+    double *rowMax;   // per parent position, the largest of its costs
+    // quadratic edges: child position j = cx*childRows + cy and the best child of parent position i maximizes
+    // child[j] - wx*(cx - px[qx[i]])^2 - wy*(cy - py[qy[i]])^2, which the distance transform solves
+    int quadratic;
+    int childRows, childCols;
+    double wx, wy;
+    int nPx, nPy;
+    double *px, *py;
+    int *qx, *qy;
+} FLANDMARK_EDGE;
+
+// fixed point weights: the appearance weights of component idx are W[j] / 2^shift[idx] (the deformation
+// entries of W are unused, the costs are rounded from the double tables); unary scores and deformation costs
+// are in int32 units of 1 / 2^scale, which is coarse enough for no score of the tree to overflow
+typedef struct quant_struct {
+    int16_t *W;
+    int *shift;
+    int scale;
+} FLANDMARK_QUANT;
+
 typedef struct model_struct {
     double * W;
+    float * Wf;  // W in float for single precision models, 0 otherwise
+    FLANDMARK_QUANT * quant;  // quantized models only, 0 otherwise
     int W_ROWS, W_COLS;
     FLANDMARK_Data data;
+    FLANDMARK_EDGE *edges;  // ordered from the leaves to the root
+    int nEdges;
+    double *qBound;  // per component, largest unary score any window can get
+    double boundMargin;  // how far rounding in the precision of the model may take a score above qBound and maxCost
+    uint32_t **cells;  // per component, offset of the code of every cell from the window corner in the code maps of
+                       // the frame, for plain windows then for mirrored ones (see flandmark_get_q_pyr)
     uint8_t *normalizedImageFrame;
     double *bb;
     float *sf;
@@ -65,6 +142,87 @@ typedef struct psi_sparse {
     uint32_t * idxs;
     uint32_t PSI_ROWS, PSI_COLS;
 } FLANDMARK_PSI_SPARSE;
+
+typedef struct lbp_pyramid_struct {
+    uint8_t *codes, *mirrored;  // nLevels planes of ROWS x COLS LBP codes of the normalized frame
+    uint32_t *sums;  // scratch block sums, one plane per level in a workspace (see liblbp_codemap_stream)
+    int ROWS, COLS, nLevels;
+} FLANDMARK_LBP_PYRAMID;
+
+// worker threads shared by detections, see flandmark_thread_pool_create
+typedef struct thread_pool_struct FLANDMARK_ThreadPool;
+
+// root position with an upper bound of its score, see FLANDMARK_BRANCH_AND_BOUND
+typedef struct candidate_struct {
+    double bound;
+    int position;
+} FLANDMARK_CANDIDATE;
+
+// octaves of an image, each the 2x2 box average of the previous one, built when a face first needs them (see
+// flandmark_get_normalized_image_frame); used by one detection at a time
+#define FLANDMARK_PYRAMID_LEVELS 16
+typedef struct image_pyramid_struct {
+    IplImage *image;  // level 0 (not owned)
+    int nLevels;      // levels built so far, level 0 included
+    uint8_t *levels[FLANDMARK_PYRAMID_LEVELS];
+    int width[FLANDMARK_PYRAMID_LEVELS], height[FLANDMARK_PYRAMID_LEVELS], step[FLANDMARK_PYRAMID_LEVELS];
+} FLANDMARK_ImagePyramid;
+
+// box sizes whose resampling tables a workspace keeps, see flandmark_get_normalized_image_frame
+#define FLANDMARK_RESAMPLER_CACHE 8
+
+// tables for the cubic or bilinear resampling of a box of width x height source pixels into the normalized frame
+// of bw[0] x bw[1] pixels
+typedef struct resampler_tables_struct {
+    int width, height;  // 0 while unused
+    int interpolation, taps;  // FLANDMARK_INTER_CUBIC (4 taps) or FLANDMARK_INTER_BILINEAR (2 taps)
+    int *xofs;  // per output column, the taps source columns it reads (clamped to the box)
+    int16_t *alpha;  // and their weights, in units of 1/2^11
+    int *srcRows, nRows;  // source rows read by the frame, each once
+    int *yofs;  // per output row, the taps of them it reads
+    float *beta;  // and their weights, in units of 1/2^11 of the horizontal pass
+} FLANDMARK_RESAMPLER_TABLES;
+
+// resampling into the normalized frame, see flandmark_get_normalized_image_frame
+typedef struct resampler_struct {
+    FLANDMARK_RESAMPLER_TABLES tables[FLANDMARK_RESAMPLER_CACHE];
+    int nTables, next;  // tables in use, and those replaced by the next box size that is not cached
+    int32_t *rows;  // horizontal pass of the source rows, output column by column
+} FLANDMARK_RESAMPLER;
+
+// scratch buffers of flandmark_detect_base and flandmark_argmax, carved from one arena sized from the model,
+// so that repeated detections do not allocate
+typedef struct workspace_struct {
+    char *arena;
+    FLANDMARK_LBP_PYRAMID pyr;
+    double **q;
+    double **scores;  // per component, messages received from its children
+    float **qf, **scoresf;  // same in float, single precision models only
+    int32_t **qi, **scoresi;  // same in fixed point, quantized models only
+    int **best;       // per edge, best child position for every parent position
+    int *indices;
+    double *dtScores, *dtBounds;  // distance transform of quadratic edges
+    int *dtBest, *dtSites;
+    int **windows, *nWindows;  // per component, windows searched by a coarse-to-fine step
+    FLANDMARK_CANDIDATE *candidates;  // root positions by decreasing bound, branch and bound only
+    unsigned long coarseRuns, coarseFallbacks;  // coarse-to-fine detections so far, and those that fell back
+    FLANDMARK_ThreadPool *pool;  // if set, independent steps of a detection run on it (not owned)
+    FLANDMARK_RESAMPLER resampler;
+} FLANDMARK_Workspace;
+
+// per-call state of the detection, so that one model can be shared by several threads
+typedef struct context_struct {
+    uint8_t *normalizedImageFrame;
+    double *bb;
+    float *sf;
+    FLANDMARK_Workspace *workspace;
+    int flags;
+    double threshold;  // faces scoring below are rejected, FLANDMARK_NO_THRESHOLD by default
+    double score;      // score of the last detection (see flandmark_detect_base), NAN if it failed
+    const int *mask;   // landmarks to locate, all if 0 (see flandmark_argmax)
+    FLANDMARK_ImagePyramid *pyramid;  // if set, octaves of the image that faces are normalized from (not owned)
+    int interpolation;  // of the normalized frame, FLANDMARK_INTER_CUBIC by default
+} FLANDMARK_Context;
 // -------------------------------------------------------------------------
 
 enum EError_T {
@@ -78,6 +236,7 @@ enum EError_T {
     ERROR_DATA_LBP=7,
     ERROR_DATA_OPTIONS_S=8,
     ERROR_DATA_OPTIONS_PSIG=9,
+    ERROR_DATA_OPTIONS_TREE=10,
     UNKNOWN_ERROR=100
 };
 
@@ -88,16 +247,33 @@ enum EError_T {
  *
  * Given the path to the file containing the model in binary form, this function will return a pointer to this model. It returns null pointer in the case of failure
  *
+ * With FLANDMARK_SINGLE_PRECISION, W and the deformation costs are also kept in float and flandmark_detect_base
+ * scores and maximizes in float. Positions whose scores differ less than the float rounding may then swap, so
+ * landmarks can move; they are required to stay within one pixel of the normalized frame of the double
+ * precision ones (test_single_precision in test.py)
+ *
+ * With FLANDMARK_QUANTIZED, the weights are read from filename + FLANDMARK_QUANTIZED_SUFFIX if that file exists
+ * and matches the model, and quantized by flandmark_quantize otherwise, and flandmark_detect_base scores and maximizes in int32 (same
+ * tolerance as above, test_quantized in test.py). It takes precedence over FLANDMARK_SINGLE_PRECISION
+ *
  * \param[in] filename
+ * \param[in] flags 0, FLANDMARK_SINGLE_PRECISION or FLANDMARK_QUANTIZED
  * \return Pointer to the FLANDMARK_Model data structure
  */
-FLANDMARK_Model * flandmark_init(const char* filename);
+FLANDMARK_Model * flandmark_init(const char* filename, int flags = 0);
 
 /**
  * Function flandmark_write model
  *
  * This function writes given FLANDMARK_model data structure to a file specified by its path.
  *
+ * Models whose tree is not the 8-point one end with a topology block: FLANDMARK_TOPOLOGY_TAG, nEdges, the
+ * [4 x nEdges] edges, nPsiGX, then ROWS and COLS of every extra table followed by its entries in the format of
+ * PsiGS0-2. Files without it, like the shipped model, or whose trailing data does not start with the tag, get
+ * the 8-point tree: 5 -> 1, 6 -> 2 with PsiGS1 and PsiGS2, then 1, 2, 3, 4, 7 -> 0 with the columns of PsiGS0.
+ * flandmark_precompute_edges rejects trees that do not span all components or whose edges are not ordered from
+ * the leaves to the root
+ *
  * \param[in] filename
  * \param[in] model
  */
@@ -123,6 +299,170 @@ EError_T flandmark_check_model(FLANDMARK_Model* model, FLANDMARK_Model* tst);
  */
 void flandmark_free(FLANDMARK_Model* model);
 
+/**
+ * Function flandmark_precompute_edges
+ *
+ * Tabulates the deformation costs of all edges of the tree from W and the PsiG displacements, so that the
+ * argmax is a pure max-plus over the tables, and recognizes the edges whose displacements are the quadratic
+ * (dx, dy, dx^2, dy^2) of a grid with concave weights. Called by flandmark_init; must be called again whenever
+ * W changes. Refreshes Wf and the float costs as well when the model has Wf, and the fixed point costs when the
+ * model is quantized. Also bounds the unary scores and the costs for the rejection threshold, and how far the
+ * rounding of single precision and fixed point scores may exceed these bounds
+ *
+ * \param[in, out] model
+ * \return int 0 on success, 1 when the model is inconsistent or memory runs out
+ */
+int flandmark_precompute_edges(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_free_edges
+ *
+ * \param[in, out] model
+ */
+void flandmark_free_edges(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_precompute_cells
+ *
+ * Lays out the cells of the windows of every component as offsets into the code maps of the frame, in the order
+ * of their 256-entry tables in W, for flandmark_get_q_pyr. Called by flandmark_init; depends only on the window
+ * sizes and the frame size
+ *
+ * \param[in, out] model
+ * \return int 0 on success, 1 when memory runs out or the cells of a window do not match its pyramid dimension
+ */
+int flandmark_precompute_cells(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_free_cells
+ *
+ * \param[in, out] model
+ */
+void flandmark_free_cells(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_quantize
+ *
+ * Rounds the appearance weights of W to int16 with the finest power of two scale of every component, and picks
+ * the unit of the int32 scores so that no score of the tree overflows. The double W is kept, it is not read
+ * while detecting. Calls flandmark_precompute_edges, which rounds the deformation costs to that unit
+ *
+ * \param[in, out] model
+ * \return int 0 on success, 1 when memory runs out or the scores cannot fit in int32
+ */
+int flandmark_quantize(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_write_quantized
+ *
+ * Writes the quantized weights of model, usually to the model file name + FLANDMARK_QUANTIZED_SUFFIX: the ints
+ * FLANDMARK_QUANTIZED_TAG, W_ROWS, M and scale, then the M ints of shift and the W_ROWS int16 of W, all in
+ * native byte order
+ *
+ * \param[in] filename
+ * \param[in] model quantized model
+ * \return int 0 on success, 1 when the model is not quantized or the file cannot be written
+ */
+int flandmark_write_quantized(const char* filename, const FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_read_quantized
+ *
+ * Replaces the quantized weights of model by the ones written by flandmark_write_quantized for the same model
+ * and calls flandmark_precompute_edges
+ *
+ * \param[in] filename
+ * \param[in, out] model
+ * \return int 0 on success, 1 when the file cannot be read or does not match the model
+ */
+int flandmark_read_quantized(const char* filename, FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_free_quantized
+ *
+ * \param[in, out] model
+ */
+void flandmark_free_quantized(FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_context_create
+ *
+ * Allocates the per-call buffers (normalized image frame, bounding box, scale factors) for the given model.
+ * A context must not be used by two threads at the same time, a model can. It returns null pointer in the
+ * case of failure
+ *
+ * \param[in] model
+ * \return Pointer to the FLANDMARK_Context data structure
+ */
+FLANDMARK_Context * flandmark_context_create(const FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_context_free
+ *
+ * \param[in] context
+ */
+void flandmark_context_free(FLANDMARK_Context* context);
+
+/**
+ * Function flandmark_workspace_create
+ *
+ * Allocates the scratch buffers of one detection with the given model. It returns null pointer in the case of failure
+ *
+ * \param[in] model
+ * \return Pointer to the FLANDMARK_Workspace data structure
+ */
+FLANDMARK_Workspace * flandmark_workspace_create(const FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_workspace_free
+ *
+ * \param[in] workspace
+ */
+void flandmark_workspace_free(FLANDMARK_Workspace* workspace);
+
+/**
+ * Function flandmark_thread_pool_create
+ *
+ * Starts nThreads worker threads. Once workspace->pool is set to the pool, flandmark_detect_base scores the
+ * components on it, and flandmark_argmax solves the branches of the root and then the root positions on it,
+ * except with FLANDMARK_DISTANCE_TRANSFORM. The thread of the detection works too, and results do not change.
+ * One pool may serve any number of workspaces at the same time. It returns null pointer in the case of failure
+ *
+ * \param[in] nThreads
+ * \return Pointer to the FLANDMARK_ThreadPool
+ */
+FLANDMARK_ThreadPool * flandmark_thread_pool_create(int nThreads);
+
+/**
+ * Function flandmark_thread_pool_free
+ *
+ * Stops the threads once their tasks are done
+ *
+ * \param[in] pool
+ */
+void flandmark_thread_pool_free(FLANDMARK_ThreadPool* pool);
+
+/**
+ * Function flandmark_thread_pool_size
+ *
+ * \param[in] pool
+ * \return int number of worker threads, 0 without pool
+ */
+int flandmark_thread_pool_size(const FLANDMARK_ThreadPool* pool);
+
+/**
+ * Function flandmark_thread_pool_run
+ *
+ * Runs task(arg, index) for all index < nTasks on the pool and the calling thread, and returns once all are
+ * done; without pool, on the calling thread only
+ *
+ * \param[in] pool
+ * \param[in] nTasks
+ * \param[in] task
+ * \param[in] arg
+ */
+void flandmark_thread_pool_run(FLANDMARK_ThreadPool* pool, int nTasks, void (*task)(void* arg, int index), void* arg);
+
 // getPsiMat (calls LBP features computation - liblbpfeatures from LIBOCAS)
 /**
  *
@@ -141,6 +481,68 @@ void flandmark_get_psi_mat(FLANDMARK_PSI* Psi, FLANDMARK_Model* model, int lbpid
  */
 void flandmark_get_psi_mat_sparse(FLANDMARK_PSI_SPARSE* Psi, FLANDMARK_Model* model, int lbpidx);
 
+/**
+ * Computes the LBP codes of all pyramid levels for the whole normalized image frame, so that the
+ * features of every window can be looked up instead of recomputed (see flandmark_get_psi_mat_sparse_pyr)
+ *
+ * \param[out] pyr
+ * \param[in] face_img
+ * \param[in] model
+ */
+void flandmark_get_lbp_pyramid(FLANDMARK_LBP_PYRAMID* pyr, const uint8_t* face_img, const FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_lbp_pyramid_levels
+ *
+ * Number of pyramid levels needed by the windows of all components of the model
+ *
+ * \param[in] model
+ * \return int
+ */
+int flandmark_lbp_pyramid_levels(const FLANDMARK_Model* model);
+
+/**
+ * Function flandmark_free_lbp_pyramid
+ *
+ * \param[in] pyr
+ */
+void flandmark_free_lbp_pyramid(FLANDMARK_LBP_PYRAMID* pyr);
+
+/**
+ * Same as flandmark_get_psi_mat_sparse, but reads the LBP codes from a precomputed pyramid
+ *
+ * \param[out] Psi
+ * \param[in] model
+ * \param[in] lbpidx
+ * \param[in] pyr
+ */
+void flandmark_get_psi_mat_sparse_pyr(FLANDMARK_PSI_SPARSE* Psi, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr);
+
+/**
+ * Computes the unary scores q[i] = <W_q, PSI_q(:,i)> of all windows of the component lbpidx directly
+ * from the LBP codes, without materializing the PSI matrix. The windows are accumulated cell by cell, a block
+ * of them at a time, so that the 256 weights of a cell stay in cache while all windows of the block look up
+ * their code in them; the sum of every window is taken in the order of the cells as before
+ *
+ * \param[out] q array of model->data.lbp[lbpidx].WINS_COLS scores
+ * \param[in] model
+ * \param[in] lbpidx
+ * \param[in] pyr
+ * \param[in] windows if given, only these nWindows windows are scored and the rest of q is left untouched
+ * \param[in] nWindows
+ */
+void flandmark_get_q_pyr(double* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows = 0, int nWindows = 0);
+
+/**
+ * Same as above in float, with model->Wf
+ */
+void flandmark_get_q_pyr(float* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows = 0, int nWindows = 0);
+
+/**
+ * Same as above in fixed point, with model->quant
+ */
+void flandmark_get_q_pyr(int32_t* q, const FLANDMARK_Model* model, int lbpidx, const FLANDMARK_LBP_PYRAMID* pyr, const int* windows = 0, int nWindows = 0);
+
 // dot product maximization with max-index return
 /**
  * Function maximizedotprod
@@ -154,9 +556,45 @@ void flandmark_maximize_gdotprod(double *maximum, double *idx, const double *fir
 /**
  * Function getNormalizedImageFrame
  *
+ * The bounding box is extended by bw_margin, or by model->data.options.bw_margin if it is not given, and the
+ * extended box is resampled (bicubic, as cvResize) straight from input into face_img, column by column; without
+ * a pyramid, no pixel outside of it is read and input is not modified, so several faces of one image may be
+ * normalized concurrently.
+ * The resampling tables are taken from workspace when one is given, which keeps those of the last
+ * FLANDMARK_RESAMPLER_CACHE box sizes.
+ *
+ * With a pyramid over input, the box is resampled from the coarsest octave on which it still spans the frame,
+ * building the octaves up to it if needed, so that the cubic kernel does not skip most pixels of large faces
+ * and the cost per face does not depend on its size. The frame is then smoothed by the box filters of the
+ * octaves and may differ slightly from the one resampled from input, for boxes of at least twice the frame
+ *
+ * interpolation may instead be FLANDMARK_INTER_BILINEAR, which reads 2 source rows and columns per frame pixel
+ * instead of 4, or FLANDMARK_INTER_AREA, which averages every pixel of the box (weighted by how much of it falls
+ * under the frame pixel) and ignores the pyramid. Like cvResize(CV_INTER_AREA), area resampling of a box smaller
+ * than the frame on either side reads 2 source rows and columns instead, weighted as cvResize does. The models
+ * are trained on cubic frames, so both modes move the landmarks somewhat (see the
+ * bob_ip_flandmark_interpolation.py script)
+ */
+int flandmark_get_normalized_image_frame(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, const FLANDMARK_Model *model, const int *bw_margin = 0, FLANDMARK_Workspace *workspace = 0, FLANDMARK_ImagePyramid *pyramid = 0, int interpolation = FLANDMARK_INTER_CUBIC);
+
+/**
+ * Function flandmark_image_pyramid_create
+ *
+ * Starts the octaves of image, to be shared by the detections of all faces of the image (see
+ * FLANDMARK_Context.pyramid). Only level 0, image itself, exists at first; image must outlive the pyramid and
+ * must not change while it is used. It returns null pointer if image is not 8-bit gray or memory runs out
+ *
+ * \param[in] image
+ * \return Pointer to the FLANDMARK_ImagePyramid data structure
+ */
+FLANDMARK_ImagePyramid * flandmark_image_pyramid_create(IplImage *image);
+
+/**
+ * Function flandmark_image_pyramid_free
  *
+ * \param[in] pyramid
  */
-int flandmark_get_normalized_image_frame(IplImage *input, const int bbox[], double *bb, uint8_t *face_img, FLANDMARK_Model *model);
+void flandmark_image_pyramid_free(FLANDMARK_ImagePyramid *pyramid);
 
 /**
  * Function imcrop
@@ -167,8 +605,34 @@ int flandmark_imcrop(IplImage *input, IplImage *output, const CvRect region);
 /**
  * Function argmax
  *
+ * Dynamic programming over model->edges: messages go from the leaves to the root, then the best positions
+ * are read back from the root
+ *
+ * \param[out] smax array of size [2 x options.M] with the positions of the landmarks
+ * \param[in] model
+ * \param[in] q unary scores of all positions of every component
+ * \param[in] workspace
+ * \param[in] flags FLANDMARK_DISTANCE_TRANSFORM computes quadratic edges in linear time instead of by brute force.
+ *   FLANDMARK_BRANCH_AND_BOUND bounds the score of every root position by the best score of each child plus
+ *   the largest cost of its edge there, visits the positions by decreasing bound and stops at the first one
+ *   that cannot beat the best so far; the result is the exhaustive one. It is ignored when the distance
+ *   transform solves an edge of the root
+ * \param[out] score if given, the score of the tree at smax
+ * \param[in] mask if given, array of size options.M, nonzero for the landmarks to locate; only the tree of these
+ *   landmarks, the ones on their paths to the root and the root is solved, and the others are NaN in smax.
+ *   The located landmarks are the optimum of that tree, which may differ from the ones of the whole model
  */
-void flandmark_argmax(double *smax, FLANDMARK_Options *options, const int *mapTable, FLANDMARK_PSI_SPARSE *Psi_sparse, double **q, double **g);
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, double **q, FLANDMARK_Workspace *workspace, int flags = 0, double *score = 0, const int *mask = 0);
+
+/**
+ * Same as above in float, with the costsf of the edges and the float buffers of workspace
+ */
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, float **q, FLANDMARK_Workspace *workspace, int flags = 0, double *score = 0, const int *mask = 0);
+
+/**
+ * Same as above in fixed point, with the costsi of the edges and the int32 buffers of workspace
+ */
+void flandmark_argmax(double *smax, const FLANDMARK_Model *model, int32_t **q, FLANDMARK_Workspace *workspace, int flags = 0, double *score = 0, const int *mask = 0);
 
 /**
  * Function flandmark_detect_base
@@ -178,16 +642,89 @@ void flandmark_argmax(double *smax, FLANDMARK_Options *options, const int *mapTa
  * \param[in] face_image pointer to 1D uint8 array with normalized image frame of face
  * \param[in] model Data structure holding info about model
  * \param[in, out] int array representing 2D array of size [2 x options.M] with estimated positions of landmarks
- * \return int indicator of success or fail of the detection
+ * \param[in] workspace scratch buffers for model, allocated for this call only if not given
+ * \param[in] flags see flandmark_argmax; with FLANDMARK_COARSE_TO_FINE, only every other position in x and y
+ *   is scored and maximized first, then all positions within two of the best coarse ones. When a landmark
+ *   ends on the rim of its neighbourhood the detection falls back to the exhaustive search, which is counted
+ *   in workspace->coarseFallbacks; otherwise the landmarks are usually, but not always, the exhaustive ones
+ * \param[in] threshold faces whose score is below are rejected; the unary scores are computed from the root
+ *   on, and the detection stops as soon as their maxima and the bounds of the others, widened by
+ *   model->boundMargin, show that the threshold cannot be reached
+ * \param[out] score if given, the score of the face, or the bound that rejected it
+ * \param[in] mask see flandmark_argmax; the components outside its tree are not scored at all
+ * \return int indicator of success or fail of the detection, FLANDMARK_REJECTED if the face was rejected, in
+ *   which case landmarks are not valid
+ *
+ * Runs in fixed point when model->quant is set, otherwise in float when model->Wf is set (see flandmark_init)
  */
-int flandmark_detect_base(uint8_t *face_image, FLANDMARK_Model *model, double *landmarks);
+int flandmark_detect_base(const uint8_t *face_image, const FLANDMARK_Model *model, double *landmarks, FLANDMARK_Workspace *workspace = 0, int flags = 0, double threshold = FLANDMARK_NO_THRESHOLD, double *score = 0, const int *mask = 0);
+
+/**
+ * Function flandmark_detect_base_batch
+ *
+ * Same as flandmark_detect_base for nFaces normalized image frames at once. Faces are processed in groups of
+ * FLANDMARK_BATCH_LANES with one face per SIMD lane, so that LBP extraction, scoring and the argmax run across
+ * faces. Results are identical to calling flandmark_detect_base without flags, threshold or mask on every face
+ * of a double precision model; single precision and quantized models are scored in double here.
+ *
+ * \param[in] face_images array of nFaces pointers to normalized image frames
+ * \param[in] nFaces
+ * \param[in] model Data structure holding info about model
+ * \param[out] landmarks nFaces consecutive arrays of size [2 x options.M]
+ * \return int indicator of success or fail of the detection, 1 if there is not enough memory
+ */
+int flandmark_detect_base_batch(uint8_t * const *face_images, int nFaces, const FLANDMARK_Model *model, double *landmarks);
 
 /**
  * Function flandmark_detect
  *
- * Estimates positions of facial landmarks given the image and the bounding box of the detected face
+ * Estimates positions of facial landmarks given the image and the bounding box of the detected face.
+ * The normalized image frame, bb and sf of the detection are left in the model, which makes this function
+ * not safe to call concurrently on one model (see flandmark_detect_ctx)
  *
+ * \param[out] score if given, the score of the detection (see flandmark_detect_base), or NAN when it fails with
+ *   neither NO_ERR nor FLANDMARK_REJECTED
+ */
+int flandmark_detect(IplImage *img, int * bbox, FLANDMARK_Model *model, double *landmarks, int * bw_margin = 0, double *score = 0);
+
+/**
+ * Function flandmark_detect_ctx
+ *
+ * Same as flandmark_detect, but all per-call state goes to context and the model is only read, so any number
+ * of threads may detect with one model at the same time, each with its own context. context->flags,
+ * context->threshold and context->score are those of flandmark_detect_base; context->pyramid, if set, must
+ * have been created over img, and context->interpolation is that of flandmark_get_normalized_image_frame. With
+ * context->workspace, the LBP codes are computed column by column while the frame is resampled instead of in a
+ * pass of their own over it
+ *
+ * \param[in] img
+ * \param[in] bbox bounding box of the face [x1, y1, x2, y2]
+ * \param[in] model
+ * \param[in, out] context created by flandmark_context_create for this model
+ * \param[out] landmarks array of size [2 x options.M]
+ * \param[in] bw_margin overrides model->data.options.bw_margin for this call only
+ * \return int indicator of success or fail of the detection, FLANDMARK_REJECTED below context->threshold
+ */
+int flandmark_detect_ctx(IplImage *img, int * bbox, const FLANDMARK_Model *model, FLANDMARK_Context *context, double *landmarks, int * bw_margin = 0);
+
+/**
+ * Function flandmark_detect_batch_ctx
+ *
+ * Same as flandmark_detect_ctx for nFaces bounding boxes of one image. When the detection is the default one
+ * (no context->flags, threshold or mask, double precision model), the faces are normalized one after the
+ * other and detected together by flandmark_detect_base_batch, with the same landmarks; otherwise, or for a
+ * single face, every face goes through flandmark_detect_ctx. context->score is not set by the batch, and
+ * context->workspace->pool is not used by it
+ *
+ * \param[in] img
+ * \param[in] nFaces
+ * \param[in] bbox nFaces consecutive bounding boxes [x1, y1, x2, y2]
+ * \param[in] model
+ * \param[in, out] context created by flandmark_context_create for this model
+ * \param[out] landmarks nFaces consecutive arrays of size [2 x options.M]
+ * \param[out] results for every face, what flandmark_detect_ctx would return
+ * \return int 0, or 1 if there is not enough memory for the batch, in which case results are not valid
  */
-int flandmark_detect(IplImage *img, int * bbox, FLANDMARK_Model *model, double *landmarks, int * bw_margin = 0);
+int flandmark_detect_batch_ctx(IplImage *img, int nFaces, const int *bbox, const FLANDMARK_Model *model, FLANDMARK_Context *context, double *landmarks, int *results);
 
 #endif // __LIBFLD_DETECTOR_H_
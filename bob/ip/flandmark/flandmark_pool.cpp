@@ -0,0 +1,140 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Thread pool for the independent steps of a detection.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "flandmark_detector.h"
+
+// Small pool of worker threads for the independent steps of one detection. A job is a number of tasks
+// that the workers and the thread running the job take one at a time; several jobs, from several threads,
+// may be queued at once.
+
+struct flandmark_job
+{
+	void (*task)(void *arg, int index);
+	void * arg;
+	int nTasks, next, done;
+};
+
+struct thread_pool_struct
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable work, finished;
+	std::deque<flandmark_job*> jobs;
+	bool stop;
+};
+
+// takes the next task of job, the mutex held; the job leaves the queue with its last task
+static int flandmark_job_take(FLANDMARK_ThreadPool *pool, flandmark_job *job)
+{
+	int index = job->next++;
+	if (job->next == job->nTasks)
+	{
+		pool->jobs.erase(std::find(pool->jobs.begin(), pool->jobs.end(), job));
+	}
+	return index;
+}
+
+// runs a task of job, the mutex held
+static void flandmark_job_run(FLANDMARK_ThreadPool *pool, flandmark_job *job, std::unique_lock<std::mutex>& lock)
+{
+	int index = flandmark_job_take(pool, job);
+	lock.unlock();
+	job->task(job->arg, index);
+	lock.lock();
+	if (++job->done == job->nTasks)
+	{
+		pool->finished.notify_all();
+	}
+}
+
+static void flandmark_thread_pool_worker(FLANDMARK_ThreadPool *pool)
+{
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	for (;;)
+	{
+		pool->work.wait(lock, [pool] { return pool->stop || !pool->jobs.empty(); });
+		if (pool->stop)
+		{
+			return;
+		}
+		flandmark_job_run(pool, pool->jobs.front(), lock);
+	}
+}
+
+FLANDMARK_ThreadPool * flandmark_thread_pool_create(int nThreads)
+{
+	FLANDMARK_ThreadPool * pool = new FLANDMARK_ThreadPool();
+	pool->stop = false;
+	try
+	{
+		for (int t = 0; t < nThreads; ++t)
+		{
+			pool->threads.push_back(std::thread(flandmark_thread_pool_worker, pool));
+		}
+	} catch (const std::system_error&) {
+		flandmark_thread_pool_free(pool);
+		return 0;
+	}
+	return pool;
+}
+
+void flandmark_thread_pool_free(FLANDMARK_ThreadPool *pool)
+{
+	if (!pool)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->stop = true;
+	}
+	pool->work.notify_all();
+	for (size_t t = 0; t < pool->threads.size(); ++t)
+	{
+		pool->threads[t].join();
+	}
+	delete pool;
+}
+
+int flandmark_thread_pool_size(const FLANDMARK_ThreadPool *pool)
+{
+	return pool ? (int)pool->threads.size() : 0;
+}
+
+void flandmark_thread_pool_run(FLANDMARK_ThreadPool *pool, int nTasks, void (*task)(void *arg, int index), void *arg)
+{
+	if (!pool || pool->threads.empty() || nTasks <= 1)
+	{
+		for (int index = 0; index < nTasks; ++index)
+		{
+			task(arg, index);
+		}
+		return;
+	}
+
+	flandmark_job job = {task, arg, nTasks, 0, 0};
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->jobs.push_back(&job);
+	pool->work.notify_all();
+
+	// the calling thread works on its own job too
+	while (job.next < job.nTasks)
+	{
+		flandmark_job_run(pool, &job, lock);
+	}
+	pool->finished.wait(lock, [&job] { return job.done == job.nTasks; });
+}
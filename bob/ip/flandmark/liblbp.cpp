@@ -9,295 +9,306 @@
  */
 
 #include "liblbp.h"
+#include "liblbp_engine.h"
+
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LIBLBP_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
 
 /*-----------------------------------------------------------------------
+  Vectorized LBP pyramid.
+
+  The pyramid is rebuilt on a uint16 copy of the window, which is exact as
+  long as at most LIBLBP_U16_MAX_LEVELS-1 reductions are needed (each 2x2
+  reduction multiplies the range by 4, 255*4^4 < 2^16). The codes of all
+  levels are produced in the same order as the scalar loops, so every
+  consumer below sees exactly the same sequence of patterns. Kernels are
+  chosen at runtime (SSE4.1, AVX2) and the scalar loops are kept for other
+  CPUs and for windows that do not fit.
   -----------------------------------------------------------------------*/
-void liblbp_pyr_features_sparse(t_index* vec, uint32_t vec_nDim, uint32_t* img, uint16_t img_nRows, uint16_t img_nCols)
+#define LIBLBP_U16_MAX_LEVELS 5
+
+#ifdef LIBLBP_X86_DISPATCH
+
+/* bits of the 8-neighbour pattern, see the scalar loops below */
+#define LIBLBP_SIMD_PATTERN(LT, TOP_L, TOP_C, TOP_R, MID_L, MID_R, BOT_L, BOT_C, BOT_R, CENTER, OR, AND) \
+  OR(OR(OR(AND(LT(TOP_L, CENTER), 0x01), AND(LT(TOP_C, CENTER), 0x02)), \
+        OR(AND(LT(TOP_R, CENTER), 0x04), AND(LT(MID_L, CENTER), 0x08))), \
+     OR(OR(AND(LT(MID_R, CENTER), 0x10), AND(LT(BOT_L, CENTER), 0x20)), \
+        OR(AND(LT(BOT_C, CENTER), 0x40), AND(LT(BOT_R, CENTER), 0x80))))
+
+static inline uint8_t liblbp_pattern_u16(const uint16_t *img, uint32_t stride, uint32_t y, uint32_t x)
 {
-    uint32_t offset, ww, hh, x, y, center, j, idx;
-    uint8_t pattern;
-
-    idx = 0;
-    offset = 0;
-    ww = img_nCols;
-    hh = img_nRows;
-    while(1)
-    {
-        for(x = 1; x < ww-1; x++)
-        {
-            for(y = 1; y< hh-1; y++)
-            {
-                pattern = 0;
-                center = img[LIBLBP_INDEX(y,x,img_nRows)];
-                if(img[LIBLBP_INDEX(y-1,x-1,img_nRows)] < center) pattern = pattern | 0x01;
-                if(img[LIBLBP_INDEX(y-1,x,img_nRows)] < center)   pattern = pattern | 0x02;
-                if(img[LIBLBP_INDEX(y-1,x+1,img_nRows)] < center) pattern = pattern | 0x04;
-                if(img[LIBLBP_INDEX(y,x-1,img_nRows)] < center)   pattern = pattern | 0x08;
-                if(img[LIBLBP_INDEX(y,x+1,img_nRows)] < center)   pattern = pattern | 0x10;
-                if(img[LIBLBP_INDEX(y+1,x-1,img_nRows)] < center) pattern = pattern | 0x20;
-                if(img[LIBLBP_INDEX(y+1,x,img_nRows)] < center)   pattern = pattern | 0x40;
-                if(img[LIBLBP_INDEX(y+1,x+1,img_nRows)] < center) pattern = pattern | 0x80;
-
-                //vec[offset+pattern]++;
-                vec[idx++] = offset+pattern;
-                offset += 256;
-            }
-        }
-        if(vec_nDim <= idx)
-          return;
-
-        if(ww % 2 == 1) ww--;
-        if(hh % 2 == 1) hh--;
-
-        ww = ww/2;
-        
-        for(x=0; x < ww; x++)
-          for(j=0; j < hh; j++)
-            img[LIBLBP_INDEX(j,x,img_nRows)] = img[LIBLBP_INDEX(j,2*x,img_nRows)] + 
-              img[LIBLBP_INDEX(j,2*x+1,img_nRows)];
-
-        hh = hh/2;
-        
-        for(y=0; y < hh; y++)
-          for(j=0; j < ww; j++)
-            img[LIBLBP_INDEX(y,j,img_nRows)] = img[LIBLBP_INDEX(2*y,j,img_nRows)] + 
-              img[LIBLBP_INDEX(2*y+1,j,img_nRows)];
-    }
+  const uint16_t *l = img + (x-1)*stride, *c = img + x*stride, *r = img + (x+1)*stride;
+  uint16_t center = c[y];
+  uint8_t pattern = 0;
+  if(l[y-1] < center) pattern = pattern | 0x01;
+  if(c[y-1] < center) pattern = pattern | 0x02;
+  if(r[y-1] < center) pattern = pattern | 0x04;
+  if(l[y] < center)   pattern = pattern | 0x08;
+  if(r[y] < center)   pattern = pattern | 0x10;
+  if(l[y+1] < center) pattern = pattern | 0x20;
+  if(c[y+1] < center) pattern = pattern | 0x40;
+  if(r[y+1] < center) pattern = pattern | 0x80;
+  return pattern;
+}
+
+/* a < b on unsigned 16-bit lanes, returned as (a >= b) to be used with andnot */
+#define LIBLBP_SSE_GE(A, B) _mm_cmpeq_epi16(_mm_max_epu16((A), (B)), (A))
+#define LIBLBP_SSE_BIT(GE, BIT) _mm_andnot_si128((GE), _mm_set1_epi16(BIT))
+#define LIBLBP_SSE_OR(A, B) _mm_or_si128((A), (B))
+
+/* 8 patterns of column x, rows y..y+7 */
+__attribute__((target("sse4.1")))
+static inline __m128i liblbp_column8_sse41(const uint16_t *img, uint32_t stride, uint32_t y, uint32_t x)
+{
+  const uint16_t *l = img + (x-1)*stride + y, *c = img + x*stride + y, *r = img + (x+1)*stride + y;
+  __m128i center = _mm_loadu_si128((const __m128i*)c);
+  return LIBLBP_SIMD_PATTERN(LIBLBP_SSE_GE,
+      _mm_loadu_si128((const __m128i*)(l-1)), _mm_loadu_si128((const __m128i*)(c-1)), _mm_loadu_si128((const __m128i*)(r-1)),
+      _mm_loadu_si128((const __m128i*)l), _mm_loadu_si128((const __m128i*)r),
+      _mm_loadu_si128((const __m128i*)(l+1)), _mm_loadu_si128((const __m128i*)(c+1)), _mm_loadu_si128((const __m128i*)(r+1)),
+      center, LIBLBP_SSE_OR, LIBLBP_SSE_BIT);
+}
+
+__attribute__((target("sse4.1")))
+static void liblbp_column_codes_sse41(uint8_t *codes, const uint16_t *img, uint32_t stride, uint32_t x, uint32_t hh)
+{
+  uint32_t n = hh-2, y;
+  if(n < 8)
+  {
+    for(y = 1; y < hh-1; y++)
+      codes[y-1] = liblbp_pattern_u16(img, stride, y, x);
     return;
+  }
+  /* the last block overlaps the previous one instead of falling back to scalar code */
+  for(y = 1; ; y += 8)
+  {
+    if(y+7 > n) y = n-7;
+    _mm_storel_epi64((__m128i*)(codes+y-1), _mm_packus_epi16(liblbp_column8_sse41(img, stride, y, x), _mm_setzero_si128()));
+    if(y+7 == n) break;
+  }
 }
 
-/*-----------------------------------------------------------------------
-  -----------------------------------------------------------------------*/
-void liblbp_pyr_features(char *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols )
+__attribute__((target("sse4.1")))
+static void liblbp_level_codes_sse41(uint8_t *codes, const uint16_t *img, uint32_t stride, uint32_t ww, uint32_t hh)
+{
+  for(uint32_t x = 1; x < ww-1; x++, codes += hh-2)
+    liblbp_column_codes_sse41(codes, img, stride, x, hh);
+}
+
+#define LIBLBP_AVX_LOAD2(P, Q) _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(P))), _mm_loadu_si128((const __m128i*)(Q)), 1)
+#define LIBLBP_AVX_GE(A, B) _mm256_cmpeq_epi16(_mm256_max_epu16((A), (B)), (A))
+#define LIBLBP_AVX_BIT(GE, BIT) _mm256_andnot_si256((GE), _mm256_set1_epi16(BIT))
+#define LIBLBP_AVX_OR(A, B) _mm256_or_si256((A), (B))
+
+/* two columns at a time: columns x and x+1 go to the low and high lanes */
+__attribute__((target("avx2")))
+static void liblbp_level_codes_avx2(uint8_t *codes, const uint16_t *img, uint32_t stride, uint32_t ww, uint32_t hh)
 {
-  uint32_t offset, ww, hh, x, y,center,j ;
-  uint8_t pattern;
-
-  offset=0;
-/*  ww=win_W;*/
-/*  hh=win_H;*/
-  ww=img_nCols;
-  hh=img_nRows;
-  while(1)
+  uint32_t n = hh-2, x, y;
+  if(n < 8)
   {
-    for(x=1; x < ww-1; x++)
+    liblbp_level_codes_sse41(codes, img, stride, ww, hh);
+    return;
+  }
+  for(x = 1; x+1 < ww-1; x += 2, codes += 2*n)
+  {
+    const uint16_t *l = img + (x-1)*stride, *c = img + x*stride, *r = img + (x+1)*stride, *rr = img + (x+2)*stride;
+    for(y = 1; ; y += 8)
     {
-      for(y=1; y< hh-1; y++)
-      {
-        pattern = 0;
-        center = img[LIBLBP_INDEX(y,x,img_nRows)];
-        if(img[LIBLBP_INDEX(y-1,x-1,img_nRows)] < center) pattern = pattern | 0x01;
-        if(img[LIBLBP_INDEX(y-1,x,img_nRows)] < center)   pattern = pattern | 0x02;
-        if(img[LIBLBP_INDEX(y-1,x+1,img_nRows)] < center) pattern = pattern | 0x04;
-        if(img[LIBLBP_INDEX(y,x-1,img_nRows)] < center)   pattern = pattern | 0x08;
-        if(img[LIBLBP_INDEX(y,x+1,img_nRows)] < center)   pattern = pattern | 0x10;
-        if(img[LIBLBP_INDEX(y+1,x-1,img_nRows)] < center) pattern = pattern | 0x20;
-        if(img[LIBLBP_INDEX(y+1,x,img_nRows)] < center)   pattern = pattern | 0x40;
-        if(img[LIBLBP_INDEX(y+1,x+1,img_nRows)] < center) pattern = pattern | 0x80;
-
-        vec[offset+pattern]++;
-        offset += 256; 
-
-      }
+      if(y+7 > n) y = n-7;
+      __m256i p = LIBLBP_SIMD_PATTERN(LIBLBP_AVX_GE,
+          LIBLBP_AVX_LOAD2(l+y-1, c+y-1), LIBLBP_AVX_LOAD2(c+y-1, r+y-1), LIBLBP_AVX_LOAD2(r+y-1, rr+y-1),
+          LIBLBP_AVX_LOAD2(l+y, c+y), LIBLBP_AVX_LOAD2(r+y, rr+y),
+          LIBLBP_AVX_LOAD2(l+y+1, c+y+1), LIBLBP_AVX_LOAD2(c+y+1, r+y+1), LIBLBP_AVX_LOAD2(r+y+1, rr+y+1),
+          LIBLBP_AVX_LOAD2(c+y, r+y), LIBLBP_AVX_OR, LIBLBP_AVX_BIT);
+      __m128i b = _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+      _mm_storel_epi64((__m128i*)(codes+y-1), b);
+      _mm_storel_epi64((__m128i*)(codes+n+y-1), _mm_unpackhi_epi64(b, b));
+      if(y+7 == n) break;
     }
-    if(vec_nDim <= offset) 
-      return;
+  }
+  if(x < ww-1)
+    liblbp_column_codes_sse41(codes, img, stride, x, hh);
+}
 
-    if(ww % 2 == 1) ww--;
-    if(hh % 2 == 1) hh--;
+/* one 2x2 reduction step in place, same order as the scalar loops */
+__attribute__((target("sse4.1")))
+static void liblbp_level_reduce_sse41(uint16_t *img, uint32_t stride, uint32_t *pww, uint32_t *phh)
+{
+  uint32_t ww = *pww, hh = *phh, x, j, y;
 
-    ww = ww/2;
-    for(x=0; x < ww; x++)
-      for(j=0; j < hh; j++)
-        img[LIBLBP_INDEX(j,x,img_nRows)] = img[LIBLBP_INDEX(j,2*x,img_nRows)] + 
-          img[LIBLBP_INDEX(j,2*x+1,img_nRows)];
+  if(ww % 2 == 1) ww--;
+  if(hh % 2 == 1) hh--;
 
-    hh = hh/2;
-    for(y=0; y < hh; y++)
-      for(j=0; j < ww; j++)
-        img[LIBLBP_INDEX(y,j,img_nRows)] = img[LIBLBP_INDEX(2*y,j,img_nRows)] + 
-          img[LIBLBP_INDEX(2*y+1,j,img_nRows)];
-    
+  ww = ww/2;
+  for(x = 0; x < ww; x++)
+  {
+    uint16_t *dst = img + x*stride;
+    const uint16_t *a = img + 2*x*stride, *b = img + (2*x+1)*stride;
+    for(j = 0; j+8 <= hh; j += 8)
+      _mm_storeu_si128((__m128i*)(dst+j), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(a+j)), _mm_loadu_si128((const __m128i*)(b+j))));
+    for(; j < hh; j++)
+      dst[j] = a[j] + b[j];
+  }
+
+  hh = hh/2;
+  for(j = 0; j < ww; j++)
+  {
+    uint16_t *col = img + j*stride;
+    for(y = 0; 2*y+16 <= 2*hh; y += 8)
+      _mm_storeu_si128((__m128i*)(col+y), _mm_hadd_epi16(_mm_loadu_si128((const __m128i*)(col+2*y)), _mm_loadu_si128((const __m128i*)(col+2*y+8))));
+    for(; y < hh; y++)
+      col[y] = col[2*y] + col[2*y+1];
   }
 
-  return;
+  *pww = ww;
+  *phh = hh;
 }
 
+typedef void (*liblbp_level_codes_fn)(uint8_t *codes, const uint16_t *img, uint32_t stride, uint32_t ww, uint32_t hh);
+
+static liblbp_level_codes_fn liblbp_select_level_codes(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return liblbp_level_codes_avx2;
+  if(__builtin_cpu_supports("sse4.1")) return liblbp_level_codes_sse41;
+  return 0;
+}
+
+#endif /* LIBLBP_X86_DISPATCH */
 
 /*-----------------------------------------------------------------------
+  Fills codes[0..nCodes-1] with the patterns of the pyramid in the order
+  the scalar loops visit them. Returns 0 (and touches nothing) when no
+  vector kernel is available or the window does not fit the uint16 path.
   -----------------------------------------------------------------------*/
-double liblbp_pyr_dotprod(double *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+static int liblbp_pyr_codes_simd(uint8_t *codes, uint32_t nCodes, const uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
 {
-  double dot_prod = 0;
-  uint32_t offset=0;
-  uint32_t ww, hh, center, x, y, j;
-  uint8_t pattern;
-  
-/*  ww=win_W;*/
-/*  hh=win_H;*/
-  ww=img_nCols;
-  hh=img_nRows;
-  while(1)
-  {
-    for(x=1; x < ww-1; x++)
-    {
-      for(y=1; y< hh-1; y++)
-      {
-        pattern = 0;
-        center = img[LIBLBP_INDEX(y,x,img_nRows)];
-        if(img[LIBLBP_INDEX(y-1,x-1,img_nRows)] < center) pattern = pattern | 0x01;
-        if(img[LIBLBP_INDEX(y-1,x,img_nRows)] < center)   pattern = pattern | 0x02;
-        if(img[LIBLBP_INDEX(y-1,x+1,img_nRows)] < center) pattern = pattern | 0x04;
-        if(img[LIBLBP_INDEX(y,x-1,img_nRows)] < center)   pattern = pattern | 0x08;
-        if(img[LIBLBP_INDEX(y,x+1,img_nRows)] < center)   pattern = pattern | 0x10;
-        if(img[LIBLBP_INDEX(y+1,x-1,img_nRows)] < center) pattern = pattern | 0x20;
-        if(img[LIBLBP_INDEX(y+1,x,img_nRows)] < center)   pattern = pattern | 0x40;
-        if(img[LIBLBP_INDEX(y+1,x+1,img_nRows)] < center) pattern = pattern | 0x80;
-
-        dot_prod += vec[offset+pattern];
-        offset += 256; 
-
-
-      }
-    }
-    if(vec_nDim <= offset) 
-      return(dot_prod);
+#ifdef LIBLBP_X86_DISPATCH
+  static const liblbp_level_codes_fn level_codes = liblbp_select_level_codes();
+  uint16_t buf[LIBLBP_SIMD_MAX_PIXELS];
+  uint32_t ww, hh, n, levels, i;
 
+  if(!level_codes || nCodes > LIBLBP_SIMD_MAX_CODES || (uint32_t)img_nRows*img_nCols > LIBLBP_SIMD_MAX_PIXELS)
+    return 0;
 
+  /* count the levels the scalar loops would visit */
+  for(ww = img_nCols, hh = img_nRows, n = 0, levels = 0; n < nCodes; levels++)
+  {
+    if(ww < 3 || hh < 3 || levels == LIBLBP_U16_MAX_LEVELS) return 0;
+    n += (ww-2)*(hh-2);
     if(ww % 2 == 1) ww--;
     if(hh % 2 == 1) hh--;
-
     ww = ww/2;
-    for(x=0; x < ww; x++)
-      for(j=0; j < hh; j++)
-        img[LIBLBP_INDEX(j,x,img_nRows)] = img[LIBLBP_INDEX(j,2*x,img_nRows)] + 
-                                          img[LIBLBP_INDEX(j,2*x+1,img_nRows)];
-
     hh = hh/2;
-    for(y=0; y < hh; y++)
-      for(j=0; j < ww; j++)
-        img[LIBLBP_INDEX(y,j,img_nRows)] = img[LIBLBP_INDEX(2*y,j,img_nRows)] + 
-                                           img[LIBLBP_INDEX(2*y+1,j,img_nRows)];    
   }
- 
-  
-}
 
+  for(i = 0; i < (uint32_t)img_nRows*img_nCols; i++)
+    buf[i] = (uint16_t)img[i];
 
-/*-----------------------------------------------------------------------
-  -----------------------------------------------------------------------*/
-void liblbp_pyr_addvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
-{
-  uint32_t offset, ww, hh, x, y, center,j ;
-  uint8_t pattern;
-
-  offset=0;
-/*  ww=win_W;*/
-/*  hh=win_H;*/
-  ww=img_nCols;
-  hh=img_nRows;
-  while(1)
+  ww = img_nCols;
+  hh = img_nRows;
+  for(n = 0; ; )
   {
-    for(x=1; x < ww-1; x++)
+    uint32_t count = (ww-2)*(hh-2);
+    if(n + count > nCodes)
     {
-      for(y=1; y< hh-1; y++)
-      {
-        pattern = 0;
-        center = img[LIBLBP_INDEX(y,x,img_nRows)];
-        if(img[LIBLBP_INDEX(y-1,x-1,img_nRows)] < center) pattern = pattern | 0x01;
-        if(img[LIBLBP_INDEX(y-1,x,img_nRows)] < center)   pattern = pattern | 0x02;
-        if(img[LIBLBP_INDEX(y-1,x+1,img_nRows)] < center) pattern = pattern | 0x04;
-        if(img[LIBLBP_INDEX(y,x-1,img_nRows)] < center)   pattern = pattern | 0x08;
-        if(img[LIBLBP_INDEX(y,x+1,img_nRows)] < center)   pattern = pattern | 0x10;
-        if(img[LIBLBP_INDEX(y+1,x-1,img_nRows)] < center) pattern = pattern | 0x20;
-        if(img[LIBLBP_INDEX(y+1,x,img_nRows)] < center)   pattern = pattern | 0x40;
-        if(img[LIBLBP_INDEX(y+1,x+1,img_nRows)] < center) pattern = pattern | 0x80;
-
-        vec[offset+pattern]++;
-        offset += 256; 
-
-      }
+      /* the scalar loops only stop at level boundaries, do not write past the caller's vector */
+      uint8_t last[LIBLBP_SIMD_MAX_PIXELS];
+      level_codes(last, buf, img_nRows, ww, hh);
+      memcpy(codes+n, last, nCodes-n);
+      return 1;
     }
-    if(vec_nDim <= offset) 
-      return;
+    level_codes(codes+n, buf, img_nRows, ww, hh);
+    n += count;
+    if(nCodes <= n)
+      return 1;
+    liblbp_level_reduce_sse41(buf, img_nRows, &ww, &hh);
+  }
+#else
+  (void)codes; (void)nCodes; (void)img; (void)img_nRows; (void)img_nCols;
+  return 0;
+#endif
+}
 
-    if(ww % 2 == 1) ww--;
-    if(hh % 2 == 1) hh--;
+/*-----------------------------------------------------------------------
+  Runs consumer over the pyramid of a window: from the vectorized codes
+  when possible, otherwise through the scalar engine (with fixed loop
+  bounds for the geometries listed in liblbp_engine.h).
+  -----------------------------------------------------------------------*/
+template <class Consumer>
+struct liblbp_window_body
+{
+  Consumer &consumer;
+  liblbp_window_source &src;
 
-    ww = ww/2;
-    for(x=0; x < ww; x++)
-      for(j=0; j < hh; j++)
-        img[LIBLBP_INDEX(j,x,img_nRows)] = img[LIBLBP_INDEX(j,2*x,img_nRows)] + 
-             img[LIBLBP_INDEX(j,2*x+1,img_nRows)];
+  template <class Geometry>
+  void operator()(const Geometry& geom) { liblbp_pyr_engine(geom, src, consumer); }
+};
 
-    hh = hh/2;
-    for(y=0; y < hh; y++)
-      for(j=0; j < ww; j++)
-        img[LIBLBP_INDEX(y,j,img_nRows)] = img[LIBLBP_INDEX(2*y,j,img_nRows)] + 
-          img[LIBLBP_INDEX(2*y+1,j,img_nRows)];
-    
+template <class Consumer>
+static void liblbp_pyr_run(Consumer& consumer, uint32_t nCells, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+{
+  uint32_t nLevels = liblbp_pyr_levels(img_nRows, img_nCols, nCells);
+  uint8_t codes[LIBLBP_SIMD_MAX_CODES];
+
+  if(liblbp_pyr_codes_simd(codes, nCells, img, img_nRows, img_nCols))
+  {
+    liblbp_codes_source src = {codes};
+    for(uint32_t cell = 0; cell < nCells; cell++)
+      consumer(cell, src.pattern(0, 0, 0));
+    return;
   }
 
-  return;
+  liblbp_window_source src = {img, img_nRows};
+  liblbp_window_body<Consumer> body = {consumer, src};
+  liblbp_geometry_dispatch(img_nRows, img_nCols, nLevels, body);
 }
 
-
-
 /*-----------------------------------------------------------------------
   -----------------------------------------------------------------------*/
-void liblbp_pyr_subvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+void liblbp_pyr_features_sparse(t_index* vec, uint32_t vec_nDim, uint32_t* img, uint16_t img_nRows, uint16_t img_nCols)
 {
-  uint32_t offset, ww, hh, x, y,center,j ;
-  uint8_t pattern;
-
-  offset=0;
-/*  ww=win_W;*/
-/*  hh=win_H;*/
-  ww=img_nCols;
-  hh=img_nRows;
-  while(1)
-  {
-    for(x=1; x < ww-1; x++)
-    {
-      for(y=1; y< hh-1; y++)
-      {
-        pattern = 0;
-        center = img[LIBLBP_INDEX(y,x,img_nRows)];
-        if(img[LIBLBP_INDEX(y-1,x-1,img_nRows)] < center) pattern = pattern | 0x01;
-        if(img[LIBLBP_INDEX(y-1,x,img_nRows)] < center)   pattern = pattern | 0x02;
-        if(img[LIBLBP_INDEX(y-1,x+1,img_nRows)] < center) pattern = pattern | 0x04;
-        if(img[LIBLBP_INDEX(y,x-1,img_nRows)] < center)   pattern = pattern | 0x08;
-        if(img[LIBLBP_INDEX(y,x+1,img_nRows)] < center)   pattern = pattern | 0x10;
-        if(img[LIBLBP_INDEX(y+1,x-1,img_nRows)] < center) pattern = pattern | 0x20;
-        if(img[LIBLBP_INDEX(y+1,x,img_nRows)] < center)   pattern = pattern | 0x40;
-        if(img[LIBLBP_INDEX(y+1,x+1,img_nRows)] < center) pattern = pattern | 0x80;
-
-        vec[offset+pattern]--;
-        offset += 256; 
-
-      }
-    }
-    if(vec_nDim <= offset) 
-      return;
+  liblbp_index_consumer consumer = {vec};
+  liblbp_pyr_run(consumer, vec_nDim, img, img_nRows, img_nCols);
+}
 
-    if(ww % 2 == 1) ww--;
-    if(hh % 2 == 1) hh--;
+/*-----------------------------------------------------------------------
+  -----------------------------------------------------------------------*/
+void liblbp_pyr_features(char *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols )
+{
+  liblbp_hist_consumer consumer = {vec};
+  liblbp_pyr_run(consumer, (vec_nDim+255)/256, img, img_nRows, img_nCols);
+}
 
-    ww = ww/2;
-    for(x=0; x < ww; x++)
-      for(j=0; j < hh; j++)
-        img[LIBLBP_INDEX(j,x,img_nRows)] = img[LIBLBP_INDEX(j,2*x,img_nRows)] + 
-          img[LIBLBP_INDEX(j,2*x+1,img_nRows)];
+/*-----------------------------------------------------------------------
+  -----------------------------------------------------------------------*/
+double liblbp_pyr_dotprod(double *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+{
+  liblbp_dotprod_consumer<> consumer = {vec, 0};
+  liblbp_pyr_run(consumer, (vec_nDim+255)/256, img, img_nRows, img_nCols);
+  return(consumer.dot_prod);
+}
 
-    hh = hh/2;
-    for(y=0; y < hh; y++)
-      for(j=0; j < ww; j++)
-        img[LIBLBP_INDEX(y,j,img_nRows)] = img[LIBLBP_INDEX(2*y,j,img_nRows)] + 
-          img[LIBLBP_INDEX(2*y+1,j,img_nRows)];
-    
-  }
+/*-----------------------------------------------------------------------
+  -----------------------------------------------------------------------*/
+void liblbp_pyr_addvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+{
+  liblbp_addvec_consumer<1> consumer = {vec};
+  liblbp_pyr_run(consumer, (vec_nDim+255)/256, img, img_nRows, img_nCols);
+}
 
-  return;
+/*-----------------------------------------------------------------------
+  -----------------------------------------------------------------------*/
+void liblbp_pyr_subvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols)
+{
+  liblbp_addvec_consumer<-1> consumer = {vec};
+  liblbp_pyr_run(consumer, (vec_nDim+255)/256, img, img_nRows, img_nCols);
 }
 
 
@@ -320,3 +331,12 @@ uint32_t liblbp_pyr_get_dim(uint16_t img_nRows, uint16_t img_nCols, uint16_t nPy
   return(256*N);
 }
 
+
+/*-----------------------------------------------------------------------
+  LBP codes of every pyramid level for a whole image, see
+  liblbp_pyr_codemaps_lanes in liblbp_engine.h.
+  -----------------------------------------------------------------------*/
+void liblbp_pyr_codemaps(uint8_t *codes, uint8_t *mirrored, uint32_t *sums, const uint8_t *img, uint16_t img_nRows, uint16_t img_nCols, uint16_t nLevels)
+{
+  liblbp_pyr_codemaps_lanes<1>(codes, mirrored, sums, &img, img_nRows, img_nCols, nLevels);
+}
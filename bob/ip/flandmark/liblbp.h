@@ -16,6 +16,10 @@
 #define LIBLBP_INDEX(ROW,COL,NUM_ROWS) ((COL)*(NUM_ROWS)+(ROW))
 #define LIBLBP_MIN(A,B) ((A) > (B) ? (B) : (A))
 
+// largest window (in pixels) and feature vector (in LBP cells) handled by the vectorized kernels
+#define LIBLBP_SIMD_MAX_PIXELS 4096
+#define LIBLBP_SIMD_MAX_CODES 4096
+
 //typedef long unsigned int t_index;
 typedef uint32_t t_index;
 
@@ -24,6 +28,7 @@ extern void liblbp_pyr_features(char *vec, uint32_t vec_nDim, uint32_t *img, uin
 extern double liblbp_pyr_dotprod(double *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols);
 extern void liblbp_pyr_addvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols);
 extern void liblbp_pyr_subvec(int64_t *vec, uint32_t vec_nDim, uint32_t *img, uint16_t img_nRows, uint16_t img_nCols);
+extern void liblbp_pyr_codemaps(uint8_t *codes, uint8_t *mirrored, uint32_t *sums, const uint8_t *img, uint16_t img_nRows, uint16_t img_nCols, uint16_t nLevels);
 extern uint32_t liblbp_pyr_get_dim(uint16_t img_nRows, uint16_t img_nCols, uint16_t nPyramids);
 
 #endif
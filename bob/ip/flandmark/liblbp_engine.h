@@ -0,0 +1,399 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Written (W) 2012 Vojtech Franc, Michal Uricar
+ * Copyright (C) 2012 Vojtech Franc, Michal Uricar
+ */
+
+#ifndef _liblbp_engine_h
+#define _liblbp_engine_h
+
+#include "liblbp.h"
+
+#include <string.h>
+
+/*-----------------------------------------------------------------------
+  LBP pyramid engine.
+
+  liblbp_pyr_engine walks the cells of an LBP pyramid in the order of
+  liblbp_pyr_features_sparse and hands every (cell, pattern) pair to a
+  consumer. It is parameterized on
+
+    Geometry  window height, width and number of levels, either fixed at
+              compile time (the loops unroll) or known at runtime,
+    Source    where the patterns come from (window pixels, a precomputed
+              code sequence or the code maps of a whole frame),
+    Consumer  what is done with each pattern (index, histogram, dot
+              product, add, subtract).
+  -----------------------------------------------------------------------*/
+
+#define LIBLBP_MAX_LEVELS 16
+
+// windows with fixed loop bounds: (rows, cols, levels), levels as counted by liblbp_pyr_levels; those of the
+// components of the shipped flandmark_model.dat (0, 1-2, 3-4, 5-6 and 7), other models use the dynamic geometry
+#define LIBLBP_FIXED_GEOMETRIES(X) \
+  X(13, 13, 3) \
+  X(11, 11, 2) \
+  X(12, 10, 2) \
+  X( 9, 13, 2) \
+  X(10, 10, 2)
+
+template <uint32_t H, uint32_t W, uint32_t LEVELS>
+struct liblbp_fixed_geometry
+{
+  static constexpr uint32_t levels() { return LEVELS; }
+  static constexpr uint32_t rows(uint32_t level) { return level == 0 ? H : rows(level-1)/2; }
+  static constexpr uint32_t cols(uint32_t level) { return level == 0 ? W : cols(level-1)/2; }
+};
+
+struct liblbp_dynamic_geometry
+{
+  uint32_t nLevels, nRows[LIBLBP_MAX_LEVELS], nCols[LIBLBP_MAX_LEVELS];
+
+  liblbp_dynamic_geometry(uint32_t img_nRows, uint32_t img_nCols, uint32_t levels)
+    : nLevels(LIBLBP_MIN(levels, LIBLBP_MAX_LEVELS))
+  {
+    for(uint32_t level = 0; level < nLevels; level++, img_nRows /= 2, img_nCols /= 2)
+    {
+      nRows[level] = img_nRows;
+      nCols[level] = img_nCols;
+    }
+  }
+
+  uint32_t levels() const { return nLevels; }
+  uint32_t rows(uint32_t level) const { return nRows[level]; }
+  uint32_t cols(uint32_t level) const { return nCols[level]; }
+};
+
+// number of levels the scalar loops visit before vec_nDim/256 cells are emitted
+inline uint32_t liblbp_pyr_levels(uint32_t img_nRows, uint32_t img_nCols, uint32_t nCells)
+{
+  uint32_t levels, n;
+  for(levels = 0, n = 0; n < nCells && LIBLBP_MIN(img_nRows, img_nCols) >= 3; levels++)
+  {
+    n += (img_nRows-2)*(img_nCols-2);
+    img_nRows /= 2;
+    img_nCols /= 2;
+  }
+  return levels;
+}
+
+/*-----------------------------------------------------------------------
+  LBP codes of every pyramid level for whole images.
+
+  Plane L of codes holds, at (y,x), the pattern of the 2^L x 2^L block
+  with top-left corner (y,x) against its 8 neighbouring blocks, i.e. the
+  code liblbp_pyr_features_sparse computes for level L of any window whose
+  block grid passes through (y,x). Plane L of mirrored holds the same code
+  with left and right neighbours swapped, as seen from a window copied in
+  reverse column order. Positions too close to the border are zero.
+
+  LANES images of the same size are processed side by side: every pixel,
+  block sum and code is stored as LANES consecutive values, one per image,
+  so that the inner loops run across images. sums is scratch space of
+  img_nRows*img_nCols*LANES elements.
+  -----------------------------------------------------------------------*/
+inline uint8_t liblbp_mirror_pattern(uint8_t pattern)
+{
+  return (pattern & 0x42) | ((pattern & 0x01) << 2) | ((pattern & 0x04) >> 2)
+    | ((pattern & 0x08) << 1) | ((pattern & 0x10) >> 1)
+    | ((pattern & 0x20) << 2) | ((pattern & 0x80) >> 2);
+}
+
+template <int LANES>
+void liblbp_pyr_codemaps_lanes(uint8_t *codes, uint8_t *mirrored, uint32_t *sums, const uint8_t * const *img, uint16_t img_nRows, uint16_t img_nCols, uint16_t nLevels)
+{
+  const uint32_t size = (uint32_t)img_nRows*img_nCols;
+  uint32_t level, s, h, x, y, i;
+  int l;
+
+  for(i=0; i < size; i++)
+    for(l=0; l < LANES; l++)
+      sums[i*LANES+l] = img[l][i];
+  memset(codes, 0, nLevels*size*LANES);
+  memset(mirrored, 0, nLevels*size*LANES);
+
+#define LIBLBP_LANES(ROW,COL) (LIBLBP_INDEX(ROW,COL,img_nRows)*LANES)
+  for(level=0, s=1; level < nLevels; level++, s*=2)
+  {
+    if(level > 0)
+    {
+      /* block sums of size s from the ones of size s/2, in place (reads are always ahead) */
+      h = s/2;
+      for(x=0; x+s <= img_nCols; x++)
+        for(y=0; y+s <= img_nRows; y++)
+        {
+          uint32_t *dst = sums + LIBLBP_LANES(y,x);
+          const uint32_t *b = sums + LIBLBP_LANES(y+h,x), *r = sums + LIBLBP_LANES(y,x+h), *br = sums + LIBLBP_LANES(y+h,x+h);
+          for(l=0; l < LANES; l++)
+            dst[l] = dst[l] + b[l] + r[l] + br[l];
+        }
+    }
+
+    uint8_t *plane = codes + level*size*LANES;
+    uint8_t *mplane = mirrored + level*size*LANES;
+    for(x=s; x+2*s <= img_nCols; x++)
+    {
+      for(y=s; y+2*s <= img_nRows; y++)
+      {
+        const uint32_t *c = sums + LIBLBP_LANES(y,x);
+        const uint32_t *n0 = sums + LIBLBP_LANES(y-s,x-s), *n1 = sums + LIBLBP_LANES(y-s,x), *n2 = sums + LIBLBP_LANES(y-s,x+s);
+        const uint32_t *n3 = sums + LIBLBP_LANES(y,x-s), *n4 = sums + LIBLBP_LANES(y,x+s);
+        const uint32_t *n5 = sums + LIBLBP_LANES(y+s,x-s), *n6 = sums + LIBLBP_LANES(y+s,x), *n7 = sums + LIBLBP_LANES(y+s,x+s);
+        uint8_t *p = plane + LIBLBP_LANES(y,x), *mp = mplane + LIBLBP_LANES(y,x);
+        for(l=0; l < LANES; l++)
+        {
+          uint32_t center = c[l];
+          uint8_t pattern = (uint8_t)((n0[l] < center) | ((n1[l] < center) << 1) | ((n2[l] < center) << 2)
+            | ((n3[l] < center) << 3) | ((n4[l] < center) << 4)
+            | ((n5[l] < center) << 5) | ((n6[l] < center) << 6) | ((n7[l] < center) << 7));
+          p[l] = pattern;
+          mp[l] = liblbp_mirror_pattern(pattern);
+        }
+      }
+    }
+  }
+#undef LIBLBP_LANES
+}
+
+/*-----------------------------------------------------------------------
+  Same code maps as liblbp_pyr_codemaps, produced while the image is
+  written column by column.
+
+  After begin(), the caller fills column(x) with the pixels of column x
+  and calls push(x), for x = 0..img_nCols-1 in order. Every block sum and
+  code is computed as soon as the columns it depends on are there, so
+  they are read back while still in cache. sums holds one plane of
+  block sums per level: nLevels*img_nRows*img_nCols elements.
+  -----------------------------------------------------------------------*/
+struct liblbp_codemap_stream
+{
+  uint8_t *codes, *mirrored;
+  uint32_t *sums;
+  uint32_t nRows, nCols, nLevels;
+
+  void begin()
+  {
+    memset(codes, 0, nLevels*nRows*nCols);
+    memset(mirrored, 0, nLevels*nRows*nCols);
+  }
+
+  uint32_t *column(uint32_t x) { return sums + x*nRows; }
+
+  void push(uint32_t x)
+  {
+    const uint32_t size = nRows*nCols;
+    int32_t c = (int32_t)x;
+
+    for(uint32_t level = 0, s = 1; level < nLevels; level++, s *= 2)
+    {
+      uint32_t *plane = sums + level*size;
+      if(level > 0)
+      {
+        /* column c of the blocks of size s, now that column c+s/2 of size s/2 is there */
+        const uint32_t h = s/2;
+        c -= (int32_t)h;
+        if(c < 0)
+          return;
+        const uint32_t *prev = plane - size + c*nRows, *right = prev + h*nRows;
+        uint32_t *dst = plane + c*nRows;
+        for(uint32_t y = 0; y+s <= nRows; y++)
+          dst[y] = prev[y] + prev[y+h] + right[y] + right[y+h];
+      }
+
+      /* codes of column c-s, whose right neighbours are the blocks of column c */
+      const int32_t xc = c - (int32_t)s;
+      if(xc < (int32_t)s)
+        continue;
+      if(nRows >= 3*s)
+        encode(codes + level*size + xc*nRows, mirrored + level*size + xc*nRows,
+               plane + (xc-s)*nRows, plane + xc*nRows, plane + c*nRows, s, s, nRows-2*s+1);
+    }
+  }
+
+  /* codes of rows y0..y1-1 of a column from the block sums of its left, middle and right neighbours; the
+     patterns go through a local buffer, which the compiler knows does not alias the sums, so the loop
+     vectorizes */
+  static void encode(uint8_t *p, uint8_t *mp, const uint32_t *l, const uint32_t *m, const uint32_t *r, uint32_t s, uint32_t y0, uint32_t y1)
+  {
+    const uint32_t *lu = l - s, *mu = m - s, *ru = r - s, *ld = l + s, *md = m + s, *rd = r + s;
+    uint8_t pattern[64], mpattern[64];
+
+    for(uint32_t begin = y0; begin < y1; begin += 64)
+    {
+      const uint32_t end = LIBLBP_MIN(begin + 64, y1);
+      for(uint32_t y = begin; y < end; y++)
+      {
+        const uint32_t center = m[y];
+        const uint8_t code = (uint8_t)((lu[y] < center) | ((mu[y] < center) << 1) | ((ru[y] < center) << 2)
+          | ((l[y] < center) << 3) | ((r[y] < center) << 4)
+          | ((ld[y] < center) << 5) | ((md[y] < center) << 6) | ((rd[y] < center) << 7));
+        pattern[y-begin] = code;
+        mpattern[y-begin] = liblbp_mirror_pattern(code);
+      }
+      memcpy(p + begin, pattern, end-begin);
+      memcpy(mp + begin, mpattern, end-begin);
+    }
+  }
+};
+
+/*-----------------------------------------------------------------------
+  Sources
+  -----------------------------------------------------------------------*/
+
+// window pixels, reduced in place between levels (the historical behaviour)
+struct liblbp_window_source
+{
+  uint32_t *img;
+  uint32_t nRows;
+
+  uint8_t pattern(uint32_t, uint32_t y, uint32_t x) const
+  {
+    const uint32_t *l = img + (x-1)*nRows, *c = img + x*nRows, *r = img + (x+1)*nRows;
+    uint32_t center = c[y];
+    return (uint8_t)((l[y-1] < center) | ((c[y-1] < center) << 1) | ((r[y-1] < center) << 2)
+      | ((l[y] < center) << 3) | ((r[y] < center) << 4)
+      | ((l[y+1] < center) << 5) | ((c[y+1] < center) << 6) | ((r[y+1] < center) << 7));
+  }
+
+  void reduce(uint32_t ww, uint32_t hh)
+  {
+    uint32_t x, y, j;
+
+    if(ww % 2 == 1) ww--;
+    if(hh % 2 == 1) hh--;
+
+    ww = ww/2;
+    for(x=0; x < ww; x++)
+      for(j=0; j < hh; j++)
+        img[LIBLBP_INDEX(j,x,nRows)] = img[LIBLBP_INDEX(j,2*x,nRows)] + img[LIBLBP_INDEX(j,2*x+1,nRows)];
+
+    hh = hh/2;
+    for(y=0; y < hh; y++)
+      for(j=0; j < ww; j++)
+        img[LIBLBP_INDEX(y,j,nRows)] = img[LIBLBP_INDEX(2*y,j,nRows)] + img[LIBLBP_INDEX(2*y+1,j,nRows)];
+  }
+};
+
+// patterns already computed in cell order (e.g. by the vectorized kernels)
+struct liblbp_codes_source
+{
+  const uint8_t *codes;
+
+  uint8_t pattern(uint32_t, uint32_t, uint32_t) { return *codes++; }
+  void reduce(uint32_t, uint32_t) {}
+};
+
+/* code maps of a whole frame (see liblbp_pyr_codemaps), planes points at the
+   window corner; mirrored windows read the mirrored codes from the opposite side */
+template <bool MIRRORED>
+struct liblbp_codemap_source
+{
+  const uint8_t *planes;
+  uint32_t nRows, planeSize, winCols;
+
+  uint8_t pattern(uint32_t level, uint32_t y, uint32_t x) const
+  {
+    uint32_t s = 1u << level;
+    uint32_t col = MIRRORED ? winCols - s*(x+1) : s*x;
+    return planes[level*planeSize + col*nRows + s*y];
+  }
+  void reduce(uint32_t, uint32_t) {}
+};
+
+// same as liblbp_codemap_source over LANES interleaved images: patterns are pointers to LANES codes
+template <bool MIRRORED, int LANES>
+struct liblbp_codemap_lanes_source
+{
+  const uint8_t *planes;
+  uint32_t nRows, planeSize, winCols;
+
+  const uint8_t *pattern(uint32_t level, uint32_t y, uint32_t x) const
+  {
+    uint32_t s = 1u << level;
+    uint32_t col = MIRRORED ? winCols - s*(x+1) : s*x;
+    return planes + (level*planeSize + col*nRows + s*y)*LANES;
+  }
+  void reduce(uint32_t, uint32_t) {}
+};
+
+/*-----------------------------------------------------------------------
+  Consumers
+  -----------------------------------------------------------------------*/
+
+struct liblbp_index_consumer
+{
+  t_index *vec;
+  void operator()(uint32_t cell, uint8_t pattern) { vec[cell] = 256*cell + pattern; }
+};
+
+struct liblbp_hist_consumer
+{
+  char *vec;
+  void operator()(uint32_t cell, uint8_t pattern) { vec[256*cell + pattern]++; }
+};
+
+template <typename T = double, typename Acc = T>
+struct liblbp_dotprod_consumer
+{
+  const T *vec;
+  Acc dot_prod;
+  void operator()(uint32_t cell, uint8_t pattern) { dot_prod += vec[256*cell + pattern]; }
+};
+
+template <int LANES>
+struct liblbp_dotprod_lanes_consumer
+{
+  const double *vec;
+  double dot_prod[LANES];
+  void operator()(uint32_t cell, const uint8_t *pattern)
+  {
+    const double *v = vec + 256*cell;
+    for(int l = 0; l < LANES; l++)
+      dot_prod[l] += v[pattern[l]];
+  }
+};
+
+template <int DELTA>
+struct liblbp_addvec_consumer
+{
+  int64_t *vec;
+  void operator()(uint32_t cell, uint8_t pattern) { vec[256*cell + pattern] += DELTA; }
+};
+
+/*-----------------------------------------------------------------------
+  Engine
+  -----------------------------------------------------------------------*/
+template <class Geometry, class Source, class Consumer>
+inline void liblbp_pyr_engine(const Geometry& geom, Source& src, Consumer& consumer)
+{
+  uint32_t cell = 0;
+  for(uint32_t level = 0; level < geom.levels(); level++)
+  {
+    if(level > 0)
+      src.reduce(geom.cols(level-1), geom.rows(level-1));
+
+    const uint32_t ww = geom.cols(level), hh = geom.rows(level);
+    for(uint32_t x = 1; x < ww-1; x++)
+      for(uint32_t y = 1; y < hh-1; y++)
+        consumer(cell++, src.pattern(level, y, x));
+  }
+}
+
+/* Calls body(geometry) with the fixed geometry matching the window, or with
+   a liblbp_dynamic_geometry when there is none. Body has a templated
+   operator() taking the geometry. */
+template <class Body>
+inline void liblbp_geometry_dispatch(uint32_t img_nRows, uint32_t img_nCols, uint32_t nLevels, Body& body)
+{
+#define LIBLBP_GEOMETRY_CASE(H, W, L) \
+  if(img_nRows == H && img_nCols == W && nLevels == L) { body(liblbp_fixed_geometry<H, W, L>()); return; }
+  LIBLBP_FIXED_GEOMETRIES(LIBLBP_GEOMETRY_CASE)
+#undef LIBLBP_GEOMETRY_CASE
+  body(liblbp_dynamic_geometry(img_nRows, img_nCols, nLevels));
+}
+
+#endif
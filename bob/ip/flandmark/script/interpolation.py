@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+# vim: set fileencoding=utf-8 :
+
+"""Measures how far the key-points move when faces are normalized with the
+bilinear or area interpolation instead of the cubic one the models are trained
+with, and how long the localization takes in each mode.
+
+Every face of the test images is located from a grid of bounding boxes around
+its own (shifted by up to a tenth of its size and scaled from 0.8 to 1.4), and
+the key-points of each mode are compared to the cubic ones of the same box.
+For scale, the last row compares the cubic key-points of boxes shifted by one
+pixel: displacements below it are within the jitter of the localizer itself.
+
+Displacements are Euclidean distances, in pixels of the image and in pixels of
+the normalized face frame (the unit of the model).
+"""
+
+import os
+import sys
+import time
+import argparse
+
+import numpy
+import pkg_resources
+
+import bob.io.base
+import bob.io.image
+import bob.ip.color
+
+from .. import Flandmark
+
+MODES = ('cubic', 'bilinear', 'area')
+
+IMAGES = (
+    ('lena.jpg', [(214, 202, 183, 183)]),
+    ('multi.jpg', [(326, 20, 31, 31), (163, 25, 34, 34), (253, 42, 28, 28)]),
+    ) #(x, y, width, height), from OpenCV's cascade detector, as in test.py
+
+def boxes(x, y, width, height):
+  """The grid of (y, x, height, width) boxes around a face"""
+
+  for scale in numpy.arange(0.8, 1.45, 0.1):
+    w, h = int(width * scale), int(height * scale)
+    for dy in range(-2, 3):
+      for dx in range(-2, 3):
+        cx, cy = x + width // 2 + dx * width // 20, y + height // 2 + dy * height // 20
+        yield (cy - h // 2, cx - w // 2, h, w)
+
+def frame_scale(height, width):
+  """Pixels of the image per pixel of the normalized face frame"""
+
+  # the default model extends the box by 20% into a frame of 40x40 pixels
+  return max(height, width) * 1.2 / 40.
+
+def evaluate(gray, faces, model=None, repetitions=3):
+  """Displacements against cubic, in image and frame pixels, and times per
+  localization, for each mode and for the boxes shifted by one pixel"""
+
+  localizers = dict((mode, Flandmark(model=model, interpolation=mode)) for mode in MODES)
+  displacement = dict((mode, []) for mode in MODES[1:] + ('shifted',))
+  frame = dict((mode, []) for mode in displacement)
+  seconds = dict((mode, 0.) for mode in MODES)
+  count = 0
+
+  for face in faces:
+    for (y, x, height, width) in boxes(*face):
+      keypoints, elapsed = {}, {}
+      for mode in MODES:
+        start = time.time()
+        for k in range(repetitions):
+          keypoints[mode] = localizers[mode].locate(gray, y, x, height, width)
+        elapsed[mode] = (time.time() - start) / repetitions
+      keypoints['shifted'] = localizers['cubic'].locate(gray, y+1, x+1, height, width)
+      if any(k is None for k in keypoints.values()): continue #box outside of the image
+      keypoints['shifted'] = keypoints['shifted'] - 1
+      count += 1
+      for mode in MODES:
+        seconds[mode] += elapsed[mode]
+
+      scale = frame_scale(height, width)
+      for mode in displacement:
+        d = numpy.sqrt(((keypoints[mode] - keypoints['cubic'])**2).sum(axis=1))
+        displacement[mode].extend(d)
+        frame[mode].extend(d / scale)
+
+  return count, displacement, frame, seconds
+
+def main(user_input=None):
+
+  parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0],
+      formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('images', nargs='*', help='Images to evaluate on, each followed by the bounding boxes of its faces as x,y,width,height (the bundled lena.jpg and multi.jpg by default)')
+  parser.add_argument('-m', '--model', help='Localization model (the bundled one by default)')
+  parser.add_argument('-r', '--repetitions', type=int, default=3, help='Localizations of every box and mode for the timings (default: %(default)s)')
+  args = parser.parse_args(user_input)
+
+  images = []
+  for arg in args.images:
+    if os.path.exists(arg): images.append((arg, []))
+    elif images: images[-1][1].append(tuple(int(v) for v in arg.split(',')))
+    else: parser.error("`%s' is neither an image nor a bounding box following one" % arg)
+  if not images:
+    images = [(pkg_resources.resource_filename('bob.ip.flandmark', os.path.join('data', f)), faces) for (f, faces) in IMAGES]
+
+  print('%-12s %-9s %6s %12s %12s %12s %10s' % ('image', 'mode', 'boxes', 'mean (px)', 'mean (frame)', 'max (frame)', 'time (ms)'))
+  for (filename, faces) in images:
+    image = bob.io.base.load(filename)
+    gray = bob.ip.color.rgb_to_gray(image) if image.ndim == 3 else image
+    count, displacement, frame, seconds = evaluate(gray, faces, args.model, args.repetitions)
+    name = os.path.basename(filename)
+    for mode in MODES + ('shifted',):
+      if mode == 'cubic':
+        d, f = [0.], [0.]
+      else:
+        d, f = displacement[mode], frame[mode]
+      ms = '%10.3f' % (1000. * seconds[mode] / max(count, 1)) if mode in seconds else '%10s' % '-'
+      print('%-12s %-9s %6d %12.2f %12.2f %12.2f %s' % (name, mode, count, numpy.mean(d), numpy.mean(f), numpy.max(f), ms))
+
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
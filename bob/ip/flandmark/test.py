@@ -171,3 +171,322 @@ def test_multi():
     nose.tools.eq_(keypoints.dtype, 'float64')
     for k in keypoints:
       assert is_inside(k, (y, x, height, width), eps=1)
+
+def test_multi_threaded():
+
+  import threading
+
+  img = bob.io.base.load(MULTI)
+  gray = bob.ip.color.rgb_to_gray(img)
+
+  flm = Flandmark()
+  expected = [flm.locate(gray, y, x, height, width) for (x, y, width, height) in MULTI_BBX]
+
+  errors = []
+  def work():
+    for _ in range(10):
+      for (x, y, width, height), ref in zip(MULTI_BBX, expected):
+        keypoints = flm.locate(gray, y, x, height, width)
+        if not numpy.array_equal(keypoints, ref): errors.append(keypoints)
+
+  threads = [threading.Thread(target=work) for _ in range(4)]
+  for t in threads: t.start()
+  for t in threads: t.join()
+  nose.tools.eq_(len(errors), 0)
+
+def test_single_precision():
+
+  # float32 scores may only move key-points by rounding; the tolerance is one
+  # pixel of the normalized face frame (40x40 with a 20% margin for the default
+  # model, i.e. about 1/33 of the bounding box), checked with some headroom
+  double = Flandmark()
+  single = Flandmark(single_precision=True)
+
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref = double.locate(gray, y, x, height, width)
+      keypoints = single.locate(gray, y, x, height, width)
+      nose.tools.eq_(keypoints.shape, (8, 2))
+      nose.tools.eq_(keypoints.dtype, 'float64')
+      assert numpy.abs(keypoints - ref).max() <= max(height, width) / 20.
+
+def test_quantized():
+
+  # same tolerance as test_single_precision, for fixed point scores
+  double = Flandmark()
+  quantized = Flandmark(quantized=True)
+
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref = double.locate(gray, y, x, height, width)
+      keypoints = quantized.locate(gray, y, x, height, width)
+      nose.tools.eq_(keypoints.shape, (8, 2))
+      assert numpy.abs(keypoints - ref).max() <= max(height, width) / 20.
+
+def test_quantized_file():
+
+  # the saved weights are read back instead of quantizing the model again
+  import shutil
+  import tempfile
+  tmpdir = tempfile.mkdtemp()
+  try:
+    path = os.path.join(tmpdir, 'model.dat')
+    shutil.copyfile(F('flandmark_model.dat'), path)
+    quantized = Flandmark(model=path, quantized=True)
+    quantized.save_quantized()
+    assert os.path.exists(path + '.q16')
+    nose.tools.assert_raises(RuntimeError, Flandmark(model=path).save_quantized)
+
+    reloaded = Flandmark(model=path, quantized=True)
+    for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+      gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+      for (x, y, width, height) in bbxs:
+        ref, ref_score = quantized.locate(gray, y, x, height, width, return_score=True)
+        keypoints, score = reloaded.locate(gray, y, x, height, width, return_score=True)
+        assert numpy.array_equal(keypoints, ref)
+        nose.tools.eq_(score, ref_score)
+
+    # a file that does not match the model is quantized again
+    (x, y, width, height) = LENA_BBX[0]
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(LENA))
+    ref = quantized.locate(gray, y, x, height, width)
+    with open(path + '.q16', 'wb') as f: f.write(b' 12 8 unrelated bytes')
+    assert numpy.array_equal(Flandmark(model=path, quantized=True).locate(gray, y, x, height, width), ref)
+  finally:
+    shutil.rmtree(tmpdir)
+
+def test_score_threshold():
+
+  img = bob.io.base.load(LENA)
+  gray = bob.ip.color.rgb_to_gray(img)
+  (x, y, width, height) = LENA_BBX[0]
+
+  flm = Flandmark()
+  ref = flm.locate(gray, y, x, height, width)
+  keypoints, score = flm.locate(gray, y, x, height, width, return_score=True)
+  assert numpy.array_equal(keypoints, ref)
+
+  # accepted down to its own score, rejected above it with a bound of the score
+  keypoints, accepted = flm.locate(gray, y, x, height, width, threshold=score, return_score=True)
+  assert numpy.array_equal(keypoints, ref)
+  nose.tools.eq_(accepted, score)
+  keypoints, bound = flm.locate(gray, y, x, height, width, threshold=score+1., return_score=True)
+  assert keypoints is None
+  assert bound >= score
+  assert flm.locate(gray, y, x, height, width, threshold=score+1.) is None
+
+  # faces that cannot be located have no score, not the one of the last face
+  keypoints, missing = flm.locate(gray, -500, -500, 100, 100, return_score=True)
+  assert keypoints is None
+  assert numpy.isnan(missing)
+
+def test_score_threshold_rounding():
+
+  # in float and fixed point, thresholds right at the score must accept the
+  # face and thresholds right above it reject it, whatever the rounding of
+  # the scores against the bounds used for early rejection
+  for flm in (Flandmark(single_precision=True), Flandmark(quantized=True)):
+    for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+      gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+      for (x, y, width, height) in bbxs:
+        ref, score = flm.locate(gray, y, x, height, width, return_score=True)
+        below = numpy.nextafter(score, -numpy.inf)
+        above = numpy.nextafter(score, numpy.inf)
+        for threshold in (below, score):
+          keypoints, accepted = flm.locate(gray, y, x, height, width, threshold=threshold, return_score=True)
+          assert numpy.array_equal(keypoints, ref)
+          nose.tools.eq_(accepted, score)
+        keypoints, bound = flm.locate(gray, y, x, height, width, threshold=above, return_score=True)
+        assert keypoints is None
+        assert bound >= score
+
+def test_coarse_to_fine():
+
+  # the coarse-to-fine search maximizes the score over fewer positions, so it
+  # never scores higher than the exhaustive one, and matches it on fallbacks
+  exhaustive = Flandmark()
+  c2f = Flandmark(coarse_to_fine=True)
+  nose.tools.eq_(c2f.coarse_to_fine_stats, (0, 0))
+
+  runs = 0
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref, ref_score = exhaustive.locate(gray, y, x, height, width, return_score=True)
+      fallbacks = c2f.coarse_to_fine_stats[1]
+      keypoints, score = c2f.locate(gray, y, x, height, width, return_score=True)
+      runs += 1
+      nose.tools.eq_(keypoints.shape, (8, 2))
+      assert score <= ref_score
+      if c2f.coarse_to_fine_stats[1] > fallbacks:
+        assert numpy.array_equal(keypoints, ref)
+
+  nose.tools.eq_(c2f.coarse_to_fine_stats[0], runs)
+  assert c2f.coarse_to_fine_stats[1] <= runs
+  nose.tools.eq_(exhaustive.coarse_to_fine_stats, (0, 0))
+
+def test_branch_and_bound():
+
+  # the pruning is exact: same key-points and scores as the exhaustive search
+  exhaustive = Flandmark()
+  bnb = Flandmark(branch_and_bound=True)
+
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref, ref_score = exhaustive.locate(gray, y, x, height, width, return_score=True)
+      keypoints, score = bnb.locate(gray, y, x, height, width, return_score=True)
+      assert numpy.array_equal(keypoints, ref)
+      nose.tools.eq_(score, ref_score)
+
+def test_landmark_subset():
+
+  # the eye corners are solved with the face center only; the others are NaN
+  flm = Flandmark()
+  img = bob.io.base.load(LENA)
+  gray = bob.ip.color.rgb_to_gray(img)
+  (x, y, width, height) = LENA_BBX[0]
+
+  ref = flm.locate(gray, y, x, height, width)
+  nose.tools.eq_(flm.locate(gray, y, x, height, width, landmarks=range(8)).tolist(), ref.tolist())
+
+  keypoints = flm.locate(gray, y, x, height, width, landmarks=[1, 2, 5, 6])
+  nose.tools.eq_(keypoints.shape, (8, 2))
+  assert numpy.isnan(keypoints[[3, 4, 7]]).all()
+  assert not numpy.isnan(keypoints[[0, 1, 2, 5, 6]]).any()
+  eyes = keypoints[[1, 2, 5, 6]]
+  assert (eyes[:,0] >= y).all() and (eyes[:,0] <= y + height).all()
+  assert (eyes[:,1] >= x).all() and (eyes[:,1] <= x + width).all()
+
+  nose.tools.assert_raises(ValueError, flm.locate, gray, y, x, height, width, landmarks=[8])
+
+def test_threads():
+
+  # components and branches scored on worker threads give the same results
+  serial = Flandmark()
+  parallel = Flandmark(threads=2)
+
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref, ref_score = serial.locate(gray, y, x, height, width, return_score=True)
+      keypoints, score = parallel.locate(gray, y, x, height, width, return_score=True)
+      assert numpy.array_equal(keypoints, ref)
+      nose.tools.eq_(score, ref_score)
+
+def test_model_trailing_data():
+
+  # data after the model that is not a topology block is ignored
+  import shutil
+  import tempfile
+  model = F('flandmark_model.dat')
+  gray = bob.ip.color.rgb_to_gray(bob.io.base.load(LENA))
+  (x, y, width, height) = LENA_BBX[0]
+  ref = Flandmark().locate(gray, y, x, height, width)
+
+  tmpdir = tempfile.mkdtemp()
+  try:
+    for trailing in (b'\x00\x01', b'unrelated trailing bytes'):
+      path = os.path.join(tmpdir, 'model.dat')
+      shutil.copyfile(model, path)
+      with open(path, 'ab') as f: f.write(trailing)
+      assert numpy.array_equal(Flandmark(model=path).locate(gray, y, x, height, width), ref)
+  finally:
+    shutil.rmtree(tmpdir)
+
+def test_locate_many():
+
+  # all faces of an image at once; without the pyramid, same as one by one
+  flm = Flandmark()
+  gray = bob.ip.color.rgb_to_gray(bob.io.base.load(MULTI))
+  boxes = [(y, x, height, width) for (x, y, width, height) in MULTI_BBX]
+
+  expected = [flm.locate(gray, *box) for box in boxes]
+  results = flm.locate_many(gray, boxes)
+  nose.tools.eq_(len(results), len(boxes))
+  for keypoints, ref in zip(results, expected):
+    assert numpy.array_equal(keypoints, ref)
+
+  for keypoints, (y, x, height, width) in zip(flm.locate_many(gray, boxes, pyramid=True), boxes):
+    nose.tools.eq_(keypoints.shape, (8, 2))
+    for k in keypoints:
+      assert is_inside(k, (y, x, height, width), eps=1)
+
+  nose.tools.eq_(flm.locate_many(gray, []), ())
+  nose.tools.assert_raises(ValueError, flm.locate_many, gray, [(1, 2, 3)])
+
+def test_locate_many_batch():
+
+  # more faces than are detected side by side, some of them twice, with the
+  # batch engine and with the settings it leaves to the one by one detection
+  gray = bob.ip.color.rgb_to_gray(bob.io.base.load(MULTI))
+  boxes = [(y + d, x - d, height + 2 * d, width + d) for d in (0, 1, 2, 3) for (x, y, width, height) in MULTI_BBX]
+  boxes += boxes[:2]
+
+  for flm in (Flandmark(), Flandmark(interpolation='bilinear'), Flandmark(single_precision=True), Flandmark(coarse_to_fine=True)):
+    expected = [flm.locate(gray, *box) for box in boxes]
+    for keypoints, ref in zip(flm.locate_many(gray, boxes), expected):
+      assert numpy.array_equal(keypoints, ref)
+
+def test_interpolation():
+
+  # the other modes resample the face differently, which moves the key-points
+  # within the jitter of the localizer (see bob_ip_flandmark_interpolation.py);
+  # here they only need to stay on the face
+  cubic = Flandmark()
+  nose.tools.eq_(cubic.interpolation, 'cubic')
+
+  for image, bbxs in ((LENA, LENA_BBX), (MULTI, MULTI_BBX)):
+    gray = bob.ip.color.rgb_to_gray(bob.io.base.load(image))
+    for (x, y, width, height) in bbxs:
+      ref = cubic.locate(gray, y, x, height, width)
+      assert numpy.array_equal(Flandmark(interpolation='cubic').locate(gray, y, x, height, width), ref)
+      for mode in ('bilinear', 'area'):
+        keypoints = Flandmark(interpolation=mode).locate(gray, y, x, height, width)
+        nose.tools.eq_(keypoints.shape, (8, 2))
+        for k in keypoints:
+          assert is_inside(k, (y, x, height, width), eps=1)
+
+  nose.tools.assert_raises(ValueError, Flandmark, interpolation='nearest')
+
+def test_interpolation_enlarging():
+
+  # like cvResize, area resamples boxes smaller than the frame with 2 taps
+  # that replicate every pixel when the frame is a whole multiple of the box:
+  # a 6 px face (extended to 10 px by the margin) then gives the key-points of
+  # the 32 px face (extended to 40 px, the frame) of the image replicated 4x
+  gray = bob.ip.color.rgb_to_gray(bob.io.base.load(MULTI))
+  gray4 = numpy.repeat(numpy.repeat(gray, 4, axis=0), 4, axis=1)
+  y, x = 32, 338
+
+  def frame(keypoints, y, x, size):
+    # key-points in pixels of the 40x40 frame, from the margin of the model
+    origin = numpy.array([y, x]) + size / 2. - 0.6 * (size + 1)
+    return numpy.round((keypoints - origin) * 40. / (1.2 * (size + 1)))
+
+  area = Flandmark(interpolation='area')
+  small = frame(area.locate(gray, y, x, 6, 6), y, x, 6)
+  large = frame(area.locate(gray4, 4*y-4, 4*x-4, 32, 32), 4*y-4, 4*x-4, 32)
+  assert numpy.array_equal(small, large)
+
+def test_views():
+
+  # slices of a larger image are read in place, other views are copied; the
+  # key-points must not depend on how the pixels are laid out in memory
+  flm = Flandmark()
+
+  gray = bob.ip.color.rgb_to_gray(bob.io.base.load(MULTI))
+  h, w = gray.shape
+  padded = numpy.zeros((h + 20, w + 30), dtype=gray.dtype)
+  padded[10:10+h, 20:20+w] = gray
+  strided = numpy.zeros((h, 2 * w), dtype=gray.dtype)
+  strided[:, ::2] = gray
+
+  for (x, y, width, height) in MULTI_BBX:
+    ref = flm.locate(gray, y, x, height, width)
+    assert numpy.array_equal(flm.locate(padded[10:10+h, 20:20+w], y, x, height, width), ref)
+    assert numpy.array_equal(flm.locate(strided[:, ::2], y, x, height, width), ref)
+    assert numpy.array_equal(flm.locate(gray[::-1], h - y - height, x, height, width),
+                             flm.locate(numpy.ascontiguousarray(gray[::-1]), h - y - height, x, height, width))
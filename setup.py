@@ -55,6 +55,8 @@ setup(
       Extension("bob.ip.flandmark._library",
         [
           "bob/ip/flandmark/flandmark_detector.cpp",
+          "bob/ip/flandmark/flandmark_batch.cpp",
+          "bob/ip/flandmark/flandmark_pool.cpp",
           "bob/ip/flandmark/liblbp.cpp",
           "bob/ip/flandmark/flandmark.cpp",
           "bob/ip/flandmark/main.cpp",
@@ -70,6 +72,12 @@ setup(
       'build_ext': build_ext
     },
 
+    entry_points = {
+      'console_scripts': [
+        'bob_ip_flandmark_interpolation.py = bob.ip.flandmark.script.interpolation:main',
+      ],
+    },
+
     classifiers = [
       'Framework :: Bob',
       'Development Status :: 4 - Beta',